@@ -1,10 +1,13 @@
 /*
  *  Main program of the ftp server. Creates a stream socket and
- *  listens on the provided port. Accepts one client at a time.
- *  Continues listening after finishes serving the current client.
- *  And accepts the clients first come being served basis.
+ *  listens on the provided port. Serves many clients at the same
+ *  time from a single event loop (see server.c); every client has its
+ *  own session state (see session.h), including its own working
+ *  directory, and transfers run without blocking the other clients.
  *  Accepted commands are:
- *  USER, QUIT, CWD, CDUP, TYPE, MODE, SRU, RETR, PASV, NLST. 
+ *  USER, QUIT, CWD, CDUP, TYPE, MODE, SRU, RETR, PASV, NLST,
+ *  STOR, APPE, ALLO, REST, SIZE, OPTS, SITE, MLSD, MLST, ABOR, STAT,
+ *  NOOP. ABOR, STAT and NOOP are also served during a transfer.
  *  Notes: 
  *  - The server will respond with 500 to any other commands that
  *    are not listed here. 
@@ -24,7 +27,24 @@
 #include "dir.h"
 #include "usage.h"
 #include "netbuffer.h"
-#include "util.h"
+#include "server.h"
+#include "session.h"
+#include "transfer.h"
+#include "uring.h"
+#include "zmode.h"
+#include "ascii.h"
+#include "filecache.h"
+#include "pattern.h"
+#include "command.h"
+#include "portpool.h"
+#include "log.h"
+#include "trace.h"
+#include "shaper.h"
+#include "sched.h"
+#include "metrics.h"
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <limits.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
@@ -42,238 +62,300 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
-#define BUFFER_SIZE 256
-#define BACKLOG 5     // how many pending connections queue will hold
-#define MAX_LINE_LENGTH 1024 /* Maximum line length for the ftp communication */
-#define MAX_PATH_LENGTH 1024 /* Maximum path length for changing the directory*/
-
-net_buffer_t communicationBuffer; /* The special buffer to be used for the communication with the client */
-char buf[MAX_LINE_LENGTH + 1]; /* Char array buffer to hold lines read from the socket */
-int result_read_line; /* integer to check the result of nb_read_line function */
-int controlcon_file_descriptor = -1; /* file descriptor of the main ftp socket */
-char main_dir[MAX_PATH_LENGTH + 1] = ""; /* path to the main working directory, initialized when handle_client starts */
-int logged_in = 0; /* integer to check if the user has been logged in correctly; if yes 1, 0 otherwise */
-int passive_mode = 0; /* integer to check if the passive mode has been activated */
-int cur_command_num_arg = 0;
-int pasv_init_descriptor = -1; /* file descriptor of the initial pasv call socket */
-int datacon_file_descriptor = -1; /* file descriptor of the passive mode ftp socket */
-char current_command[BUFFER_SIZE] = ""; /* buffer to hold current command */
-char current_command_arg[BUFFER_SIZE] = ""; /* buffer to hold current argument for current command*/
-
-
-static void handle_client(char * port);
+#define MAX_OPEN_FILES 65536 /* file descriptor limit requested for thousands of sessions */
+
+char main_dir[MAX_PATH_LENGTH + 1] = ""; /* path to the main working directory, initialized when the server starts */
+
+
 static void string_to_upper(char * string);
-static void handle_user(char * command_argument);
-static void handle_quit();
-static void handle_cwd(char * command_argument);
-static void handle_cdup();
-static void handle_pasv();
-static void handle_type(char * command_argument);
-static void handle_stru(char * command_argument);
-static void handle_mode(char * command_argument);
-static void handle_retr(char * command_argument);
-static void handle_nlst();
-void replace_line_from_string(char * str);
+static void handle_user(struct session * s, char * command_argument);
+static void handle_quit(struct session * s, char * params);
+static void handle_cwd(struct session * s, char * command_argument);
+static void handle_cdup(struct session * s, char * params);
+static void handle_pasv(struct session * s, char * params);
+static void handle_type(struct session * s, char * command_argument);
+static void handle_stru(struct session * s, char * command_argument);
+static void handle_mode(struct session * s, char * command_argument);
+static void handle_retr(struct session * s, char * command_argument);
+static void handle_nlst(struct session * s, char * params);
+static void handle_mlsd(struct session * s, char * params);
+static void handle_mlst(struct session * s, char * params);
+static void handle_stor(struct session * s, char * command_argument);
+static void handle_appe(struct session * s, char * command_argument);
+static void store_file(struct session * s, char * command_argument, int append);
+static void handle_allo(struct session * s, char * command_argument);
+static void handle_rest(struct session * s, char * command_argument);
+static void handle_size(struct session * s, char * command_argument);
+static void handle_opts(struct session * s, char * params);
+static void handle_site(struct session * s, char * params);
+static void site_rate(struct session * s, char * params);
+static void site_stats(struct session * s);
+static int parse_weights(char * list);
+static void handle_abor(struct session * s, char * params);
+static void handle_stat(struct session * s, char * params);
+static void handle_noop(struct session * s, char * params);
 static int is_using_illegal_cwd(char * path);
-int create_com_socket(const char * port);
-static void *get_in_addr(struct sockaddr *sa);
-int create_data_socket();
-int activate_data_connection();
-void parse_command(char * str);
-void close_data_con_resources();
-void close_resources();
+static void raise_file_limit();
+
+/*
+ *  The commands the server accepts. Arguments are counted as space separated
+ *  words; the handler gets all of them as a single string, or NULL if there
+ *  are none. Commands marked with login are refused until USER succeeded.
+ *  Commands marked with transfer are also run while a transfer is in
+ *  progress; the others wait until it is over.
+ */
+static const struct command commands[] = {
+    /* verb     min  max               login  handler         transfer */
+    { "USER",   1,   1,                0,     handle_user,    0 },
+    { "QUIT",   0,   0,                0,     handle_quit,    0 },
+    { "CWD",    1,   1,                1,     handle_cwd,     0 },
+    { "CDUP",   0,   0,                1,     handle_cdup,    0 },
+    { "PASV",   0,   0,                1,     handle_pasv,    0 },
+    { "TYPE",   1,   1,                1,     handle_type,    0 },
+    { "STRU",   1,   1,                1,     handle_stru,    0 },
+    { "MODE",   1,   1,                1,     handle_mode,    0 },
+    { "RETR",   1,   1,                1,     handle_retr,    0 },
+    { "STOR",   1,   1,                1,     handle_stor,    0 },
+    { "APPE",   1,   1,                1,     handle_appe,    0 },
+    { "ALLO",   1,   3,                1,     handle_allo,    0 },
+    { "REST",   1,   1,                1,     handle_rest,    0 },
+    { "SIZE",   1,   1,                1,     handle_size,    0 },
+    { "OPTS",   1,   COMMAND_ANY_ARGS, 1,     handle_opts,    0 },
+    { "SITE",   1,   COMMAND_ANY_ARGS, 1,     handle_site,    0 },
+    { "NLST",   0,   COMMAND_ANY_ARGS, 1,     handle_nlst,    0 },
+    { "LIST",   0,   COMMAND_ANY_ARGS, 1,     handle_nlst,    0 },
+    { "MLSD",   0,   COMMAND_ANY_ARGS, 1,     handle_mlsd,    0 },
+    { "MLST",   0,   COMMAND_ANY_ARGS, 1,     handle_mlst,    0 },
+    { "ABOR",   0,   0,                1,     handle_abor,    1 },
+    { "STAT",   0,   COMMAND_ANY_ARGS, 1,     handle_stat,    1 },
+    { "NOOP",   0,   0,                0,     handle_noop,    1 },
+};
 
 // Here is an example of how to use the above function. It also shows
 // one how to get the arguments passed on the command line.
 
 int main(int argc, char *argv[])
 {
+    int num_workers = 1;
+    size_t cache_budget = FILECACHE_DEFAULT_BUDGET;
+    long long rates[3] = { 0, 0, 0 }; /* KiB/s of the server, of each user and of each session */
+    struct shaper_rates limits;
+    const char * log_path = NULL;
+    const char * trace_path = NULL;
+    int trace_sampling = 1;
+    int opt;
+    
     // Check the command line arguments
-    if (argc != 2) {
+    while ((opt = getopt(argc, argv, "w:c:m:up:r:W:l:L:T:s:")) != -1) {
+        switch (opt) {
+        case 'l':
+            if ((log_level = log_parse_level(optarg)) == -1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'L':
+            log_path = optarg;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 's':
+            trace_sampling = atoi(optarg);
+            if (trace_sampling < 1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'm':
+            cache_budget = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'u':
+            uring_enabled = 1;
+            break;
+        case 'p':
+            if (sscanf(optarg, "%d-%d", &pasv_port_first, &pasv_port_last) != 2 ||
+                pasv_port_first < 1024 || pasv_port_last > 65535 ||
+                pasv_port_first > pasv_port_last) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lld,%lld,%lld", &rates[0], &rates[1], &rates[2]) < 1 ||
+                rates[0] < 0 || rates[1] < 0 || rates[2] < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'W':
+            if (parse_weights(optarg) == -1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'c':
+            transfer_chunk_size = strtoul(optarg, NULL, 10);
+            if (transfer_chunk_size < MIN_CHUNK_SIZE || transfer_chunk_size > MAX_CHUNK_SIZE) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers == 0)
+                num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+            if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind != argc - 1) {
       usage(argv[0]);
       return -1;
     }
+    // every worker needs at least one port of the range
+    if (pasv_port_first && pasv_port_last - pasv_port_first + 1 < num_workers) {
+        fprintf(stderr, "server: the PASV port range is smaller than the number of workers\n");
+        return -1;
+    }
     
+    // save the starting working directory
+    if (getcwd(main_dir, sizeof(main_dir)) == NULL) {
+        perror("getcwd");
+        return -1;
+    }
     
-    while (1) {
-    
-    handle_client(argv[1]);
-        
+    // broken connections are reported by the send calls instead
+    signal(SIGPIPE, SIG_IGN);
+    if (log_init(log_path) == -1)
+        return -1;
+    if (trace_path && trace_init(trace_path, trace_sampling) == -1)
+        return -1;
+    raise_file_limit();
+    ascii_init();
+    if (command_table_init(commands, sizeof(commands) / sizeof(commands[0])) == -1) {
+        fprintf(stderr, "server: cannot build the command table\n");
+        return -1;
     }
+    if (metrics_init(argv[optind], num_workers, commands, sizeof(commands) / sizeof(commands[0])) == -1)
+        return -1;
+    limits.global  = rates[0] * 1024;
+    limits.user    = rates[1] * 1024;
+    limits.session = rates[2] * 1024;
+    shaper_init(&limits);
+    if (filecache_init(cache_budget) == -1)
+        fprintf(stderr, "server: running without the file cache\n");
+    
+    return server_run(argv[optind], num_workers);
 }
 
 /*
- *  handle_client(port)
- * 
- *  Handles the communication with the client.
- *  Creates a stream socket on port and starts listening for
- *  a client by calling create_com_socket. After the initial
- *  communication with the client, it starts reading the commands
- *  sent by the client and for each command it parses the command
- *  by calling parse_command(), then it calls necessary handlers
- *  for that command.
+ *  raise_file_limit()
+ *
+ *  Every session uses up to three descriptors, so the soft limit on
+ *  open files is raised as far as the hard limit allows.
  */
 static void
-handle_client(port)
-char * port; /* portnumber */
+raise_file_limit()
 {
-    // remember the main connection file descriptor
-    // controlcon_file_descriptor = run_server(port);
-    controlcon_file_descriptor = create_com_socket(port);
-    
-    // save the starting working directory
-    getcwd(main_dir, sizeof(main_dir));
+    struct rlimit limit;
     
-    // start communicating by asking for a username
-    send_string(controlcon_file_descriptor, "220 Welcome. Server is ready. Provide a username. \r\n");
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+        return;
+    if (limit.rlim_cur >= MAX_OPEN_FILES || limit.rlim_cur == limit.rlim_max)
+        return;
+    limit.rlim_cur = limit.rlim_max < MAX_OPEN_FILES ? limit.rlim_max : MAX_OPEN_FILES;
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
 
-    // initialize the communication buffer to be used in sending/receiving data from socket
-    int result;
-    communicationBuffer = nb_create(controlcon_file_descriptor, MAX_LINE_LENGTH + 1);
+/*
+ *  handle_command(s, line)
+ * 
+ *  Handles a single command line received from the client of session s.
+ *  The line is split in place by command_tokenize(), the verb is looked up
+ *  in the command table, and the handler is called once the number of
+ *  arguments and the login state have been checked. Called by the event
+ *  loop for every complete line read on the control connection. The time
+ *  the line took is recorded in the worker's histogram of its verb.
+ */
+void
+handle_command(s, line)
+struct session * s;
+char * line; /* command line, null terminated; a trailing CR is ignored */
+{
+    struct command_line cl;
+    const struct command * c;
+    struct worker_metrics * m = s->worker->metrics;
+    uint64_t start = metrics_now_ns();
     
-    while (1) {
-        
-        // read and process next command
-        result = nb_read_line(communicationBuffer, buf);
-        if (result == -1) { // netbuffer couldn't read; connection error
-            perror("server: error on reading data on control connection.");
-            close_resources();
-            return;
-        }
-        if ( result == 0) { // client left
-            perror("server: client left.");
-            close_resources();
-            return;
-        }
-        
-        // take off the CRLF before parsing the command
-        replace_line_from_string(buf);
-        // parse the command and args
-        parse_command(buf);
-        // for case-insensitive check
-        string_to_upper(current_command);
-        
-        
-        if (!strcmp("USER",current_command)) {
-            if (cur_command_num_arg != 1) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-               handle_user(current_command_arg);
-            }
-            
-            
-        } else if (!strcmp("QUIT",current_command)) {
-            if (cur_command_num_arg != 0) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-                handle_quit();
-                return;
-            }
-            
-            
-        } else if (!strcmp("CWD",current_command)) {
-            if (cur_command_num_arg != 1) { // incorrect call
-               send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-               handle_cwd(current_command_arg);
-            }
-            
-            
-        } else if (!strcmp("CDUP",current_command)) {
-            if (cur_command_num_arg != 1) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-                handle_cdup();
-            }
-            
-        } else if (!strcmp("PASV",current_command)) {
-            if (cur_command_num_arg != 0) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-                handle_pasv();
-            }
-            
-        } else if (!strcmp("TYPE",current_command)) {
-            if (cur_command_num_arg != 1) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-                handle_type(current_command_arg);
-            }
-            
-        } else if (!strcmp("STRU",current_command)) {
-            if (cur_command_num_arg != 1) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-                handle_stru(current_command_arg);
-            }
-            
-        } else if (!strcmp("MODE",current_command)) {
-            if (cur_command_num_arg != 1) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-                handle_mode(current_command_arg);
-            }
-            
-        } else if (!strcmp("RETR",current_command)) {
-            if (cur_command_num_arg != 1) { // incorrect call
-                send_string(controlcon_file_descriptor, "501 Syntax error, verify your input.\r\n");
-            } else {
-                handle_retr(current_command_arg);
-            }
-            
-        } else if (!strcmp("NLST",current_command) || !strcmp("LIST",current_command)) {
-            if (cur_command_num_arg == 1) { // incorrect call
-                send_string(controlcon_file_descriptor,
-                            "502 NLST with arguments not implemented.\r\n");
-            } else if (cur_command_num_arg == 0) {
-                handle_nlst();
-            } else {
-                send_string(controlcon_file_descriptor, "501 Syntax error.\r\n");
-            }
-            
-            
-        } else {
-            send_string(controlcon_file_descriptor, "500 Syntax error, command unrecognized.\r\n");
-        }
+    command_tokenize(line, &cl);
+    s->num_args = cl.num_args;
+    
+    c = command_find(cl.key);
+    if (!c) {
+        session_reply(s, "500 Syntax error, command unrecognized.\r\n");
+    } else if (cl.num_args < c->min_args ||
+               (c->max_args != COMMAND_ANY_ARGS && cl.num_args > c->max_args)) { // incorrect call
+        session_reply(s, "501 Syntax error, verify your input.\r\n");
+    } else if (c->login && !s->logged_in) { // cannot proceed before a authorized login
+        session_reply(s, "530 Not logged in.\r\n");
+    } else {
+        log_msg(LOG_DEBUG, s->id, "command %s", c->name);
+        c->handler(s, cl.num_args ? cl.params : NULL);
     }
+    // unknown verbs share the histogram after the last command
+    histogram_record(&m->verbs[c ? c - commands : metrics->num_verbs - 1],
+                     metrics_now_ns() - start);
+    trace_end(s, s->traced ? start : 0, "command", c ? c->name : "unknown", -1, NULL);
 }
 
 /*
- *  handle_user(command_argument)
+ *  handle_user(s, command_argument)
  *
  *  Handles USER command: only accepted username is cs317 (case insensitive).
  *  sends back the necessary responses to the client after checking username
  */
 static void
-handle_user(command_argument)
+handle_user(s, command_argument)
+struct session * s;
 char * command_argument;
 {
     char * username = "CS317";
     string_to_upper(command_argument); // get the uppercase so check with case-insensitive
     if (!command_argument) {
-        send_string(controlcon_file_descriptor, "530 Incorrect username, not logged in.\r\n");
+        session_reply(s, "530 Incorrect username, not logged in.\r\n");
     } else if (!strcmp(username, command_argument)) {  // username is cs317, correct
-        logged_in = 1; // authorized user logged in
-        send_string(controlcon_file_descriptor, "230 User logged in, proceed.\r\n");
+        s->logged_in = 1; // authorized user logged in
+        s->user_shape = shaper_user_bucket(command_argument);
+        s->weight = sched_user_weight(command_argument);
+        session_reply(s, "230 User logged in, proceed.\r\n");
     } else { // not a valid username
-        send_string(controlcon_file_descriptor, "530 Incorrect username, not logged in.\r\n");
+        session_reply(s, "530 Incorrect username, not logged in.\r\n");
     }
 }
 
 /*
- *  handle_quit()
+ *  handle_quit(s, params)
  *
  *  Handles the QUIT command: closes all the sockets in use
  */
 static void
-handle_quit()
+handle_quit(s, params)
+struct session * s;
+char * params; /* unused */
 {
-    send_string(controlcon_file_descriptor, "221 Bye.\r\n");
-    close_resources();
+    session_reply(s, "221 Bye.\r\n");
+    session_close(s);
 }
 
 /*
- *  handle_cwd(command_argument)
+ *  handle_cwd(s, command_argument)
  *
  *  Handles CWD command
  *
@@ -282,30 +364,28 @@ handle_quit()
  *  from the root directory of the server will not be accepted.
  */
 static void
-handle_cwd(command_argument)
+handle_cwd(s, command_argument)
+struct session * s;
 char * command_argument;
 {
-    if (logged_in) {
-        if(!command_argument) { // syntax error in parameters, it should have given a path
-            send_string(controlcon_file_descriptor, "501 Syntax error, a path is expected.\r\n");
-        } else if (is_using_illegal_cwd(command_argument)) { // check if it is legal according to the note above
-            send_string(controlcon_file_descriptor, "550 Action not permitted.\r\n");
-        } else { // try to change the directory
-            int result = chdir(command_argument);
-            if (!result) {
-                send_string(controlcon_file_descriptor, "250 Directory change has been completed.\r\n");
-            } else if (result == EACCES) {
-                send_string(controlcon_file_descriptor, "550 Action not taken, no permission.\r\n");
-            } else {
-                send_string(controlcon_file_descriptor, "550 No such file or directory.\r\n");
-            }
+    if(!command_argument) { // syntax error in parameters, it should have given a path
+        session_reply(s, "501 Syntax error, a path is expected.\r\n");
+    } else if (is_using_illegal_cwd(command_argument)) { // check if it is legal according to the note above
+        session_reply(s, "550 Action not permitted.\r\n");
+    } else { // try to change the directory
+        int result = session_chdir(s, command_argument);
+        if (!result) {
+            session_reply(s, "250 Directory change has been completed.\r\n");
+        } else if (errno == EACCES) {
+            session_reply(s, "550 Action not taken, no permission.\r\n");
+        } else {
+            session_reply(s, "550 No such file or directory.\r\n");
         }
-    } else // cannot proceed before a authorized login
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+    }
 }
 
 /*
- *  handle_cdup()
+ *  handle_cdup(s, params)
  *
  *  Handles CDUP command
  *
@@ -314,677 +394,883 @@ char * command_argument;
  *  be accepted.
  */
 static void
-handle_cdup()
+handle_cdup(s, params)
+struct session * s;
+char * params; /* unused */
 {
-    if (logged_in) {
-        char cwd[MAX_PATH_LENGTH + 1];
+    if(!strcmp(s->cwd, main_dir)) { // cannot go to the parent of initial starting dir
+        session_reply(s, "550 Action not taken, no permission.\r\n");
         
-        if(getcwd(cwd, sizeof(cwd)) != NULL) {
-            if(!strcmp(cwd, main_dir)) { // cannot go to the parent of initial starting dir
-                send_string(controlcon_file_descriptor, "550 Action not taken, no permission.\r\n");
-                
-            } else {
-                int result = chdir("..");
-                if (!result) { // change has been successful
-                    send_string(controlcon_file_descriptor, "200 Directory has been change to the parent.\r\n");
-                } else if (result == EACCES) { // don't have access
-                    send_string(controlcon_file_descriptor, "550 Action not taken, no permission.\r\n");
-                } else { // some other error occured
-                    send_string(controlcon_file_descriptor, "550 Action cannot be taken.\r\n");
-                }
-            }
-            
-         } else {
-            send_string(controlcon_file_descriptor, "421 Not available, try again later.\r\n");
-         }
-        // not logged in
     } else {
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+        int result = session_chdir(s, "..");
+        if (!result) { // change has been successful
+            session_reply(s, "200 Directory has been change to the parent.\r\n");
+        } else if (errno == EACCES) { // don't have access
+            session_reply(s, "550 Action not taken, no permission.\r\n");
+        } else { // some other error occured
+            session_reply(s, "550 Action cannot be taken.\r\n");
+        }
     }
 }
 
 /*
- *  handle_pasv()
+ *  handle_pasv(s, params)
  *
  *  Handles PASV command by calling a helper function to create
  *  another socket for the data connection. Sending Pasv command will
  *  close the current one and will try to open up a new one.
  */
 static void
-handle_pasv()
+handle_pasv(s, params)
+struct session * s;
+char * params; /* unused */
 {
-    if (logged_in) {
-        if(!passive_mode) {
-        
-            int result = create_data_socket();
-            if (result == -1) {
-                // error occured and the connection info has not been sent
-                send_string(controlcon_file_descriptor,
-                            "421 Service not available, closing control connection.\r\n");
-                close(result);
-                pasv_init_descriptor = - 1;
-                passive_mode = 0;
-            } else {
-                pasv_init_descriptor = result;
-                passive_mode = 1;
-            }
-            
-        } else { // already in passive mode; close the old connection and open a new one
-            pasv_init_descriptor = -1;
-            datacon_file_descriptor = 0;
-            passive_mode = 0;
-            handle_pasv();
-        }
-    } else // cannot proceed before a authorized login
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+    if (s->passive_mode) {
+        // already in passive mode; close the old connection and open a new one
+        close_data_con_resources(s);
+    }
+    
+    if (create_data_socket(s) == -1) {
+        // error occured and the connection info has not been sent
+        session_reply(s, "421 Service not available, closing control connection.\r\n");
+        close_data_con_resources(s);
+    } else {
+        s->passive_mode = 1;
+    }
 }
 
 /*
- *  handle_type(command_argument)
+ *  handle_type(s, command_argument)
  *
  *  Handles TYPE command: changes the binary flag of the server,
- *  sends necessary responses to the client
+ *  sends necessary responses to the client. In ASCII type, files are
+ *  sent with CRLF line endings and stored with LF (see ascii.c).
+ *  Switching to ASCII drops a pending REST, whose offset was a byte
+ *  of the file as stored (see handle_rest).
  *
  *  Note: this implementation only accepts Image & ASCII type
  */
 static void
-handle_type(command_argument)
+handle_type(s, command_argument)
+struct session * s;
 char * command_argument; /* data type that is being requested */
 {
-    if (logged_in) {
-        if ( !strcmp("I", command_argument) ||  !strcmp("A", command_argument)) {
-            send_string(controlcon_file_descriptor, "200 Command okay.\r\n");
-        } else if (!strcmp("L", command_argument) ||
-                   (cur_command_num_arg ==3 && !strcmp("A", command_argument))) {
-            send_string(controlcon_file_descriptor, "504 Not implemented.\r\n");
-        } else {
-            send_string(controlcon_file_descriptor, "501 Syntax error.\r\n");
-        }
-    } else // cannot proceed before a authorized login
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+    if ( !strcmp("I", command_argument) ||  !strcmp("A", command_argument)) {
+        s->type_ascii = !strcmp("A", command_argument);
+        if (s->type_ascii)
+            s->restart_offset = 0;
+        session_reply(s, "200 Command okay.\r\n");
+    } else if (!strcmp("L", command_argument) ||
+               (s->num_args ==3 && !strcmp("A", command_argument))) {
+        session_reply(s, "504 Not implemented.\r\n");
+    } else {
+        session_reply(s, "501 Syntax error.\r\n");
+    }
 }
 
 /*
- *  handle_stru(command_argument)
+ *  handle_stru(s, command_argument)
  *
  *  Handles STRU command: accepts the F (file structure), rejects any other
  *  with 504 not implemented.
  */
 static void
-handle_stru(command_argument)
+handle_stru(s, command_argument)
+struct session * s;
 char * command_argument; /* structure mode that is being requested */
 {
-    if (logged_in) {
-        if ( !strcmp("F", command_argument)) {
-            send_string(controlcon_file_descriptor, "200 Command okay.\r\n");
-        } else {
-            send_string(controlcon_file_descriptor, "504 Not implemented.\r\n");
-        }
-    } else // cannot proceed before a authorized login
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+    if ( !strcmp("F", command_argument)) {
+        session_reply(s, "200 Command okay.\r\n");
+    } else {
+        session_reply(s, "504 Not implemented.\r\n");
+    }
 }
 
 /*
- *  handle_mode(command_argument)
+ *  handle_mode(s, command_argument)
  *
- *  Handles MODE command: accepts the request with S; rejects any other commands
- *  with 504 not implemented.
+ *  Handles MODE command: accepts S (stream) and Z (deflate, see zmode.c);
+ *  rejects any other mode with 504 not implemented.
  */
 static void
-handle_mode(command_argument)
+handle_mode(s, command_argument)
+struct session * s;
 char * command_argument; /* mode that is being requested */
 {
-    if (logged_in) {
-        if ( !strcmp("S", command_argument)) {
-            send_string(controlcon_file_descriptor, "200 Command okay.\r\n");
-        } else {
-            send_string(controlcon_file_descriptor, "504 Not implemented.\r\n");
-        }
-    } else // cannot proceed before a authorized login
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+    string_to_upper(command_argument);
+    if ( !strcmp("S", command_argument)) {
+        s->mode_z = 0;
+        session_reply(s, "200 Command okay.\r\n");
+    } else if ( !strcmp("Z", command_argument)) {
+        s->mode_z = 1;
+        session_reply(s, "200 MODE Z ok.\r\n");
+    } else {
+        session_reply(s, "504 Not implemented.\r\n");
+    }
 }
 
 /*
- *  handle_retr(command_argument)
- *
- *  Handles the RETR command
+ *  handle_retr(s, command_argument)
  *
+ *  Handles the RETR command. The file is sent by the event loop once
+ *  the client opens the data connection; the final reply is sent when
+ *  the transfer completes. If REST was given, the transfer starts at
+ *  that offset. Small files are served from the file cache (see
+ *  filecache.c).
  */
 static void
-handle_retr(command_argument)
+handle_retr(s, command_argument)
+struct session * s;
 char * command_argument; /* path to a file that is being requested */
 {
-    if (logged_in) {
-        // check if it's in passive mode
-        if(!passive_mode) {
-            send_string(controlcon_file_descriptor,
-                        "425 Can't open data connection. Enable passive first\r\n");
-        } else { // can handle the command now
+    // check if it's in passive mode
+    if(!s->passive_mode) {
+        session_reply(s, "425 Can't open data connection. Enable passive first\r\n");
+    } else { // can handle the command now
+        
+        char path[PATH_MAX];
+        struct cache_entry * cached = NULL;
+        uint64_t start = trace_now(s);
+        int file = -1;
+        int rv;
+        
+        // the file must be inside the directory the server was started from
+        rv = session_resolve(s, command_argument, path);
+        
+        // a cached file is sent without opening it
+        if (rv == 0 && (cached = filecache_get(path)) != NULL) {
+            trace_end(s, start, "file", "cache hit", cached->size, path);
+            session_reply(s, "150 File status ok. About to open data connection for file: %s .\r\n",
+                          command_argument);
+            if (s->mode_z && zmode_precompressed_data(path, cached->data, cached->size))
+                s->xfer.z_level = 0;
+            transfer_start_cached(s, cached, s->restart_offset);
             
-            // check access
-            if (access(command_argument, R_OK) == -1) {
-                if (errno == EACCES) {
-                    send_string(controlcon_file_descriptor, "550 No access to the directory.\r\n");
-                } else {
-                   send_string(controlcon_file_descriptor, "550 File not found.\r\n");
-                }
-                // close all the sources and reset variables after error
-                close_data_con_resources();
-                
-                // can access the file; handle retr
+        // check access
+        } else if (rv == -1 ||
+            access(path, R_OK) == -1 ||
+            (file = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+            trace_end(s, start, "file", "open failed", -1, command_argument);
+            if (errno == EACCES) {
+                session_reply(s, "550 No access to the directory.\r\n");
             } else {
-                FILE * file = fopen(command_argument, "r");
-                send_string(controlcon_file_descriptor,
-                            "150 File status ok. About to open data connection for file: %s .\r\n", command_argument);
-                
-                // try to open data connection
-                int socket_result = activate_data_connection();
-                if (socket_result == -2) {
-                    send_string(controlcon_file_descriptor,
-                                "425 No connection was established.\r\n");
-                    // close all the sources and reset variables after error
-                    close_data_con_resources();
-                    return;
-                } else if (socket_result == -1) {
-                    send_string(controlcon_file_descriptor,
-                                "426 Connection failure.\r\n");
-                    // close all the sources and reset variables after error
-                    close_data_con_resources();
-                    
-                } else { // get the new socket fd on success
-                    datacon_file_descriptor = socket_result;
-                }
-                
-                // if here then connection is ready
-                char data_buffer[BUFFER_SIZE * 2];  // data buffer to read and send data
-                int bytes_read;
-                int send_result;
-                
-                memset(&data_buffer, 0, sizeof data_buffer);
-                while((bytes_read = fread(data_buffer, sizeof(char), (BUFFER_SIZE * 2), file)) > 0){
-                    send_result = send_all(datacon_file_descriptor, data_buffer, bytes_read);
-                    
-                    if (send_result == -1) { // error occured while sending
-                        send_string(controlcon_file_descriptor,
-                                    "426 Connection failure.\r\n");
-                        
-                        // close all the sources and reset variables after error
-                        close_data_con_resources();
-                    }
-                }
-                
-                // if here then the data successfully sent
-                close_data_con_resources(); // close all the sources and reset variables after success
-                send_string(controlcon_file_descriptor,
-                            "226 Closing data connection. Requested file action successful.\r\n");
+               session_reply(s, "550 File not found.\r\n");
+            }
+            // close all the sources and reset variables after error
+            close_data_con_resources(s);
+            
+            // can access the file; handle retr
+        } else {
+            trace_end(s, start, "file", "open", -1, path);
+            session_reply(s, "150 File status ok. About to open data connection for file: %s .\r\n",
+                          command_argument);
+            // deflating data that is already compressed only costs CPU
+            if (s->mode_z && zmode_precompressed(path, file))
+                s->xfer.z_level = 0;
+            
+            // small files are kept in memory for the next requests
+            start = trace_now(s);
+            cached = filecache_load(path, file);
+            trace_end(s, start, "file", "cache load", cached ? (long long) cached->size : -1, path);
+            if (cached) {
+                close(file);
+                transfer_start_cached(s, cached, s->restart_offset);
+            } else {
+                transfer_start_file(s, file, s->restart_offset);
             }
         }
-    } else // cannot proceed before a authorized login
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+        s->restart_offset = 0;
+    }
 }
 
 /*
- *  handle_nlst()
+ *  handle_stor(s, command_argument) and handle_appe(s, command_argument)
  *
- *  Handles NLST command: sends the list of the files in the directory from an already
- *  established data connection by the client.
- *
- *  Note: this program doesn't implement NLST version that requires an argument.
+ *  Handles the STOR and APPE commands. STOR replaces the file, APPE adds
+ *  the received data to its end; both create the file if needed. After
+ *  REST, STOR keeps the file and writes the data from that offset. If
+ *  the client announced the size with ALLO, the space is reserved
+ *  before the data arrives. The final reply is sent when the client
+ *  closes the data connection.
  */
 static void
-handle_nlst()
+handle_stor(s, command_argument)
+struct session * s;
+char * command_argument; /* path to the file that is being stored */
 {
-    if (logged_in) {
-        if (passive_mode) {
-            
-            char current_dir[MAX_PATH_LENGTH + 1];
-            getcwd(current_dir, sizeof(current_dir));
-            
-            // check access
-            if (access(current_dir, R_OK) != 0) {
-                send_string(controlcon_file_descriptor, "550 No access to the directory.\r\n");
-                // close all the sources and reset variables after error
-                close_data_con_resources();
-                return;
-            }
-            
-            // try to open the data connection
-            send_string(controlcon_file_descriptor,
-                        "150 Directory status ok. About to open data connection.\r\n");
-            int socket_result = activate_data_connection();
-            if (socket_result == -2) {
-                send_string(controlcon_file_descriptor,
-                            "425 No connection was established.\r\n");
-                // close all the sources and reset variables after error
-                close_data_con_resources();
-                return;
-                
-            } else if (socket_result == -1) {
-                send_string(controlcon_file_descriptor,
-                            "426 Connection failure.\r\n");
-                // close all the sources and reset variables after error
-                close_data_con_resources();
-                return;
-                
-            } else {  // get the new descriptor on success
-                datacon_file_descriptor = socket_result;
-            }
-            
-            
-            // connection ready; try to send the dir list.
-            int result = listFiles(datacon_file_descriptor, current_dir);
-            if (!result) { // no permission to access the directory
-                // close all the sources and reset variables after error
-                close_data_con_resources();
-                send_string(controlcon_file_descriptor, "451 Cannot read the directory.\r\n");
+    store_file(s, command_argument, 0);
+}
+
+static void
+handle_appe(s, command_argument)
+struct session * s;
+char * command_argument; /* path to the file that is being appended to */
+{
+    store_file(s, command_argument, 1);
+}
+
+static void
+store_file(s, command_argument, append)
+struct session * s;
+char * command_argument; /* path to the file that is being stored */
+int append; /* 1 for APPE, 0 for STOR */
+{
+    // check if it's in passive mode
+    if(!s->passive_mode) {
+        session_reply(s, "425 Can't open data connection. Enable passive first\r\n");
+    } else { // can handle the command now
+        
+        char path[MAX_PATH_LENGTH + BUFFER_SIZE];
+        int file = -1;
+        struct stat st;
+        off_t restart = s->restart_offset;
+        uint64_t start = trace_now(s);
+        
+        s->restart_offset = 0;
+        
+        if (session_path(s, command_argument, path, sizeof(path)) == -1 ||
+            session_check_new_file(path) == -1 ||
+            (file = open(path, O_WRONLY | O_CREAT | (append || restart ? 0 : O_TRUNC) | O_CLOEXEC,
+                         0644)) == -1 ||
+            fstat(file, &st) == -1 || !S_ISREG(st.st_mode)) {
+            trace_end(s, start, "file", "open failed", -1, command_argument);
+            if (errno == EACCES) {
+                session_reply(s, "550 No access to the directory.\r\n");
             } else {
-                // close all the sources and reset variables after success
-                close_data_con_resources();
-                send_string(controlcon_file_descriptor,
-                            "226 Closing data connection. Requested file action successful.\r\n");
+                session_reply(s, "553 Requested action not taken. File name not allowed.\r\n");
             }
-        } else {
-            send_string(controlcon_file_descriptor,
-                        "425 Cannot open data connection. Must open a passive connection first.\r\n");
-          }
-    }else // cannot proceed before a authorized login
-        send_string(controlcon_file_descriptor, "530 Not logged in.\r\n");
+            if (file != -1)
+                close(file);
+            // close all the sources and reset variables after error
+            close_data_con_resources(s);
+            s->alloc_size = 0;
+            return;
+        }
+        
+        off_t offset = append ? st.st_size : restart;
+        trace_end(s, start, "file", "open", st.st_size, path);
+        
+        // reserve the announced space up front so the file is not fragmented
+        if (s->alloc_size > 0 &&
+            fallocate(file, FALLOC_FL_KEEP_SIZE, offset, s->alloc_size) == 0)
+            s->xfer.preallocated = 1;
+        s->alloc_size = 0;
+        
+        session_reply(s, "150 File status ok. About to open data connection for file: %s .\r\n",
+                      command_argument);
+        transfer_start_receive(s, file, offset);
+    }
 }
 
 /*
- *  is_using_illegal_cwd(path)
+ *  handle_allo(s, command_argument)
  *
- *  Returns 1 if path starts with "./", ".", "../". ".."
- *  or contains "../" in it or if path is absolute(starts with /) and doesn't start
- *  from the root directory of the server. Returns 0 otherwise.
+ *  Handles the ALLO command: remembers how many bytes the next STOR or
+ *  APPE will send, so the file can be preallocated.
  */
-static int /* TRUE OR FALSE */
-is_using_illegal_cwd(path)
-char * path;
+static void
+handle_allo(s, command_argument)
+struct session * s;
+char * command_argument; /* number of bytes to reserve */
 {
-    if (path[0] == '.' && path[1] == '/') return 1; // path starts with ./
-    if (path[0] == '.' && path[1] == '.' && path[2] == '/') return 1; // path starts with ../
-    if (!strcmp(".", path)) return 1;  // path is .
-    if (!strcmp("..", path)) return 1; // path is ..
-    
-    
-    char * dir_changer = "../";
-    char * result = strstr(path, dir_changer);
-    if(!result) return 0; // path contains ../
+    char * end;
+    long long size = strtoll(command_argument, &end, 10);
     
+    // the optional "R <record size>" does not matter for files
+    if ((*end != '\0' && *end != ' ') || size < 0) {
+        session_reply(s, "501 Syntax error in parameters.\r\n");
+    } else {
+        s->alloc_size = size;
+        session_reply(s, "200 Command okay.\r\n");
+    }
+}
+
+/*
+ *  handle_rest(s, command_argument)
+ *
+ *  Handles the REST command (RFC 3659 stream mode restart): the next
+ *  RETR or STOR starts at the given byte offset instead of 0. Offsets
+ *  are bytes of the file as stored, which in TYPE A are not the bytes
+ *  sent (every LF goes out as CRLF), so only REST 0 is taken there.
+ */
+static void
+handle_rest(s, command_argument)
+struct session * s;
+char * command_argument; /* offset to restart at */
+{
+    char * end;
+    long long offset = strtoll(command_argument, &end, 10);
     
-    if (path[0] == '/') {  // if the path is absolute then it should start with the server's root
-        size_t len_main = strlen(main_dir);
-        size_t len_path = strlen(path);
-        
-        int check = len_main > len_path ? 0 : strncmp(main_dir, path, len_main) == 0;
-        if(!check) return 0;  // path is absolute but doesn't start with main_dir
+    if (*end != '\0' || offset < 0) {
+        session_reply(s, "501 Syntax error in parameters.\r\n");
+    } else if (s->type_ascii && offset > 0) {
+        session_reply(s, "550 REST not allowed in ASCII mode, use TYPE I.\r\n");
+    } else {
+        s->restart_offset = offset;
+        session_reply(s, "350 Restarting at %lld. Send STORE or RETRIEVE.\r\n", offset);
     }
+}
+
+/*
+ *  handle_size(s, command_argument)
+ *
+ *  Handles the SIZE command (RFC 3659): replies with the size of a
+ *  regular file, so clients can tell where to restart a transfer. The
+ *  size is the number of bytes RETR sends in the current TYPE, which in
+ *  TYPE A is not known without reading the whole file, so SIZE is
+ *  refused there, as a REST other than 0 is.
+ */
+static void
+handle_size(s, command_argument)
+struct session * s;
+char * command_argument; /* path to the file */
+{
+    char path[PATH_MAX];
+    uint64_t start = trace_now(s);
+    struct stat st;
+    int rv;
     
+    if (s->type_ascii) {
+        session_reply(s, "550 SIZE not allowed in ASCII mode, use TYPE I.\r\n");
+        return;
+    }
     
-    return 1;
+    // like RETR, only files inside the directory the server was started from
+    rv = session_resolve(s, command_argument, path) == -1 ||
+         stat(path, &st) == -1 || !S_ISREG(st.st_mode);
+    trace_end(s, start, "file", "stat", rv ? -1 : (long long) st.st_size, command_argument);
+    if (rv) {
+        session_reply(s, "550 File not found.\r\n");
+    } else {
+        session_reply(s, "213 %lld\r\n", (long long) st.st_size);
+    }
 }
 
 /*
- *  replace_line_from_string(str)
+ *  handle_opts(s, params)
  *
- *  Replaces the first \n or \r with \0, returns rightaway if str is NULL.
+ *  Handles the OPTS command. The options supported are
+ *  OPTS MODE Z LEVEL <0-9>, which sets the deflate level used in MODE Z
+ *  (OPTS MODE Z alone reports the current level), and
+ *  OPTS MLST <fact>;<fact>;..., which selects the facts of MLSD and MLST.
  */
-void replace_line_from_string(str)
-char *str; /* String to be manipulated: change the first \n or \r with \0 */
+static void
+handle_opts(s, params)
+struct session * s;
+char * params; /* everything after the OPTS verb */
 {
-    if(!str) return;
-    int i = 0;
-    int len = strlen(str)+1;
+    char command[BUFFER_SIZE], mode[BUFFER_SIZE], option[BUFFER_SIZE];
+    int level;
+    int n = sscanf(params, "%255s %255s %255s %d", command, mode, option, &level);
     
-    for(i=0; i<len; i++)
-    {
-        if(str[i] == '\r' || str[i] == '\n')
-        {
-            str[i] = '\0';
-            break;
+    if (n >= 1 && !strcasecmp("MLST", command)) {
+        struct strbuf names;
+        
+        // an empty list turns all the facts off
+        s->mlst_facts = mlsx_parse_facts(n >= 2 ? mode : "");
+        sb_init(&names);
+        mlsx_format_facts(&names, s->mlst_facts);
+        session_reply(s, "200 MLST OPTS %.*s\r\n", (int) sb_pending(&names), sb_head(&names));
+        sb_free(&names);
+    } else if (n >= 2 && !strcasecmp("MODE", command) && !strcasecmp("Z", mode)) {
+        if (n == 2) {
+            session_reply(s, "200 MODE Z LEVEL %d\r\n", s->z_level);
+        } else if (n == 4 && !strcasecmp("LEVEL", option) && level >= 0 && level <= 9) {
+            s->z_level = level;
+            session_reply(s, "200 MODE Z LEVEL set to %d.\r\n", level);
+        } else {
+            session_reply(s, "501 Syntax error in parameters.\r\n");
         }
+    } else {
+        session_reply(s, "501 Option not understood.\r\n");
     }
 }
 
-
-
 /*
- *  get_arg_number(str)
- *
- *  Parses the string, gets the command verb(if any) and puts it on current_command,
- *  gets the argument (if any) and puts it on current_command_arg, and counts the
- *  number of arguments and puts it in current_command_num_arg.
+ *  site_rate(s, params)
  *
- *  Note: the str must be null ended string
+ *  Handles SITE RATE: without arguments, reports the limits of the data
+ *  sent by the server, the user and the session, in KiB/s (0 for none).
+ *  "SITE RATE GLOBAL|USER|SESSION <KiB/s>" changes one of them; the
+ *  transfers in progress follow the new limit right away.
  */
-void
-parse_command(str)
-char *str; /* null ended command line string */
+static void
+site_rate(s, params)
+struct session * s;
+char * params; /* the arguments after RATE, or "" */
 {
-    cur_command_num_arg = 0;
-    strcpy(current_command, "");
-    strcpy(current_command_arg, "");
+    struct shaper_rates rates;
+    char level[16];
+    long long rate;
+    char * end;
     
-    if (!str) {
+    if (!params[0]) {
+        shaper_get_rates(s->user_shape, &rates);
+        session_reply(s, "211-Rate limits (KiB/s, 0 for none):\r\n"
+                      " global %lld\r\n user %lld\r\n session %lld\r\n"
+                      "211 End.\r\n",
+                      rates.global / 1024, rates.user / 1024, s->shape.rate / 1024);
         return;
     }
-
-    // get the command
-    char * command = strtok(str, " ");
-    if(command) {
-        strcpy(current_command, command);
-    }
     
-    // get the argument
-    char * argument = strtok(NULL, " ");
-    if(argument) {
-        strcpy(current_command_arg, argument);
-        
+    if (sscanf(params, "%15s", level) != 1) {
+        session_reply(s, "501 SITE command not understood.\r\n");
+        return;
     }
-    
-    // count the number of arguments
-    while(argument != NULL){
-        argument = strtok(NULL, " ");
-        cur_command_num_arg ++;
+    params += strlen(level);
+    params += strspn(params, " ");
+    rate = strtoll(params, &end, 10);
+    if (end == params || *end || rate < 0) {
+        session_reply(s, "501 Rate must be a number of KiB/s.\r\n");
+        return;
     }
+    rate *= 1024;
     
+    if (!strcasecmp("GLOBAL", level)) {
+        shaper_set_global_rate(rate);
+    } else if (!strcasecmp("USER", level) && s->user_shape) {
+        shaper_set_rate(s->user_shape, rate);
+    } else if (!strcasecmp("SESSION", level)) {
+        shaper_set_rate(&s->shape, rate);
+    } else {
+        session_reply(s, "501 SITE command not understood.\r\n");
+        return;
+    }
+    session_reply(s, "200 Rate limit changed.\r\n");
 }
 
 /*
- *  string_to_upper(string)
+ *  site_stats(s)
  *
- *  Converts the string into uppercase
+ *  Handles SITE STATS: reports the counters of every worker added up and,
+ *  for every verb that was used, how many lines had it and the 50th, 90th
+ *  and 99th percentiles and the maximum of the time they took, in
+ *  microseconds. The same metrics are published for postoffice-top.
  */
 static void
-string_to_upper(string)
-char * string; /* pointer to null ending string */
+site_stats(s)
+struct session * s;
 {
-    if(!string) return;
-    char * s = string;
-    while(*s){
-        *s = toupper((unsigned char) *s);
-        s++;
+    struct metrics_totals t;
+    struct filecache_stats st;
+    struct histogram h;
+    unsigned long long lookups;
+    int v;
+    
+    metrics_sum(metrics, &t);
+    filecache_get_stats(&st);
+    lookups = st.hits + st.misses;
+    session_reply(s, "211-Server statistics:\r\n"
+                  " uptime %lld s, %d workers\r\n"
+                  " sessions %llu open, %llu total\r\n"
+                  " transfers %llu running, %llu total\r\n"
+                  " bytes %llu sent, %llu received\r\n"
+                  " cache %llu hits, %llu misses, %.1f%% hit rate\r\n",
+                  (long long) (time(NULL) - metrics->started), metrics->num_workers,
+                  (unsigned long long) t.sessions, (unsigned long long) t.sessions_total,
+                  (unsigned long long) t.transfers, (unsigned long long) t.transfers_total,
+                  (unsigned long long) t.bytes_sent, (unsigned long long) t.bytes_received,
+                  st.hits, st.misses, lookups ? 100.0 * st.hits / lookups : 0.0);
+    session_reply(s, " log records %llu dropped\r\n", (unsigned long long) log_dropped());
+    if (trace_every)
+        session_reply(s, " trace of one session in %d, %llu spans dropped\r\n", trace_every,
+                      (unsigned long long) trace_dropped());
+    if (t.pasv_ports)
+        session_reply(s, " pasv ports %llu of %llu in use, %llu refused\r\n",
+                      (unsigned long long) t.pasv_in_use, (unsigned long long) t.pasv_ports,
+                      (unsigned long long) t.pasv_refused);
+    session_reply(s, " %-6s %10s %10s %10s %10s %10s\r\n",
+                  "verb", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (v = 0; v < metrics->num_verbs; v++) {
+        metrics_verb(metrics, v, &h);
+        if (!h.count)
+            continue;
+        session_reply(s, " %-6s %10llu %10.1f %10.1f %10.1f %10.1f\r\n",
+                      metrics->verbs[v], (unsigned long long) h.count,
+                      histogram_percentile(&h, 50) / 1000.0,
+                      histogram_percentile(&h, 90) / 1000.0,
+                      histogram_percentile(&h, 99) / 1000.0, h.max / 1000.0);
     }
+    session_reply(s, "211 End.\r\n");
 }
 
-
-/** Creates a server socket at the specified port number for the ftp
- *  communication, listens for new connections and accepts them.
+/*
+ *  parse_weights(list)
  *
- *  Parameters: port: String corresponding to the port number (or
- *                    name) where the server will listen for new
- *                    connections.
+ *  Sets the weights of the transfers of users from the argument of -W,
+ *  a list of user=weight separated by commas.
  *
+ *  Returns 0 on success, -1 if the list is not valid.
  */
-int
-create_com_socket(port)
-const char * port;
+static int
+parse_weights(list)
+char * list;
 {
+    char * saveptr;
+    char * item;
+    char * end;
+    long weight;
     
-    int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
-    struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    struct sigaction sa;
-    int yes = 1;
-    char s[INET6_ADDRSTRLEN];
-    int rv;
-    
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family   = AF_INET;   // use IPv4 - can update to include ipv6 with AF_UNSPEC
-    hints.ai_socktype = SOCK_STREAM; // create a stream (TCP) socket server
-    hints.ai_flags    = AI_PASSIVE;  // use any available connection
-    
-    // Gets information about available socket types and protocols
-    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "control con getaddrinfo: %s\n", gai_strerror(rv));
-        exit(1);
+    for (item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char * eq = strchr(item, '=');
+        if (!eq || eq == item)
+            return -1;
+        *eq = '\0';
+        weight = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || *end || sched_set_user_weight(item, weight) == -1)
+            return -1;
     }
-    
-    // loop through all the results and bind to the first we can
-    for(p = servinfo; p != NULL; p = p->ai_next) {
+    return 0;
+}
+
+/*
+ *  handle_site(s, params)
+ *
+ *  Handles the SITE command. SITE CACHE reports the counters of the
+ *  file cache, SITE STATS the metrics of the server (see metrics.c),
+ *  SITE RATE shows or changes the rate limits, and
+ *  SITE WEIGHT shows or changes the share of the bandwidth the
+ *  session's transfers get when the server is busy (see sched.c).
+ */
+static void
+handle_site(s, params)
+struct session * s;
+char * params; /* everything after the SITE verb */
+{
+    if (!strncasecmp("RATE", params, 4) && (params[4] == ' ' || !params[4])) {
+        site_rate(s, params + 4 + strspn(params + 4, " "));
+    } else if (!strncasecmp("WEIGHT", params, 6) && (params[6] == ' ' || !params[6])) {
+        char * arg = params + 6 + strspn(params + 6, " ");
+        char * end;
+        long weight = strtol(arg, &end, 10);
         
-        // create socket object
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("control connection: socket");
-            continue;
+        if (!arg[0]) {
+            session_reply(s, "200 Transfer weight %d.\r\n", s->weight);
+        } else if (*end || weight < 1 || weight > SCHED_MAX_WEIGHT) {
+            session_reply(s, "501 Weight must be between 1 and %d.\r\n", SCHED_MAX_WEIGHT);
+        } else {
+            s->weight = weight;
+            session_reply(s, "200 Transfer weight changed.\r\n");
         }
+    } else if (!strcasecmp("STATS", params)) {
+        site_stats(s);
+    } else if (!strcasecmp("CACHE", params)) {
+        struct filecache_stats st;
+        
+        filecache_get_stats(&st);
+        session_reply(s, "211-File cache:\r\n"
+                      " hits %llu\r\n misses %llu\r\n evictions %llu\r\n invalidations %llu\r\n"
+                      " entries %zu\r\n bytes %zu of %zu\r\n"
+                      "211 End.\r\n",
+                      st.hits, st.misses, st.evictions, st.invalidations,
+                      st.entries, st.bytes, st.budget);
+    } else {
+        session_reply(s, "501 SITE command not understood.\r\n");
+    }
+}
+
+/*
+ *  handle_nlst(s, params)
+ *
+ *  Handles NLST and LIST commands: sends the list of the files in a directory from an already
+ *  established data connection by the client. Without an argument the working directory is
+ *  listed. The argument can name a directory, a file, or files matching a shell pattern in
+ *  the last component of the path ("*.csv", "logs/2026-*"). Options such as "-la", which
+ *  many clients send with LIST, are ignored.
+ */
+static void
+handle_nlst(s, params)
+struct session * s;
+char * params; /* the path or pattern to list, or NULL */
+{
+    if (s->passive_mode) {
+        char path[PATH_MAX];
+        struct pattern * match = NULL;
+        struct stat st;
+        uint64_t start;
+        int rv;
         
-        // specify that, once the program finishes, the port can be reused by other processes
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-            perror("control con setsockopt");
-            exit(1);
+        // skip the ls style options some clients send
+        while (params && params[0] == '-') {
+            params += strcspn(params, " ");
+            params += strspn(params, " ");
         }
+        if (params && !params[0])
+            params = NULL;
         
-        // bind to the specified port number
-        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            if (sockfd != 0)
-                close(sockfd);
-            perror("control connection: bind");
-            continue;
+        if (!params) {
+            // check access
+            if (access(s->cwd, R_OK) != 0) {
+                session_reply(s, "550 No access to the directory.\r\n");
+                // close all the sources and reset variables after error
+                close_data_con_resources(s);
+                return;
+            }
+            
+            // listings are rendered once and then served from the file cache
+            struct cache_entry * cached;
+            
+            start = trace_now(s);
+            cached = filecache_get_listing(s->cwd);
+            if (!cached)
+                cached = filecache_load_listing(s->cwd, renderFiles);
+            trace_end(s, start, "listing", "cached listing", cached ? (long long) cached->size : -1,
+                      s->cwd);
+            if (cached) {
+                session_reply(s, "150 Directory status ok. About to open data connection.\r\n");
+                transfer_start_cached(s, cached, 0);
+                return;
+            }
+            strcpy(path, s->cwd);
+        } else if (!pattern_has_magic(params) && session_resolve(s, params, path) == -1) {
+            session_reply(s, "550 File not found.\r\n");
+            close_data_con_resources(s);
+            return;
+        } else if (pattern_has_magic(params) || stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+            // the last component is matched against the entries of its directory,
+            // while a directory is listed whole
+            char * slash = strrchr(params, '/');
+            char * base = slash ? slash + 1 : params;
+            char dir_name[PATH_MAX];
+            
+            if (snprintf(dir_name, sizeof(dir_name), "%.*s",
+                         slash == params ? 1 : (int) (base - params), params) >= (int) sizeof(dir_name)) {
+                session_reply(s, "501 Syntax error, the path is too long.\r\n");
+                close_data_con_resources(s);
+                return;
+            }
+            if (pattern_has_magic(dir_name)) {
+                session_reply(s, "501 Wildcards are only supported in the last path component.\r\n");
+                close_data_con_resources(s);
+                return;
+            }
+            if (session_resolve(s, slash ? dir_name : s->cwd, path) == -1 || !base[0]) {
+                session_reply(s, "550 No access to the directory.\r\n");
+                close_data_con_resources(s);
+                return;
+            }
+            if (!(match = pattern_compile(base))) {
+                session_reply(s, "451 Requested action aborted. Local error in processing.\r\n");
+                close_data_con_resources(s);
+                return;
+            }
         }
         
-        // if the code reaches this point, the socket was properly created and bound
-        break;
-    }
-    
-    // all done with this structure
-    freeaddrinfo(servinfo);
-    
-    // if p is null, the loop above could create a socket for any given address
-    if (p == NULL)  {
-        fprintf(stderr, "control connection: failed to bind\n");
-        exit(1);
-    }
-    
-    // sets up a queue of incoming connections to be received by the server
-    if (listen(sockfd, BACKLOG) == -1) {
-        perror("control connection listen");
-        exit(1);
-    }
-    
-    
-    printf("server: waiting for connections...\n");
-    
-    //while(1) {
-    // wait for new client to connect
-    sin_size = sizeof(their_addr);
-    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-    if (new_fd == -1) {
-        perror("accept");
-        // continue;
-    }
-    
-    
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-              s, sizeof(s));
-    
-    printf("server: got connection from %s\n", s);
-    close(sockfd);
-    return new_fd;
-    
+        // the listing is rendered while it is sent
+        start = trace_now(s);
+        rv = dir_open(&s->xfer.dir, path);
+        trace_end(s, start, "listing", "open directory", -1, path);
+        if (rv < 0) {
+            pattern_free(match);
+            if (rv == -2)
+                session_reply(s, "451 Cannot read the directory.\r\n");
+            else
+                session_reply(s, "550 No access to the directory.\r\n");
+            close_data_con_resources(s);
+            return;
+        }
+        s->xfer.dir.match = match;
+        
+        session_reply(s, "150 Directory status ok. About to open data connection.\r\n");
+        transfer_start_listing(s, 0, 0);
+    } else {
+        session_reply(s, "425 Cannot open data connection. Must open a passive connection first.\r\n");
+      }
 }
 
-
-/** Returns the IPv4 or IPv6 object for a socket address, depending on
- *  the family specified in that address.
+/*
+ *  handle_mlsd(s, params)
+ *
+ *  Handles MLSD command: sends the facts of every file of the directory
+ *  (the working directory if there is no argument) on an already
+ *  established data connection, in the format of RFC 3659. The listing
+ *  is rendered while it is sent, so directories of any size are listed
+ *  with little memory.
  */
 static void
-*get_in_addr(sa)
-struct sockaddr *sa;
+handle_mlsd(s, params)
+struct session * s;
+char * params; /* the directory to list, or NULL */
 {
-    if (sa->sa_family == AF_INET)
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    else
-        return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    if (s->passive_mode) {
+        char path[PATH_MAX];
+        uint64_t start;
+        int rv;
+        
+        if (session_resolve(s, params ? params : s->cwd, path) == -1) {
+            session_reply(s, "550 No access to the directory.\r\n");
+            close_data_con_resources(s);
+            return;
+        }
+        
+        start = trace_now(s);
+        rv = dir_open(&s->xfer.dir, path);
+        trace_end(s, start, "listing", "open directory", -1, path);
+        if (rv < 0) {
+            if (rv == -2)
+                session_reply(s, "451 Cannot read the directory.\r\n");
+            else if (errno == ENOTDIR)
+                session_reply(s, "501 Not a directory.\r\n");
+            else
+                session_reply(s, "550 No access to the directory.\r\n");
+            close_data_con_resources(s);
+            return;
+        }
+        
+        session_reply(s, "150 Directory status ok. About to open data connection.\r\n");
+        transfer_start_listing(s, 1, s->mlst_facts);
+    } else {
+        session_reply(s, "425 Cannot open data connection. Must open a passive connection first.\r\n");
+    }
 }
 
 /*
- *  create_data_socket()
+ *  handle_mlst(s, params)
  *
- *  Creates a socket for the data communication with an available port, returns
- *  the initial file descriptor before starting to listen on the socket
+ *  Handles MLST command: replies on the control connection with the
+ *  facts of a single file (the working directory if there is no
+ *  argument), in the format of RFC 3659.
  */
-int
-create_data_socket()
+static void
+handle_mlst(s, params)
+struct session * s;
+char * params; /* the file to describe, or NULL */
 {
+    char * name = params ? params : s->cwd;
+    char path[PATH_MAX];
+    struct strbuf line;
     
-    // create the data structures to create and initialize the socket
-    int sockfd, new_fd; // listen on sock_fd, new connection on new_fd
-    struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    struct sockaddr_in data_sock_addr;
-    socklen_t sin_size;
-    struct sigaction sa;
-    int yes = 1;
-    char s[INET6_ADDRSTRLEN];
-    int rv;
-    
-    
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("datasocket: socket");
-        return -1;
-    }
-    
-    memset(&data_sock_addr, 0, sizeof data_sock_addr);
-    data_sock_addr.sin_family = AF_INET;  // use ipv4
-    data_sock_addr.sin_port = 0;  // to get a random available dynamic port
-    data_sock_addr.sin_addr.s_addr = INADDR_ANY;
-    
-    // specify that, once the program finishes, the port can be reused by other processes
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-        perror("datasocket: setsockopt");
-        return -1;
+    sb_init(&line);
+    if (session_resolve(s, name, path) == -1 ||
+        mlst_render(&line, s->mlst_facts, path, name) < 0) {
+        session_reply(s, "550 File not found.\r\n");
+    } else {
+        session_reply(s, "250-Listing %s\r\n%.*s250 End.\r\n", name,
+                      (int) sb_pending(&line), sb_head(&line));
     }
-    
-    // bind to the specified port number
-    if (bind(sockfd, (struct sockaddr *) &data_sock_addr, sizeof(data_sock_addr)) == -1) {
-        if (sockfd != 0)
-            close(sockfd);
-        perror("server: bind");
-        return -1; // if the port is already in use, this function must be called with
-                  // a new port number;
-     }
-    
-    // provide ip and port information to the client
-    
-    // get the ip information from the control connection socket
-    struct sockaddr my_addr;
-    socklen_t addrlen = sizeof(my_addr);
-    int res = getsockname(controlcon_file_descriptor, &my_addr, &addrlen);
-    if (res == -1) return -1;
-    
-    // decode ip
-    struct sockaddr_in *socket_info = (struct sockaddr_in *) &my_addr;
-    struct in_addr * ipv4 = &socket_info->sin_addr;
-    unsigned char * ip = (unsigned char *) ipv4;
-    unsigned int h1 = (unsigned int) ip[0];
-    unsigned int h2 = (unsigned int) ip[1];
-    unsigned int h3 = (unsigned int) ip[2];
-    unsigned int h4 = (unsigned int) ip[3];
-    
-    // get the port information after bind to data connection sockt
-    struct sockaddr my_addr_port;
-    addrlen = sizeof(my_addr_port);
-    res = getsockname(sockfd, &my_addr_port, &addrlen);
-    if (res == -1) return -1;
-    
-    // decode the information
-    socket_info = (struct sockaddr_in *) &my_addr_port;
-    unsigned short port = htons((unsigned int) socket_info->sin_port);
-    
-    unsigned short p1 = port/256;
-    unsigned short p2 = port % 256;
-    
-    
-    if (listen(sockfd, BACKLOG) == -1) {
-        perror("listen");
-        return -1;
+    sb_free(&line);
+}
+
+/*
+ *  handle_abor(s, params)
+ *
+ *  Handles ABOR command: cancels the transfer in progress, or the one
+ *  waiting for its data connection. Runs while a transfer is in progress.
+ */
+static void
+handle_abor(s, params)
+struct session * s;
+char * params; /* unused */
+{
+    if (s->state == SESSION_TRANSFER || s->state == SESSION_WAIT_DATA) {
+        transfer_abort(s);
+    } else {
+        // nothing to abort, but the data connection of a PASV is dropped
+        close_data_con_resources(s);
+        session_reply(s, "225 No transfer to abort.\r\n");
     }
-    
-    send_string(controlcon_file_descriptor, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\n", h1, h2, h3, h4, p1, p2);
-    
-    return sockfd;
 }
 
 /*
- *  activate_data_connection()
+ *  handle_stat(s, params)
  *
- *  Listens and accepts on the data connection socket. If no connection occurs
- *  in 15 seconds it returns -2; it returns -1 for any other error. Otherwise it returns
- *  the file descriptor of the new socket.
+ *  Handles STAT command without arguments: reports the state of the
+ *  session and, while a transfer is in progress, the bytes moved so far
+ *  and the rate. Runs while a transfer is in progress.
  */
-int
-activate_data_connection()
+static void
+handle_stat(s, params)
+struct session * s;
+char * params; /* not supported */
 {
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    int new_fd;
-    
-    printf("listening on %d\n", pasv_init_descriptor);
+    struct transfer * x = &s->xfer;
 
-    
-    // set up the timeout
-    fd_set rfds;
-    struct timeval time_val;
-    int return_val;
-    
-    FD_ZERO(&rfds);
-    FD_SET(pasv_init_descriptor, &rfds);
-    
-    // Wait up to 15 seconds
-    time_val.tv_sec = 15;
-    time_val.tv_usec = 0;
-    return_val = select(pasv_init_descriptor + 1, &rfds, 0, 0, &time_val);
-    sin_size = sizeof(their_addr);
-    new_fd = accept(pasv_init_descriptor, (struct sockaddr *) &their_addr, &sin_size);
-    if (new_fd < 0) {
-        perror("error on data connection accept");
-        return -1;
+    if (params) {
+        session_reply(s, "504 Command not implemented for that parameter.\r\n");
+        return;
     }
-    return new_fd;
-}
 
+    session_reply(s, "211-Status:\r\n %s, TYPE %s, STRU F, MODE %s%s\r\n",
+                  s->logged_in ? "Logged in" : "Not logged in",
+                  s->type_ascii ? "A" : "I", s->mode_z ? "Z" : "S",
+                  s->passive_mode ? ", passive mode" : "");
+    if (s->state == SESSION_WAIT_DATA) {
+        session_reply(s, " Waiting for the data connection\r\n");
+    } else if (s->state == SESSION_TRANSFER) {
+        double seconds = (now_ms() - x->started) / 1000.0;
+        double average = seconds > 0 ? x->bytes / seconds : 0;
+
+        session_reply(s, " %s, %lld bytes in %.1f s\r\n"
+                      " Average rate %.0f bytes/s, current rate %.0f bytes/s\r\n",
+                      x->source == XFER_RECEIVE ? "Receiving" : "Sending",
+                      (long long) x->bytes, seconds, average,
+                      x->rate >= 0 ? x->rate : average);
+    } else {
+        session_reply(s, " No transfer in progress\r\n");
+    }
+    session_reply(s, "211 End of status.\r\n");
+}
 
 /*
- *  close_data_con_resources()
+ *  handle_noop(s, params)
  *
- *  Closes the sockets that are used for opening and maintaining
- *  data connection. Usually called after completing a passive connection
- *  or after an error when opening a data connection or during a data
- *  exchange over the data connection. Resets the variables back to their
- *  defaut values: passive_mode to 0 and passive con descriptors to -1.
+ *  Handles NOOP command. Runs while a transfer is in progress.
  */
-void
-close_data_con_resources()
+static void
+handle_noop(s, params)
+struct session * s;
+char * params; /* unused */
 {
-    passive_mode = 0;
-    close(pasv_init_descriptor);
-    close(datacon_file_descriptor);
-    pasv_init_descriptor = - 1;
-    datacon_file_descriptor = -1;
+    session_reply(s, "200 Command okay.\r\n");
 }
 
 /*
- *  close_resources()
+ *  is_using_illegal_cwd(path)
  *
- *  Closes all the resources that are in use including the communication/
- *  data sockets, and netbuffer sutructs.  Usually called after a quit
- *  command or a terminal error.
+ *  Returns 1 if path starts with "./", ".", "../". ".."
+ *  or contains "../" in it or if path is absolute(starts with /) and doesn't start
+ *  from the root directory of the server. Returns 0 otherwise.
  */
-void
-close_resources()
+static int /* TRUE OR FALSE */
+is_using_illegal_cwd(path)
+char * path;
 {
-    if (passive_mode){
-        close(pasv_init_descriptor);
-        close(pasv_init_descriptor);
-        pasv_init_descriptor = - 1;
-        datacon_file_descriptor = -1;
-    }
-    close(datacon_file_descriptor);
-    nb_destroy(communicationBuffer);
+    if (path[0] == '.' && path[1] == '/') return 1; // path starts with ./
+    if (path[0] == '.' && path[1] == '.' && path[2] == '/') return 1; // path starts with ../
+    if (!strcmp(".", path)) return 1;  // path is .
+    if (!strcmp("..", path)) return 1; // path is ..
+    
+    
+    char * dir_changer = "../";
+    char * result = strstr(path, dir_changer);
+    if(!result) return 0; // path contains ../
+    
+    
+    if (path[0] == '/') {  // if the path is absolute then it should start with the server's root
+        size_t len_main = strlen(main_dir);
+        size_t len_path = strlen(path);
+        
+        int check = len_main > len_path ? 0 : strncmp(main_dir, path, len_main) == 0;
+        if(!check) return 0;  // path is absolute but doesn't start with main_dir
+    }
+    
+    
+    return 1;
 }
 
-
-
+/*
+ *  string_to_upper(string)
+ *
+ *  Converts the string into uppercase
+ */
+static void
+string_to_upper(string)
+char * string; /* pointer to null ending string */
+{
+    if(!string) return;
+    char * s = string;
+    while(*s){
+        *s = toupper((unsigned char) *s);
+        s++;
+    }
+}
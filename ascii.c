@@ -0,0 +1,243 @@
+/* ascii.c
+ * Newline conversion kernels for TYPE A (ASCII) transfers. The SIMD
+ * kernels compare a whole vector of input against '\n' (or '\r') at
+ * once; vectors without line endings, which are most of them, are
+ * copied with a single store, and only the vectors that contain one
+ * are split around it.
+ */
+
+#include "ascii.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ASCII_X86 1
+#include <immintrin.h>
+#endif
+
+/* Kernel used by ascii_to_crlf() and ascii_from_crlf() */
+static const struct ascii_kernel *kernel = &ascii_kernels[0];
+
+/** Converts src[i, end) to CRLF line endings at o and returns the new
+ *  end of the output.
+ */
+static inline char *to_crlf_range(char *o, const char *src, size_t i, size_t end) {
+  for (; i < end; i++) {
+    if (src[i] == '\n')
+      *o++ = '\r';
+    *o++ = src[i];
+  }
+  return o;
+}
+
+/** Drops the CR of every CRLF in src[i, end) while copying to o, and
+ *  returns the new end of the output. A CR is kept if it is followed
+ *  by anything but LF; src[end] must be readable if src[end - 1] can
+ *  be a CR.
+ */
+static inline char *from_crlf_range(char *o, const char *src, size_t i, size_t end) {
+  for (; i < end; i++) {
+    if (src[i] == '\r' && src[i + 1] == '\n')
+      continue;
+    *o++ = src[i];
+  }
+  return o;
+}
+
+/** Number of bytes of src that can be converted by from_crlf without
+ *  knowing the byte that follows it.
+ */
+static inline size_t from_crlf_usable(const char *src, size_t n) {
+  return n > 0 && src[n - 1] == '\r' ? n - 1 : n;
+}
+
+static int scalar_supported(void) {
+  return 1;
+}
+
+static size_t scalar_to_crlf(char *dst, const char *src, size_t n) {
+  return to_crlf_range(dst, src, 0, n) - dst;
+}
+
+static size_t scalar_from_crlf(char *dst, const char *src, size_t n, size_t *used) {
+  *used = from_crlf_usable(src, n);
+  return from_crlf_range(dst, src, 0, *used) - dst;
+}
+
+#ifdef ASCII_X86
+
+static int sse2_supported(void) {
+  return __builtin_cpu_supports("sse2");
+}
+
+/** Copies a vector from which the bytes given by the bits of mask are
+ *  dropped. o may overlap p as long as it does not come after it, so
+ *  unlike the LF to CRLF kernels, this cannot store past the vector.
+ */
+static inline char *from_crlf_split(char *o, const char *p, unsigned mask, unsigned width) {
+  unsigned prev = 0, b;
+
+  while (mask) {
+    b = __builtin_ctz(mask);
+    memmove(o, p + prev, b - prev);
+    o += b - prev;
+    prev = b + 1;
+    mask &= mask - 1;
+  }
+  memmove(o, p + prev, width - prev);
+  return o + width - prev;
+}
+
+__attribute__ ((target("sse2")))
+static size_t sse2_to_crlf(char *dst, const char *src, size_t n) {
+
+  const __m128i lf = _mm_set1_epi8('\n');
+  char *o = dst;
+  size_t i;
+
+  // a vector with a LF is copied with a whole store for every line in
+  // it, each one overwriting the excess of the one before; that reads
+  // up to a vector past the current one, hence the bound
+  for (i = 0; i + 32 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+    unsigned prev = 0, b;
+
+    while (mask) {
+      b = __builtin_ctz(mask);
+      _mm_storeu_si128((__m128i *) o, _mm_loadu_si128((const __m128i *) (src + i + prev)));
+      o += b - prev;
+      *o++ = '\r';
+      *o++ = '\n';
+      prev = b + 1;
+      mask &= mask - 1;
+    }
+    _mm_storeu_si128((__m128i *) o, _mm_loadu_si128((const __m128i *) (src + i + prev)));
+    o += 16 - prev;
+  }
+  return to_crlf_range(o, src, i, n) - dst;
+}
+
+__attribute__ ((target("sse2")))
+static size_t sse2_from_crlf(char *dst, const char *src, size_t n, size_t *used) {
+
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  char *o = dst;
+  size_t i;
+
+  *used = from_crlf_usable(src, n);
+  // the byte after each vector is read too, so the last one is left to the scalar loop
+  for (i = 0; i + 16 < *used; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+    if (mask) {
+      // drop every CR whose next byte is a LF
+      __m128i next = _mm_loadu_si128((const __m128i *) (src + i + 1));
+      mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(next, lf));
+    }
+    if (!mask) {
+      _mm_storeu_si128((__m128i *) o, v);
+      o += 16;
+    } else {
+      o = from_crlf_split(o, src + i, mask, 16);
+    }
+  }
+  return from_crlf_range(o, src, i, *used) - dst;
+}
+
+static int avx2_supported(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__ ((target("avx2")))
+static size_t avx2_to_crlf(char *dst, const char *src, size_t n) {
+
+  const __m256i lf = _mm256_set1_epi8('\n');
+  char *o = dst;
+  size_t i;
+
+  for (i = 0; i + 64 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+    unsigned prev = 0, b;
+
+    while (mask) {
+      b = __builtin_ctz(mask);
+      _mm256_storeu_si256((__m256i *) o, _mm256_loadu_si256((const __m256i *) (src + i + prev)));
+      o += b - prev;
+      *o++ = '\r';
+      *o++ = '\n';
+      prev = b + 1;
+      mask &= mask - 1;
+    }
+    _mm256_storeu_si256((__m256i *) o, _mm256_loadu_si256((const __m256i *) (src + i + prev)));
+    o += 32 - prev;
+  }
+  return to_crlf_range(o, src, i, n) - dst;
+}
+
+__attribute__ ((target("avx2")))
+static size_t avx2_from_crlf(char *dst, const char *src, size_t n, size_t *used) {
+
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  char *o = dst;
+  size_t i;
+
+  *used = from_crlf_usable(src, n);
+  for (i = 0; i + 32 < *used; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+    if (mask) {
+      __m256i next = _mm256_loadu_si256((const __m256i *) (src + i + 1));
+      mask &= _mm256_movemask_epi8(_mm256_cmpeq_epi8(next, lf));
+    }
+    if (!mask) {
+      _mm256_storeu_si256((__m256i *) o, v);
+      o += 32;
+    } else {
+      o = from_crlf_split(o, src + i, mask, 32);
+    }
+  }
+  return from_crlf_range(o, src, i, *used) - dst;
+}
+
+#endif /* ASCII_X86 */
+
+/* From the slowest to the fastest */
+const struct ascii_kernel ascii_kernels[] = {
+  { "scalar", scalar_supported, scalar_to_crlf, scalar_from_crlf },
+#ifdef ASCII_X86
+  { "sse2",   sse2_supported,   sse2_to_crlf,   sse2_from_crlf },
+  { "avx2",   avx2_supported,   avx2_to_crlf,   avx2_from_crlf },
+#endif
+  { NULL, NULL, NULL, NULL }
+};
+
+/** Selects the fastest kernel the CPU supports. Must be called before
+ *  the workers start.
+ */
+void ascii_init(void) {
+
+  const struct ascii_kernel *k;
+
+  for (k = ascii_kernels; k->name; k++) {
+    if (k->supported())
+      kernel = k;
+  }
+}
+
+/** Returns the name of the kernel in use.
+ */
+const char *ascii_kernel_name(void) {
+  return kernel->name;
+}
+
+size_t ascii_to_crlf(char *dst, const char *src, size_t n) {
+  return kernel->to_crlf(dst, src, n);
+}
+
+size_t ascii_from_crlf(char *dst, const char *src, size_t n, size_t *used) {
+  return kernel->from_crlf(dst, src, n, used);
+}
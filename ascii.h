@@ -0,0 +1,38 @@
+/* ascii.h
+ * Newline conversion for TYPE A (ASCII) transfers: local LF line
+ * endings become CRLF on the data connection, and CRLF received from
+ * the client becomes LF in the file. Every conversion has a scalar
+ * kernel and, on x86, SSE2 and AVX2 kernels; the fastest one the CPU
+ * supports is selected when the server starts.
+ */
+
+#ifndef _ASCII_H_
+#define _ASCII_H_
+
+#include <stddef.h>
+
+struct ascii_kernel {
+  const char *name;
+  int (*supported)(void);
+
+  /* Copies n bytes of src to dst, writing CRLF for every LF. dst must
+   * have room for 2 * n bytes; src may lie in that room if it starts
+   * n or more bytes after dst. Returns the bytes written to dst. */
+  size_t (*to_crlf)(char *dst, const char *src, size_t n);
+
+  /* Copies the bytes of src to dst, dropping the CR of every CRLF. dst
+   * may be src. A CR in the last byte is left out, since the next byte
+   * decides whether it is kept; *used is set to the bytes of src that
+   * were converted. Returns the bytes written to dst. */
+  size_t (*from_crlf)(char *dst, const char *src, size_t n, size_t *used);
+};
+
+/* Every kernel compiled in, ending with an entry whose name is NULL */
+extern const struct ascii_kernel ascii_kernels[];
+
+void ascii_init(void);
+const char *ascii_kernel_name(void);
+size_t ascii_to_crlf(char *dst, const char *src, size_t n);
+size_t ascii_from_crlf(char *dst, const char *src, size_t n, size_t *used);
+
+#endif
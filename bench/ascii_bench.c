@@ -0,0 +1,118 @@
+/* ascii_bench.c
+ * Microbenchmark of the TYPE A newline conversion kernels (see
+ * ascii.c). Every kernel the CPU supports converts the same text,
+ * first from LF to CRLF and then back, and its throughput is printed
+ * next to the others. The output of every kernel is checked against
+ * the scalar one.
+ *
+ * Usage: ascii_bench [-s <MiB>] [-l <line length>] [-n <rounds>]
+ */
+
+#include "../ascii.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Fills buf with printable text whose lines average line_length
+ *  bytes.
+ */
+static void fill_text(char *buf, size_t size, int line_length) {
+
+  size_t i;
+
+  srand(317);
+  for (i = 0; i < size; i++) {
+    if (rand() % line_length == 0)
+      buf[i] = '\n';
+    else
+      buf[i] = ' ' + rand() % 95;
+  }
+}
+
+int main(int argc, char *argv[]) {
+
+  size_t size = 64;
+  int line_length = 64, rounds = 10;
+  const struct ascii_kernel *k;
+  char *text, *crlf, *lf, *ref;
+  size_t crlf_len = 0, ref_len = 0, len, used;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "s:l:n:")) != -1) {
+    switch (opt) {
+    case 's': size = strtoul(optarg, NULL, 10); break;
+    case 'l': line_length = atoi(optarg); break;
+    case 'n': rounds = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-s <MiB>] [-l <line length>] [-n <rounds>]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (size == 0 || line_length < 1 || rounds < 1) {
+    fprintf(stderr, "%s: sizes and counts must be positive\n", argv[0]);
+    return 1;
+  }
+  size <<= 20;
+
+  text = malloc(size);
+  crlf = malloc(2 * size);
+  lf   = malloc(2 * size);
+  ref  = malloc(2 * size);
+  if (!text || !crlf || !lf || !ref) {
+    perror("malloc");
+    return 1;
+  }
+  fill_text(text, size, line_length);
+
+  printf("%zu MiB of text, lines of about %d bytes, %d rounds\n",
+         size >> 20, line_length, rounds);
+  printf("%-8s %12s %12s\n", "kernel", "LF->CRLF", "CRLF->LF");
+
+  for (k = ascii_kernels; k->name; k++) {
+    double start, to_time, from_time;
+
+    if (!k->supported()) {
+      printf("%-8s %12s %12s\n", k->name, "-", "-");
+      continue;
+    }
+
+    start = now_sec();
+    for (i = 0; i < rounds; i++)
+      crlf_len = k->to_crlf(crlf, text, size);
+    to_time = now_sec() - start;
+
+    start = now_sec();
+    for (i = 0; i < rounds; i++)
+      len = k->from_crlf(lf, crlf, crlf_len, &used);
+    from_time = now_sec() - start;
+
+    if (k == ascii_kernels) {
+      memcpy(ref, crlf, crlf_len);
+      ref_len = crlf_len;
+    }
+    if (crlf_len != ref_len || memcmp(crlf, ref, crlf_len) ||
+        len != size || memcmp(lf, text, size)) {
+      fprintf(stderr, "%s: kernel %s produced wrong output\n", argv[0], k->name);
+      return 1;
+    }
+
+    printf("%-8s %9.2f GB/s %7.2f GB/s\n", k->name,
+           (double) size * rounds / to_time / 1e9,
+           (double) crlf_len * rounds / from_time / 1e9);
+  }
+
+  free(text);
+  free(crlf);
+  free(lf);
+  free(ref);
+  return 0;
+}
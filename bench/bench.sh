@@ -0,0 +1,54 @@
+#!/bin/sh
+# Runs the standard load scenarios (see loadgen.c) against a server
+# started on a temporary directory, and appends their results to a file
+# as lines of JSON. Run by "make bench"; the environment can change:
+#
+#   BENCH_PORT  port of the server, 2199 by default
+#   BENCH_TIME  seconds per scenario, 5 by default
+#   BENCH_OPTS  options of the server, a PASV port range by default:
+#               without it, every PASV binds a new ephemeral port, which
+#               gets slow once thousands of data connections are in
+#               TIME_WAIT, and the later scenarios would measure that
+#   BENCH_JSON  file the results are appended to, bench/results.json by
+#               default
+
+PORT=${BENCH_PORT:-2199}
+TIME=${BENCH_TIME:-5}
+OPTS=${BENCH_OPTS:--p 50000-50999}
+JSON=${BENCH_JSON:-bench/results.json}
+TOP=$(pwd)
+LOADGEN=$TOP/bench/loadgen
+
+dir=$(mktemp -d) || exit 1
+server=
+trap 'if [ -n "$server" ]; then kill $server; fi; rm -rf "$dir"' EXIT INT TERM
+
+# small files, a heavy-tailed mix and a few large files
+$LOADGEN -t 0 -g "$dir" -d small -n 1000 -s fixed:4k $PORT || exit 1
+$LOADGEN -t 0 -g "$dir" -d mixed -n 200 -s pareto:4k,1.2 $PORT || exit 1
+$LOADGEN -t 0 -g "$dir" -d large -n 8 -s uniform:4m-16m $PORT || exit 1
+
+(cd "$dir" && exec "$TOP/PostOffice" $OPTS $PORT > server.log 2>&1) &
+server=$!
+sleep 1
+if ! kill -0 $server 2> /dev/null; then
+  echo "bench: the server did not start" >&2
+  cat "$dir/server.log" >&2
+  exit 1
+fi
+
+run() {
+  label=$1
+  shift
+  $LOADGEN -t $TIME -l $label -j "$JSON" "$@" $PORT || exit 1
+  echo
+}
+
+run small-retr  -c 32 -d small -n 1000 -m 100,0,0
+run mixed       -c 32 -d mixed -n 200  -m 70,20,10
+run large-retr  -c 4  -d large -n 8    -m 100,0,0
+run listing     -c 16 -d small -n 1000 -m 0,100,0
+run commands    -c 64 -d small -n 1000 -m 0,0,100
+run churn       -c 32 -d small -n 1000 -m 0,0,100 -k 1
+
+echo "results appended to $JSON"
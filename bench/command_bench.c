@@ -0,0 +1,170 @@
+/* command_bench.c
+ * Microbenchmark of the control connection command parser and
+ * dispatcher (see command.c). A mix of typical command lines is parsed
+ * and dispatched to handlers that only count their calls, on a single
+ * core, and the rate is printed next to the one of the strtok and
+ * strcmp chain parser the server used before.
+ *
+ * Usage: command_bench [-n <millions of commands>]
+ */
+
+#include "../command.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+#define LINE_SIZE 256
+
+static const char *lines[] = {
+  "USER cs317\r\n", "PASV\r\n", "TYPE I\r\n", "RETR data/file000123.dat\r\n",
+  "SIZE log.csv\r\n", "REST 1048576\r\n", "CWD many\r\n", "CDUP\r\n",
+  "NLST *.csv\r\n", "MLSD\r\n", "STOR upload.bin\r\n", "OPTS MLST type;size;\r\n",
+  "MODE Z\r\n", "SITE CACHE\r\n", "XYZZ nothing\r\n", "QUIT\r\n",
+};
+
+#define NUM_LINES (sizeof(lines) / sizeof(lines[0]))
+
+static unsigned long calls;
+
+static void count_call(struct session *s, char *params) {
+  calls++;
+}
+
+static const struct command commands[] = {
+  { "USER", 1, 1, 0, count_call }, { "QUIT", 0, 0, 0, count_call },
+  { "CWD",  1, 1, 1, count_call }, { "CDUP", 0, 0, 1, count_call },
+  { "PASV", 0, 0, 1, count_call }, { "TYPE", 1, 1, 1, count_call },
+  { "STRU", 1, 1, 1, count_call }, { "MODE", 1, 1, 1, count_call },
+  { "RETR", 1, 1, 1, count_call }, { "STOR", 1, 1, 1, count_call },
+  { "APPE", 1, 1, 1, count_call }, { "ALLO", 1, 3, 1, count_call },
+  { "REST", 1, 1, 1, count_call }, { "SIZE", 1, 1, 1, count_call },
+  { "OPTS", 1, COMMAND_ANY_ARGS, 1, count_call },
+  { "SITE", 1, COMMAND_ANY_ARGS, 1, count_call },
+  { "NLST", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "LIST", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "MLSD", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "MLST", 0, COMMAND_ANY_ARGS, 1, count_call },
+};
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Parses and dispatches line the way handle_command() does. */
+static void dispatch_table(char *line) {
+
+  struct command_line cl;
+  const struct command *c;
+
+  command_tokenize(line, &cl);
+  c = command_find(cl.key);
+  if (c && cl.num_args >= c->min_args &&
+      (c->max_args == COMMAND_ANY_ARGS || cl.num_args <= c->max_args))
+    c->handler(NULL, cl.num_args ? cl.params : NULL);
+}
+
+/* State of the parser the server used before the command table */
+struct legacy_command {
+  char command[LINE_SIZE];
+  char command_arg[LINE_SIZE];
+  char command_params[LINE_SIZE];
+  int  num_args;
+};
+
+/** Parses and dispatches line with strtok, copies and a chain of
+ *  strcmp calls, as the server did before the command table. */
+static void dispatch_legacy(struct legacy_command *lc, char *line) {
+
+  char *saveptr, *p, *argument;
+  size_t i;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  lc->num_args = 0;
+  strcpy(lc->command, "");
+  strcpy(lc->command_arg, "");
+  p = strchr(line, ' ');
+  snprintf(lc->command_params, sizeof(lc->command_params), "%s",
+           p ? p + strspn(p, " ") : "");
+  if ((p = strtok_r(line, " ", &saveptr)) != NULL)
+    snprintf(lc->command, sizeof(lc->command), "%s", p);
+  if ((argument = strtok_r(NULL, " ", &saveptr)) != NULL)
+    snprintf(lc->command_arg, sizeof(lc->command_arg), "%s", argument);
+  while (argument) {
+    argument = strtok_r(NULL, " ", &saveptr);
+    lc->num_args++;
+  }
+  for (p = lc->command; *p; p++)
+    *p = toupper((unsigned char) *p);
+
+  for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (!strcmp(commands[i].name, lc->command)) {
+      if (lc->num_args >= commands[i].min_args &&
+          (commands[i].max_args == COMMAND_ANY_ARGS || lc->num_args <= commands[i].max_args))
+        commands[i].handler(NULL, lc->command_arg);
+      return;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+
+  struct legacy_command lc;
+  char line[LINE_SIZE];
+  unsigned long n = 20, i, table_calls;
+  double start, table_time, legacy_time;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n': n = strtoul(optarg, NULL, 10); break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <millions of commands>]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (n == 0) {
+    fprintf(stderr, "%s: the number of commands must be positive\n", argv[0]);
+    return 1;
+  }
+  n *= 1000000;
+
+  if (command_table_init(commands, sizeof(commands) / sizeof(commands[0])) == -1) {
+    fprintf(stderr, "%s: cannot build the command table\n", argv[0]);
+    return 1;
+  }
+
+  // every line is copied first, as the server parses its own copy
+  start = now_sec();
+  for (i = 0; i < n; i++) {
+    strcpy(line, lines[i % NUM_LINES]);
+    dispatch_table(line);
+  }
+  table_time = now_sec() - start;
+  table_calls = calls;
+
+  calls = 0;
+  start = now_sec();
+  for (i = 0; i < n; i++) {
+    strcpy(line, lines[i % NUM_LINES]);
+    dispatch_legacy(&lc, line);
+  }
+  legacy_time = now_sec() - start;
+
+  if (calls != table_calls) {
+    fprintf(stderr, "%s: the parsers dispatched %lu and %lu commands\n",
+            argv[0], table_calls, calls);
+    return 1;
+  }
+
+  printf("%lu commands, %zu different lines, one core\n", n, NUM_LINES);
+  printf("%-8s %14s %10s\n", "parser", "commands/s", "ns/command");
+  printf("%-8s %14.0f %10.1f\n", "table", n / table_time, table_time * 1e9 / n);
+  printf("%-8s %14.0f %10.1f\n", "legacy", n / legacy_time, legacy_time * 1e9 / n);
+  return 0;
+}
@@ -0,0 +1,574 @@
+/* loadgen.c
+ * Load generator for PostOffice. Every session is a thread with its
+ * own control connection that logs in and then runs a random mix of
+ * operations until the time is up:
+ *
+ *   retr  PASV, RETR of a random file of the corpus, read to the end
+ *   nlst  PASV, NLST of the corpus directory, read to the end
+ *   cmd   SIZE of a random file, a single round trip
+ *
+ * Every operation is timed from its first command to its last reply;
+ * logging in is timed as "connect". With -k, a session quits and
+ * connects again after that many operations, to measure connection
+ * churn. The corpus is a directory of files with names f00000.dat,
+ * f00001.dat... under the server's directory, which loadgen can
+ * generate (-g) with fixed, uniform or Pareto distributed sizes.
+ *
+ * The results are printed as text, and appended as one line of JSON
+ * to a file with -j.
+ *
+ * Usage: loadgen [options] <port>; see usage() below.
+ */
+
+#include "../metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_SESSIONS 4096
+#define REPLY_SIZE 1024
+#define IO_TIMEOUT 10        /* seconds before a blocked read or write fails */
+#define MAX_PARETO 1024      /* Pareto sizes are capped at this many times the minimum */
+
+enum { OP_RETR, OP_NLST, OP_CMD, OP_CONNECT, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = { "retr", "nlst", "cmd", "connect" };
+
+/* Options */
+static struct sockaddr_in server;
+static int num_sessions = 16;
+static double duration = 10;
+static int ops_per_connection;      /* 0 to stay connected */
+static int mix[3] = { 70, 20, 10 }; /* weights of retr, nlst and cmd */
+static const char *corpus = "corpus";
+static int num_files = 100;
+static const char *label = "";
+
+/* Size distribution of a generated corpus */
+enum { DIST_FIXED, DIST_UNIFORM, DIST_PARETO };
+static int dist = DIST_FIXED;
+static long long dist_a = 4096, dist_b;  /* size; min, max; min, alpha * 100 */
+
+/* Counters of a session, added up at the end */
+struct session_stats {
+  unsigned long long commands;
+  unsigned long long connections;
+  unsigned long long bytes;
+  unsigned long long errors;
+  struct histogram   ops[NUM_OPS];
+};
+
+struct session {
+  pthread_t            thread;
+  uint64_t             rng;
+  int                  ctl;
+  char                 buf[REPLY_SIZE];
+  size_t               len;         /* bytes of buf read but not yet returned */
+  struct session_stats stats;
+};
+
+static double deadline;
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-H <host>] [-c <sessions>] [-t <seconds>] [-k <ops>]\n"
+          "       [-m <retr>,<nlst>,<cmd>] [-d <dir>] [-n <files>] [-g <root>]\n"
+          "       [-s <distribution>] [-l <label>] [-j <file>] <port>\n", prog);
+  fprintf(stderr, "     -H       Address of the server. Defaults to 127.0.0.1.\n");
+  fprintf(stderr, "     -c       Concurrent sessions. Defaults to 16.\n");
+  fprintf(stderr, "     -t       Seconds to run. 0 only generates the corpus. Defaults to 10.\n");
+  fprintf(stderr, "     -k       Operations per connection before reconnecting. Defaults\n");
+  fprintf(stderr, "              to 0, for a single connection per session.\n");
+  fprintf(stderr, "     -m       Weights of RETR, NLST and SIZE operations. Defaults to\n");
+  fprintf(stderr, "              70,20,10.\n");
+  fprintf(stderr, "     -d       Corpus directory, relative to the server's directory.\n");
+  fprintf(stderr, "              Defaults to corpus.\n");
+  fprintf(stderr, "     -n       Files in the corpus. Defaults to 100.\n");
+  fprintf(stderr, "     -g       Generates the corpus in <root>/<dir> first, where <root>\n");
+  fprintf(stderr, "              is the directory the server serves.\n");
+  fprintf(stderr, "     -s       Sizes of the generated files: fixed:<size>,\n");
+  fprintf(stderr, "              uniform:<min>-<max> or pareto:<min>,<alpha>; sizes may\n");
+  fprintf(stderr, "              end in k, m or g. Defaults to fixed:4k.\n");
+  fprintf(stderr, "     -l       Name of the scenario in the results.\n");
+  fprintf(stderr, "     -j       Appends the results to a file as a line of JSON.\n");
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Returns the next number of a xorshift generator. */
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/** Parses a size such as 4096, 64k or 2m.
+ *
+ *  Returns: the size in bytes, or -1 if it is not valid.
+ */
+static long long parse_size(const char *text, char **end) {
+
+  long long size = strtoll(text, end, 10);
+
+  if (*end == text || size < 0)
+    return -1;
+  switch (**end) {
+  case 'g': case 'G': size *= 1024;  /* fall through */
+  case 'm': case 'M': size *= 1024;  /* fall through */
+  case 'k': case 'K': size *= 1024; (*end)++;
+  }
+  return size;
+}
+
+/** Parses the argument of -s.
+ *
+ *  Returns: 0 on success, -1 if it is not valid.
+ */
+static int parse_distribution(const char *text) {
+
+  char *end;
+  double alpha;
+
+  if (!strncmp(text, "fixed:", 6)) {
+    dist = DIST_FIXED;
+    dist_a = parse_size(text + 6, &end);
+    return dist_a < 0 || *end ? -1 : 0;
+  }
+  if (!strncmp(text, "uniform:", 8)) {
+    dist = DIST_UNIFORM;
+    dist_a = parse_size(text + 8, &end);
+    if (dist_a < 0 || *end != '-')
+      return -1;
+    dist_b = parse_size(end + 1, &end);
+    return dist_b < dist_a || *end ? -1 : 0;
+  }
+  if (!strncmp(text, "pareto:", 7)) {
+    dist = DIST_PARETO;
+    dist_a = parse_size(text + 7, &end);
+    if (dist_a < 1 || *end != ',')
+      return -1;
+    alpha = strtod(end + 1, &end);
+    dist_b = alpha * 100;
+    return alpha <= 0 || *end ? -1 : 0;
+  }
+  return -1;
+}
+
+/** Returns the size of the next generated file. */
+static long long next_size(uint64_t *rng) {
+
+  double u;
+  long long size;
+
+  switch (dist) {
+  case DIST_UNIFORM:
+    return dist_a + next_random(rng) % (dist_b - dist_a + 1);
+  case DIST_PARETO:
+    u = (next_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+    size = dist_a / pow(1 - u, 100.0 / dist_b);
+    return size > dist_a * MAX_PARETO ? dist_a * MAX_PARETO : size;
+  default:
+    return dist_a;
+  }
+}
+
+/** Writes the corpus of num_files files into root/corpus. The contents
+ *  are random, so that MODE Z cannot make them cheaper.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int generate_corpus(const char *root) {
+
+  char path[4096];
+  static char block[64 * 1024];
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  long long size, total = 0, n;
+  size_t i;
+  int f, fd;
+
+  for (i = 0; i < sizeof(block) / sizeof(uint64_t); i++)
+    ((uint64_t *) block)[i] = next_random(&rng);
+
+  snprintf(path, sizeof(path), "%s/%s", root, corpus);
+  if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+    perror(path);
+    return -1;
+  }
+  for (f = 0; f < num_files; f++) {
+    snprintf(path, sizeof(path), "%s/%s/f%05d.dat", root, corpus, f);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+      perror(path);
+      return -1;
+    }
+    for (size = next_size(&rng); size > 0; size -= n) {
+      n = size < (long long) sizeof(block) ? size : (long long) sizeof(block);
+      if (write(fd, block, n) != n) {
+        perror(path);
+        close(fd);
+        return -1;
+      }
+    }
+    total += lseek(fd, 0, SEEK_CUR);
+    close(fd);
+  }
+  printf("corpus %s: %d files, %.1f MB\n", corpus, num_files, total / 1e6);
+  return 0;
+}
+
+/** Opens a TCP connection to port of the server, with timeouts on
+ *  every read and write.
+ *
+ *  Returns: the socket, or -1 on error.
+ */
+static int connect_to(unsigned short port) {
+
+  struct sockaddr_in addr = server;
+  struct timeval tv = { IO_TIMEOUT, 0 };
+  int fd, one = 1;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  addr.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/** Reads the next reply line on the control connection into line.
+ *
+ *  Returns: the reply code, or -1 on error.
+ */
+static int read_reply(struct session *s, char *line, size_t size) {
+
+  char *nl;
+  ssize_t rv;
+  size_t n;
+  int code;
+
+  while (!(nl = memchr(s->buf, '\n', s->len))) {
+    if (s->len == sizeof(s->buf))
+      return -1;
+    rv = recv(s->ctl, s->buf + s->len, sizeof(s->buf) - s->len, 0);
+    if (rv <= 0)
+      return -1;
+    s->len += rv;
+  }
+  n = nl - s->buf + 1;
+  code = atoi(s->buf);
+  if (line) {
+    size_t copy = n < size ? n : size - 1;
+    memcpy(line, s->buf, copy);
+    line[copy] = '\0';
+  }
+  memmove(s->buf, s->buf + n, s->len - n);
+  s->len -= n;
+  return code > 0 ? code : -1;
+}
+
+/** Sends a command and reads its reply.
+ *
+ *  Returns: the reply code, or -1 on error.
+ */
+static int command(struct session *s, char *line, size_t size, const char *fmt, ...)
+  __attribute__ ((format(printf, 4, 5)));
+
+static int command(struct session *s, char *line, size_t size, const char *fmt, ...) {
+
+  char out[512];
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(out, sizeof(out), fmt, args);
+  va_end(args);
+  if (send(s->ctl, out, len, MSG_NOSIGNAL) != len)
+    return -1;
+  s->stats.commands++;
+  return read_reply(s, line, size);
+}
+
+/** Logs in on a new control connection.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int login(struct session *s, unsigned short port) {
+
+  char line[REPLY_SIZE];
+
+  s->len = 0;
+  if ((s->ctl = connect_to(port)) == -1)
+    return -1;
+  if (read_reply(s, line, sizeof(line)) != 220 ||
+      command(s, line, sizeof(line), "USER cs317\r\n") != 230 ||
+      command(s, line, sizeof(line), "TYPE I\r\n") != 200) {
+    close(s->ctl);
+    s->ctl = -1;
+    return -1;
+  }
+  s->stats.connections++;
+  return 0;
+}
+
+/** Runs PASV followed by a command whose data is read to the end.
+ *
+ *  Returns: 0 on success, 1 if the server refused a command, -1 if
+ *           the control connection failed.
+ */
+static int data_command(struct session *s, const char *cmd) {
+
+  char line[REPLY_SIZE], data[64 * 1024];
+  unsigned int h1, h2, h3, h4, p1, p2;
+  char *paren;
+  ssize_t rv;
+  int fd;
+
+  int code;
+
+  if ((code = command(s, line, sizeof(line), "PASV\r\n")) != 227)
+    return code == -1 ? -1 : 1;
+  if (!(paren = strchr(line, '(')) ||
+      sscanf(paren, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6 ||
+      (fd = connect_to(p1 * 256 + p2)) == -1)
+    return -1;
+  if ((code = command(s, line, sizeof(line), "%s\r\n", cmd)) != 150) {
+    close(fd);
+    return code == -1 ? -1 : 1;
+  }
+  while ((rv = recv(fd, data, sizeof(data), 0)) > 0)
+    s->stats.bytes += rv;
+  close(fd);
+  if (rv < 0)
+    return -1;
+  if ((code = read_reply(s, line, sizeof(line))) != 226)
+    return code == -1 ? -1 : 1;
+  return 0;
+}
+
+/** Thread of a session: runs operations until the deadline. */
+static void *run_session(void *arg) {
+
+  struct session *s = arg;
+  unsigned short port = ntohs(server.sin_port);
+  int total = mix[0] + mix[1] + mix[2];
+  int ops = 0, op, pick, rv;
+  char line[REPLY_SIZE];
+  uint64_t start;
+
+  s->ctl = -1;
+  while (now_sec() < deadline) {
+    if (s->ctl == -1) {
+      start = metrics_now_ns();
+      if (login(s, port) == -1) {
+        s->stats.errors++;
+        usleep(10000);
+        continue;
+      }
+      histogram_record(&s->stats.ops[OP_CONNECT], metrics_now_ns() - start);
+      ops = 0;
+    }
+
+    pick = next_random(&s->rng) % total;
+    op = pick < mix[0] ? OP_RETR : pick < mix[0] + mix[1] ? OP_NLST : OP_CMD;
+    start = metrics_now_ns();
+    if (op == OP_RETR) {
+      snprintf(line, sizeof(line), "RETR %s/f%05d.dat", corpus,
+               (int) (next_random(&s->rng) % num_files));
+      rv = data_command(s, line);
+    } else if (op == OP_NLST) {
+      snprintf(line, sizeof(line), "NLST %s", corpus);
+      rv = data_command(s, line);
+    } else {
+      rv = command(s, line, sizeof(line), "SIZE %s/f%05d.dat\r\n", corpus,
+                   (int) (next_random(&s->rng) % num_files));
+      rv = rv == 213 ? 0 : rv == -1 ? -1 : 1;
+    }
+    if (rv) {
+      // a refused command is counted, a broken connection is replaced
+      s->stats.errors++;
+      if (rv == -1) {
+        close(s->ctl);
+        s->ctl = -1;
+      }
+      continue;
+    }
+    histogram_record(&s->stats.ops[op], metrics_now_ns() - start);
+
+    if (ops_per_connection && ++ops == ops_per_connection) {
+      command(s, NULL, 0, "QUIT\r\n");
+      close(s->ctl);
+      s->ctl = -1;
+    }
+  }
+  if (s->ctl != -1) {
+    command(s, NULL, 0, "QUIT\r\n");
+    close(s->ctl);
+  }
+  return NULL;
+}
+
+/** Prints the results as text, and as a line of JSON to json if it is
+ *  not NULL.
+ */
+static void report(struct session_stats *t, double seconds, FILE *json) {
+
+  int op;
+
+  printf("%s%s%d sessions, %.1f s\n", label, label[0] ? ": " : "", num_sessions, seconds);
+  printf("  connections %10llu  %10.1f /s\n", t->connections, t->connections / seconds);
+  printf("  commands    %10llu  %10.1f /s\n", t->commands, t->commands / seconds);
+  printf("  data        %10.1f MB  %7.1f MB/s\n", t->bytes / 1e6, t->bytes / 1e6 / seconds);
+  printf("  errors      %10llu\n", t->errors);
+  printf("  %-8s %10s %10s %10s %10s %10s\n", "latency", "count", "p50 us", "p99 us", "p999 us", "max us");
+  for (op = 0; op < NUM_OPS; op++) {
+    struct histogram *h = &t->ops[op];
+    if (!h->count)
+      continue;
+    printf("  %-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", op_names[op],
+           (unsigned long long) h->count, histogram_percentile(h, 50) / 1e3,
+           histogram_percentile(h, 99) / 1e3, histogram_percentile(h, 99.9) / 1e3,
+           h->max / 1e3);
+  }
+
+  if (!json)
+    return;
+  fprintf(json, "{\"label\":\"%s\",\"sessions\":%d,\"seconds\":%.3f,"
+          "\"connections\":%llu,\"connections_per_sec\":%.1f,"
+          "\"commands\":%llu,\"commands_per_sec\":%.1f,"
+          "\"bytes\":%llu,\"mbytes_per_sec\":%.2f,\"errors\":%llu,\"latency_us\":{",
+          label, num_sessions, seconds, t->connections, t->connections / seconds,
+          t->commands, t->commands / seconds, t->bytes, t->bytes / 1e6 / seconds, t->errors);
+  for (op = 0; op < NUM_OPS; op++) {
+    struct histogram *h = &t->ops[op];
+    fprintf(json, "%s\"%s\":{\"count\":%llu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+            op ? "," : "", op_names[op], (unsigned long long) h->count,
+            histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 99) / 1e3,
+            histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+  }
+  fprintf(json, "}}\n");
+}
+
+int main(int argc, char *argv[]) {
+
+  struct session *sessions;
+  struct session_stats total;
+  const char *host = "127.0.0.1", *root = NULL, *json_path = NULL;
+  FILE *json = NULL;
+  double start;
+  int opt, i, op, b;
+
+  while ((opt = getopt(argc, argv, "H:c:t:k:m:d:n:g:s:l:j:")) != -1) {
+    switch (opt) {
+    case 'H': host = optarg; break;
+    case 'c': num_sessions = atoi(optarg); break;
+    case 't': duration = atof(optarg); break;
+    case 'k': ops_per_connection = atoi(optarg); break;
+    case 'd': corpus = optarg; break;
+    case 'n': num_files = atoi(optarg); break;
+    case 'g': root = optarg; break;
+    case 'l': label = optarg; break;
+    case 'j': json_path = optarg; break;
+    case 'm':
+      if (sscanf(optarg, "%d,%d,%d", &mix[0], &mix[1], &mix[2]) != 3 ||
+          mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      if (parse_distribution(optarg) == -1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || num_sessions < 1 || num_sessions > MAX_SESSIONS ||
+      num_files < 1 || duration < 0 || ops_per_connection < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(atoi(argv[optind]));
+  if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+    fprintf(stderr, "%s: not an IPv4 address: %s\n", argv[0], host);
+    return 1;
+  }
+
+  if (root && generate_corpus(root) == -1)
+    return 1;
+  if (duration == 0)
+    return 0;
+
+  if (json_path && !(json = fopen(json_path, "a"))) {
+    perror(json_path);
+    return 1;
+  }
+  sessions = calloc(num_sessions, sizeof(struct session));
+  if (!sessions) {
+    perror("calloc");
+    return 1;
+  }
+
+  start = now_sec();
+  deadline = start + duration;
+  for (i = 0; i < num_sessions; i++) {
+    sessions[i].rng = 0x2545f4914f6cdd1dULL * (i + 1);
+    if (pthread_create(&sessions[i].thread, NULL, run_session, &sessions[i]) != 0) {
+      fprintf(stderr, "%s: cannot start session %d\n", argv[0], i);
+      return 1;
+    }
+  }
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < num_sessions; i++) {
+    struct session_stats *st = &sessions[i].stats;
+    pthread_join(sessions[i].thread, NULL);
+    total.commands    += st->commands;
+    total.connections += st->connections;
+    total.bytes       += st->bytes;
+    total.errors      += st->errors;
+    for (op = 0; op < NUM_OPS; op++) {
+      total.ops[op].count += st->ops[op].count;
+      total.ops[op].sum   += st->ops[op].sum;
+      if (st->ops[op].max > total.ops[op].max)
+        total.ops[op].max = st->ops[op].max;
+      for (b = 0; b < METRICS_HIST_BUCKETS; b++)
+        total.ops[op].buckets[b] += st->ops[op].buckets[b];
+    }
+  }
+
+  report(&total, now_sec() - start, json);
+  if (json)
+    fclose(json);
+  return 0;
+}
@@ -0,0 +1,489 @@
+/* micro_bench.c
+ * Microbenchmarks of the hot components of the server, each run in
+ * isolation on a single core:
+ *
+ *   nb/...      lines taken out of a netbuffer fed from a socketpair, with
+ *               nb_feed/nb_peek_line/nb_consume as the event loop does and
+ *               with nb_read_line, for several line lengths and numbers of
+ *               lines sent together (pipelining depth)
+ *   command/... command lines split and looked up in the command table
+ *   list/...    listings of synthetic directories, rendered whole by
+ *               listFiles() into /dev/null and streamed in transfer sized
+ *               parts by list_render()
+ *   reply/...   replies of session_reply() sent over a socketpair, one at
+ *               a time and coalesced the way session_resume() batches them
+ *
+ * Every benchmark prints one line, in the same format as Go benchmarks so
+ * that runs of two commits can be compared with benchstat or diff:
+ *
+ *   <name> <iterations> <ns> ns/op <allocations> allocs/op
+ *
+ * By default the iterations of each benchmark are grown until it runs
+ * for about -t seconds. With -f every benchmark runs a fixed number of
+ * iterations instead, so that the work done does not depend on the
+ * machine, for comparisons in CI. Allocations are counted by wrapping
+ * malloc, so they include those made inside the C library.
+ *
+ * Usage: micro_bench [-f] [-t <seconds>] [-L] [<prefix>...]
+ *        -L adds the listings of a directory of a million entries.
+ */
+
+#include "../session.h"
+#include "../netbuffer.h"
+#include "../command.h"
+#include "../dir.h"
+#include "../strbuf.h"
+#include "../metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+/* Allocation counting: the allocator of the C library does the work */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  allocations++;
+  return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+  __libc_free(p);
+}
+
+/* What the server's main program would provide to session.c */
+char main_dir[MAX_PATH_LENGTH + 1] = "/";
+void handle_command(struct session *s, char *line) {}
+
+/* State of a running benchmark */
+struct bench_state {
+  long          n;       /* iterations to run */
+  double        start;
+  double        elapsed;
+  unsigned long allocs;
+};
+
+struct bench {
+  const char *name;
+  long        fixed;     /* iterations with -f */
+  void      (*run)(struct bench_state *b, long param);
+  long        param;
+  int         large;     /* only run with -L */
+};
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Starts measuring, after the setup of a benchmark. */
+static void bench_start(struct bench_state *b) {
+  b->allocs = allocations;
+  b->start  = now_sec();
+}
+
+/** Stops measuring, before the teardown of a benchmark. */
+static void bench_stop(struct bench_state *b) {
+  b->elapsed = now_sec() - b->start;
+  b->allocs  = allocations - b->allocs;
+}
+
+/** Returns a connected pair of stream sockets with large buffers. */
+static void make_pair(int sv[2]) {
+
+  int size = 4 * 1024 * 1024;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+/** Fills line with a command line of len bytes, CRLF included. */
+static void make_line(char *line, long len) {
+  memcpy(line, "RETR ", 5);
+  memset(line + 5, 'a', len - 7);
+  memcpy(line + len - 2, "\r\n", 2);
+}
+
+/* The lengths and depths of the nb benchmarks, packed in param */
+#define NB_PARAM(len, depth) ((len) * 1000 + (depth))
+
+/** Lines taken as views with nb_feed, nb_peek_line and nb_consume. */
+static void bench_nb_peek(struct bench_state *b, long param) {
+
+  long len = param / 1000, depth = param % 1000, i, j;
+  char batch[64 * 1024];
+  net_buffer_t nb;
+  size_t got;
+  int sv[2];
+
+  b->n = (b->n + depth - 1) / depth * depth;
+  make_pair(sv);
+  nb = nb_create(sv[1], MAX_LINE_LENGTH + 1);
+  for (j = 0; j < depth; j++)
+    make_line(batch + j * len, len);
+
+  bench_start(b);
+  for (i = 0; i < b->n; i += depth) {
+    if (write(sv[0], batch, len * depth) != len * depth)
+      exit(1);
+    for (j = 0; j < depth; j++) {
+      while (!nb_peek_line(nb, &got))
+        nb_feed(nb);
+      nb_consume(nb, got);
+    }
+  }
+  bench_stop(b);
+
+  nb_destroy(nb);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+/** Lines copied out with nb_read_line. */
+static void bench_nb_read_line(struct bench_state *b, long param) {
+
+  long len = param / 1000, depth = param % 1000, i, j;
+  char batch[64 * 1024], out[MAX_LINE_LENGTH + 1];
+  net_buffer_t nb;
+  int sv[2];
+
+  b->n = (b->n + depth - 1) / depth * depth;
+  make_pair(sv);
+  nb = nb_create(sv[1], MAX_LINE_LENGTH + 1);
+  for (j = 0; j < depth; j++)
+    make_line(batch + j * len, len);
+
+  bench_start(b);
+  for (i = 0; i < b->n; i += depth) {
+    if (write(sv[0], batch, len * depth) != len * depth)
+      exit(1);
+    for (j = 0; j < depth; j++)
+      nb_read_line(nb, out);
+  }
+  bench_stop(b);
+
+  nb_destroy(nb);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+static void count_call(struct session *s, char *params) {}
+
+static const struct command commands[] = {
+  { "USER", 1, 1, 0, count_call }, { "QUIT", 0, 0, 0, count_call },
+  { "CWD",  1, 1, 1, count_call }, { "CDUP", 0, 0, 1, count_call },
+  { "PASV", 0, 0, 1, count_call }, { "TYPE", 1, 1, 1, count_call },
+  { "STRU", 1, 1, 1, count_call }, { "MODE", 1, 1, 1, count_call },
+  { "RETR", 1, 1, 1, count_call }, { "STOR", 1, 1, 1, count_call },
+  { "APPE", 1, 1, 1, count_call }, { "ALLO", 1, 3, 1, count_call },
+  { "REST", 1, 1, 1, count_call }, { "SIZE", 1, 1, 1, count_call },
+  { "OPTS", 1, COMMAND_ANY_ARGS, 1, count_call },
+  { "SITE", 1, COMMAND_ANY_ARGS, 1, count_call },
+  { "NLST", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "LIST", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "MLSD", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "MLST", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "ABOR", 0, 0, 1, count_call }, { "STAT", 0, COMMAND_ANY_ARGS, 1, count_call },
+  { "NOOP", 0, 0, 0, count_call },
+};
+
+static const char *lines[] = {
+  "USER cs317\r", "PASV\r", "TYPE I\r", "RETR data/file000123.dat\r",
+  "SIZE log.csv\r", "REST 1048576\r", "CWD many\r", "CDUP\r",
+  "NLST *.csv\r", "MLSD\r", "STOR upload.bin\r", "OPTS MLST type;size;\r",
+  "MODE Z\r", "SITE CACHE\r", "XYZZ nothing\r", "NOOP\r",
+};
+
+#define NUM_LINES (sizeof(lines) / sizeof(lines[0]))
+
+/** Command lines split and dispatched the way handle_command() does. */
+static void bench_command(struct bench_state *b, long param) {
+
+  char copies[NUM_LINES][64];
+  struct command_line cl;
+  const struct command *c;
+  long i;
+
+  bench_start(b);
+  for (i = 0; i < b->n; i++) {
+    char *line = copies[i % NUM_LINES];
+    strcpy(line, lines[i % NUM_LINES]);
+    command_tokenize(line, &cl);
+    c = command_find(cl.key);
+    if (c && cl.num_args >= c->min_args &&
+        (c->max_args == COMMAND_ANY_ARGS || cl.num_args <= c->max_args))
+      c->handler(NULL, cl.num_args ? cl.params : NULL);
+  }
+  bench_stop(b);
+}
+
+static char fixture_root[] = "/tmp/micro_bench.XXXXXX";
+static long fixtures[8];
+static int num_fixtures;
+
+/** Returns the path of a directory of entries empty files, created
+ *  the first time it is asked for.
+ */
+static const char *fixture_dir(long entries, char *path, size_t size) {
+
+  char name[4200];
+  long i;
+  int fd;
+
+  snprintf(path, size, "%s/%ld", fixture_root, entries);
+  for (i = 0; i < num_fixtures; i++)
+    if (fixtures[i] == entries)
+      return path;
+
+  if (mkdir(path, 0755) == -1) {
+    perror(path);
+    exit(1);
+  }
+  for (i = 0; i < entries; i++) {
+    snprintf(name, sizeof(name), "%s/file%07ld.dat", path, i);
+    if ((fd = open(name, O_WRONLY | O_CREAT, 0644)) == -1) {
+      perror(name);
+      exit(1);
+    }
+    close(fd);
+  }
+  fixtures[num_fixtures++] = entries;
+  return path;
+}
+
+/** Removes the directories of the list benchmarks. */
+static void remove_fixtures(void) {
+
+  char path[4096], name[4200];
+  int i;
+  long j;
+
+  for (i = 0; i < num_fixtures; i++) {
+    snprintf(path, sizeof(path), "%s/%ld", fixture_root, fixtures[i]);
+    for (j = 0; j < fixtures[i]; j++) {
+      snprintf(name, sizeof(name), "%s/file%07ld.dat", path, j);
+      unlink(name);
+    }
+    rmdir(path);
+  }
+  rmdir(fixture_root);
+}
+
+/** Whole listings written by listFiles(). */
+static void bench_list_files(struct bench_state *b, long entries) {
+
+  char path[4096];
+  int fd = open("/dev/null", O_WRONLY);
+  long i;
+
+  fixture_dir(entries, path, sizeof(path));
+  bench_start(b);
+  for (i = 0; i < b->n; i++)
+    listFiles(fd, path);
+  bench_stop(b);
+  close(fd);
+}
+
+/** Listings streamed by list_render() in parts of the default
+ *  transfer chunk size, as XFER_LISTING transfers do.
+ */
+static void bench_list_stream(struct bench_state *b, long entries) {
+
+  char path[4096];
+  struct dir_reader r;
+  struct strbuf out;
+  long i;
+
+  fixture_dir(entries, path, sizeof(path));
+  sb_init(&out);
+  bench_start(b);
+  for (i = 0; i < b->n; i++) {
+    if (dir_open(&r, path) == -1)
+      exit(1);
+    while (list_render(&r, &out, DEFAULT_CHUNK_SIZE) > 0)
+      sb_reset(&out);
+    dir_close(&r);
+  }
+  bench_stop(b);
+  sb_free(&out);
+}
+
+/** Reads everything the peer of a session has been sent. */
+static void drain(int fd) {
+  char buf[64 * 1024];
+  while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+    ;
+}
+
+/** Replies sent by session_reply(), param at a time: one reply is sent
+ *  right away, more are coalesced into a single send.
+ */
+static void bench_reply(struct bench_state *b, long depth) {
+
+  struct worker_metrics m;
+  struct worker w;
+  struct session *s;
+  long i, j;
+  int sv[2];
+
+  b->n = (b->n + depth - 1) / depth * depth;
+  memset(&w, 0, sizeof(w));
+  memset(&m, 0, sizeof(m));
+  w.metrics = &m;
+  w.epoll_fd = epoll_create1(0);
+  make_pair(sv);
+  s = session_create(&w, sv[1]);
+  if (!s)
+    exit(1);
+  drain(sv[0]);
+
+  bench_start(b);
+  for (i = 0; i < b->n; i += depth) {
+    s->batch++;
+    for (j = 0; j < depth; j++)
+      session_reply(s, "213 %ld\r\n", i + j);
+    s->batch--;
+    // sends what the batch queued, as at the end of session_resume
+    session_resume(s);
+    drain(sv[0]);
+  }
+  bench_stop(b);
+
+  session_close(s);
+  session_free(s);
+  close(sv[0]);
+  close(w.epoll_fd);
+}
+
+static const struct bench benches[] = {
+  { "nb/peek/len=16/depth=1",         2000000, bench_nb_peek,      NB_PARAM(16, 1) },
+  { "nb/peek/len=16/depth=16",        4000000, bench_nb_peek,      NB_PARAM(16, 16) },
+  { "nb/peek/len=128/depth=1",        2000000, bench_nb_peek,      NB_PARAM(128, 1) },
+  { "nb/peek/len=128/depth=16",       4000000, bench_nb_peek,      NB_PARAM(128, 16) },
+  { "nb/peek/len=1024/depth=1",       1000000, bench_nb_peek,      NB_PARAM(1024, 1) },
+  { "nb/peek/len=1024/depth=16",      1000000, bench_nb_peek,      NB_PARAM(1024, 16) },
+  { "nb/read_line/len=16/depth=1",    2000000, bench_nb_read_line, NB_PARAM(16, 1) },
+  { "nb/read_line/len=16/depth=16",   4000000, bench_nb_read_line, NB_PARAM(16, 16) },
+  { "nb/read_line/len=128/depth=16",  4000000, bench_nb_read_line, NB_PARAM(128, 16) },
+  { "nb/read_line/len=1024/depth=16", 1000000, bench_nb_read_line, NB_PARAM(1024, 16) },
+  { "command/dispatch",              20000000, bench_command,      0 },
+  { "list/files/entries=10",            50000, bench_list_files,   10 },
+  { "list/files/entries=1000",           2000, bench_list_files,   1000 },
+  { "list/files/entries=100000",           10, bench_list_files,   100000 },
+  { "list/files/entries=1000000",           2, bench_list_files,   1000000, 1 },
+  { "list/stream/entries=10",           50000, bench_list_stream,  10 },
+  { "list/stream/entries=1000",          2000, bench_list_stream,  1000 },
+  { "list/stream/entries=100000",          10, bench_list_stream,  100000 },
+  { "list/stream/entries=1000000",          2, bench_list_stream,  1000000, 1 },
+  { "reply/depth=1",                  1000000, bench_reply,        1 },
+  { "reply/depth=16",                 4000000, bench_reply,        16 },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/** Returns 1 if the benchmark was selected by the prefixes given on
+ *  the command line (all of them are without any).
+ */
+static int selected(const struct bench *bench, char **prefixes, int n, int large) {
+
+  int i;
+
+  if (bench->large && !large)
+    return 0;
+  if (!n)
+    return 1;
+  for (i = 0; i < n; i++)
+    if (!strncmp(bench->name, prefixes[i], strlen(prefixes[i])))
+      return 1;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  struct bench_state b;
+  double target = 0.5;
+  int fixed = 0, large = 0, opt;
+  size_t i;
+
+  while ((opt = getopt(argc, argv, "ft:L")) != -1) {
+    switch (opt) {
+    case 'f':
+      fixed = 1;
+      break;
+    case 't':
+      target = atof(optarg);
+      break;
+    case 'L':
+      large = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-f] [-t <seconds>] [-L] [<prefix>...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (!mkdtemp(fixture_root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  atexit(remove_fixtures);
+  if (command_table_init(commands, sizeof(commands) / sizeof(commands[0])) == -1) {
+    fprintf(stderr, "cannot build the command table\n");
+    return 1;
+  }
+
+  for (i = 0; i < NUM_BENCHES; i++) {
+    const struct bench *bench = &benches[i];
+
+    if (!selected(bench, argv + optind, argc - optind, large))
+      continue;
+
+    if (fixed) {
+      b.n = bench->fixed;
+      bench->run(&b, bench->param);
+    } else {
+      // grow the iterations until a run takes long enough to time
+      for (b.n = 1; ; ) {
+        bench->run(&b, bench->param);
+        if (b.elapsed >= target || b.n >= 1000000000L)
+          break;
+        if (b.elapsed < target / 100)
+          b.n *= 100;
+        else
+          b.n = b.n * target * 1.2 / b.elapsed + 1;
+      }
+    }
+    printf("%-32s %10ld %12.1f ns/op %8.2f allocs/op\n", bench->name, b.n,
+           b.elapsed * 1e9 / b.n, (double) b.allocs / b.n);
+    fflush(stdout);
+  }
+  return 0;
+}
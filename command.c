@@ -0,0 +1,181 @@
+/* command.c
+ * Tokenizing and dispatching the command lines of the control
+ * connection.
+ *
+ * Every verb of the protocol has at most four letters, so a verb is
+ * packed, in upper case, into a 32 bit key. When the server starts, a
+ * multiplier is searched for that sends the key of every command of
+ * the table to a different slot of a small array: finding the command
+ * of a line is then one multiplication, one shift and one comparison.
+ */
+
+#include "command.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define SEED_MULTIPLIER 0x9e3779b1u /* first multiplier tried (golden ratio) */
+#define MAX_MULTIPLIER_TRIES (1 << 20)
+#define TELNET_IAC 0xff             /* "Interpret As Command", starts a Telnet command */
+
+static const struct command *slots[1 << COMMAND_MAX_SLOT_BITS];
+static uint32_t slot_keys[1 << COMMAND_MAX_SLOT_BITS]; /* key of the command in each slot */
+static uint32_t slot_multiplier;
+static int slot_shift = 32;  /* 32 - bits of the slot index; 32 while there is no table */
+
+/** Packs a verb of len bytes into a key, in upper case.
+ *
+ *  Returns: the key, or 0 if the verb is empty, longer than four bytes
+ *           or contains anything but letters.
+ */
+uint32_t command_key(const char *verb, size_t len) {
+
+  uint32_t key = 0;
+  size_t i;
+
+  if (len == 0 || len > 4)
+    return 0;
+  for (i = 0; i < len; i++) {
+    unsigned char c = verb[i];
+    if (c >= 'a' && c <= 'z')
+      c -= 'a' - 'A';
+    else if (c < 'A' || c > 'Z')
+      return 0;
+    key |= (uint32_t) c << (8 * i);
+  }
+  return key;
+}
+
+/** Returns how many bytes at the start of the line of len bytes come
+ *  before the verb: spaces, and the Telnet commands (IAC followed by
+ *  one byte) that clients send ahead of an urgent command such as
+ *  ABOR, "Interrupt Process" and "Data Mark".
+ */
+static size_t verb_offset(const char *line, size_t len) {
+
+  size_t i = 0;
+
+  while (i < len) {
+    if (line[i] == ' ')
+      i++;
+    else if ((unsigned char) line[i] == TELNET_IAC && i + 1 < len)
+      i += 2;
+    else
+      break;
+  }
+  return i;
+}
+
+/** Splits a command line in place. The line ends at its first CR or
+ *  LF; the verb is the first word and the arguments are the rest of
+ *  the line. Nothing is copied: the verb and the arguments are
+ *  NUL-terminated inside the line.
+ */
+void command_tokenize(char *line, struct command_line *cl) {
+
+  char *end = line + strcspn(line, "\r\n");
+  char *p = line;
+  int in_word = 0;
+
+  while (end > line && end[-1] == ' ')
+    end--;
+  *end = '\0';
+
+  p += verb_offset(line, end - line);
+  cl->verb = p;
+  while (*p && *p != ' ')
+    p++;
+  cl->key = command_key(cl->verb, p - cl->verb);
+  if (*p)
+    *p++ = '\0';
+
+  while (*p == ' ')
+    p++;
+  cl->params = p;
+
+  cl->num_args = 0;
+  for (; *p; p++) {
+    if (*p == ' ')
+      in_word = 0;
+    else if (!in_word) {
+      in_word = 1;
+      cl->num_args++;
+    }
+  }
+}
+
+/** Returns the slot of key for the current multiplier and shift. */
+static inline unsigned int slot_of(uint32_t key, uint32_t multiplier, int shift) {
+  return (key * multiplier) >> shift;
+}
+
+/** Builds the dispatch table from the n commands of table, which must
+ *  stay valid while the server runs. Must be called before the
+ *  workers start.
+ *
+ *  Returns: 0 on success, -1 if no collision free table was found.
+ */
+int command_table_init(const struct command *table, size_t n) {
+
+  uint32_t multiplier;
+  size_t i;
+  int bits, tries, shift;
+
+  // the smallest table with at least twice as many slots as commands
+  for (bits = 1; bits < COMMAND_MAX_SLOT_BITS && ((size_t) 1 << bits) < 2 * n; bits++)
+    ;
+
+  for (; bits <= COMMAND_MAX_SLOT_BITS; bits++) {
+    shift = 32 - bits;
+    multiplier = SEED_MULTIPLIER;
+    for (tries = 0; tries < MAX_MULTIPLIER_TRIES; tries++, multiplier += 2) {
+      memset(slots, 0, sizeof(slots));
+      memset(slot_keys, 0, sizeof(slot_keys));
+      for (i = 0; i < n; i++) {
+        uint32_t key = command_key(table[i].name, strlen(table[i].name));
+        unsigned int slot = slot_of(key, multiplier, shift);
+        if (slots[slot])
+          break;
+        slots[slot] = &table[i];
+        slot_keys[slot] = key;
+      }
+      if (i == n) {
+        slot_multiplier = multiplier;
+        slot_shift = shift;
+        return 0;
+      }
+    }
+  }
+
+  memset(slots, 0, sizeof(slots));
+  memset(slot_keys, 0, sizeof(slot_keys));
+  errno = EEXIST;
+  return -1;
+}
+
+/** Returns the command of the table whose verb has key, or NULL.
+ */
+const struct command *command_find(uint32_t key) {
+
+  unsigned int slot;
+
+  if (!key || slot_shift == 32)
+    return NULL;
+  slot = slot_of(key, slot_multiplier, slot_shift);
+  return slot_keys[slot] == key ? slots[slot] : NULL;
+}
+
+/** Returns the command of the table that the line of len bytes, which
+ *  does not have to be NUL-terminated, would run, or NULL. The line is
+ *  not changed.
+ */
+const struct command *command_find_line(const char *line, size_t len) {
+
+  size_t start = verb_offset(line, len);
+  size_t end = start;
+
+  while (end < len && line[end] != ' ' && line[end] != '\r' && line[end] != '\n')
+    end++;
+  return command_find(command_key(line + start, end - start));
+}
@@ -0,0 +1,44 @@
+/* command.h
+ * Tokenizing and dispatching the command lines of the control
+ * connection. A line is split in place, without copying, and its verb
+ * is looked up in the command table with a perfect hash of the verb
+ * packed into 32 bits.
+ */
+
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMMAND_ANY_ARGS -1 /* max_args of commands that take any number of arguments */
+#define COMMAND_MAX_SLOT_BITS 10
+
+struct session;
+
+/* An entry of the command table */
+struct command {
+  const char *name;      /* the verb, in upper case, at most 4 characters */
+  int         min_args;
+  int         max_args;  /* COMMAND_ANY_ARGS for no limit */
+  int         login;     /* 1 if the client must be logged in */
+  void      (*handler)(struct session *s, char *params); /* params is NULL without arguments */
+  int         transfer;  /* 1 if it is also run while a transfer is in progress */
+};
+
+/* A command line split by command_tokenize(); the pointers are into
+ * the line itself */
+struct command_line {
+  uint32_t    key;       /* the verb packed by command_key(), 0 if it cannot be a verb */
+  char       *verb;      /* the verb, NUL-terminated */
+  char       *params;    /* the arguments with the surrounding spaces removed, or "" */
+  int         num_args;  /* number of space separated words in params */
+};
+
+uint32_t command_key(const char *verb, size_t len);
+void command_tokenize(char *line, struct command_line *cl);
+int command_table_init(const struct command *table, size_t n);
+const struct command *command_find(uint32_t key);
+const struct command *command_find_line(const char *line, size_t len);
+
+#endif
@@ -4,64 +4,618 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include "dir.h"
+#include "strbuf.h"
+#include "pattern.h"
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <strings.h>
+#include <time.h>
 
-/* 
-   Arguments: 
-      fd - a valid open file descriptor. This is not checked for validity
-           or for errors with it is used.
-      directory - a pointer to a null terminated string that names a 
+#define LIST_FLUSH_SIZE (256 * 1024) /* listFiles() writes once this much is rendered */
+
+/*
+   Arguments:
+      r - reader to initialize.
+      directory - a pointer to a null terminated string that names a
                   directory
 
    Returns
+      0 on success.
       -1 the named directory does not exist or you don't have permission
          to read it.
       -2 insufficient resources to perform request
 
- 
-   This function takes the name of a directory and lists all the regular
-   files and directories in the directory. 
- 
+   Opens a directory for reading its entries with dir_next(). The
+   entries are fetched from the kernel with getdents64 into a large
+   buffer, so that a big directory is read with few system calls.
+ */
+
+int dir_open(struct dir_reader *r, const char * directory) {
+
+  r->fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (r->fd == -1)
+    return -1;
+
+  r->buf = malloc(DIR_BUFFER_SIZE);
+  if (!r->buf) {
+    close(r->fd);
+    r->fd = -1;
+    return -2;
+  }
+  r->len = 0;
+  r->pos = 0;
+  r->match = NULL;
+  return 0;
+}
+
+/*
+   Arguments:
+      r - an open reader.
 
+   Returns the next entry of the directory, or NULL after the last one
+   or on error (errno is 0 after the last one). "." and ".." are
+   returned like any other entry. If the reader has a pattern, entries
+   whose names do not match it are skipped here, before anything else
+   is done with them.
  */
 
-int listFiles(int fd, char * directory) {
+struct dirent64 *dir_next(struct dir_reader *r) {
+
+  struct dirent64 *entry;
+  ssize_t n;
+
+  do {
+    if (r->pos >= r->len) {
+      n = getdents64(r->fd, r->buf, DIR_BUFFER_SIZE);
+      if (n <= 0) {
+        errno = n == 0 ? 0 : errno;
+        return NULL;
+      }
+      r->len = n;
+      r->pos = 0;
+    }
+
+    entry = (struct dirent64 *) (r->buf + r->pos);
+    r->pos += entry->d_reclen;
+  } while (r->match && !pattern_match(r->match, entry->d_name, strlen(entry->d_name)));
+
+  return entry;
+}
+
+/*
+   Arguments:
+      r - an open reader.
+
+   Releases the resources of the reader.
+ */
+
+void dir_close(struct dir_reader *r) {
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r->buf);
+  pattern_free(r->match);
+  r->fd  = -1;
+  r->buf = NULL;
+  r->match = NULL;
+}
+
+/*
+   Arguments:
+      r - the reader the entry was returned by.
+      entry - an entry returned by dir_next().
+      want - the statx fields needed besides the file type.
+      stx - where the information about the entry is stored.
+
+   Returns the file type of the entry (DT_REG, DT_DIR, ...), or -1 if
+   the entry could not be looked up, usually because it was removed
+   after the directory was read.
+
+   Looks the entry up relative to the directory, asking the kernel only
+   for the fields in want. Entries whose type the file system did not
+   report are looked up even if want is 0.
+ */
+
+int dir_stat(struct dir_reader *r, struct dirent64 *entry, unsigned int want,
+             struct statx *stx) {
+
+  if (!want && entry->d_type != DT_UNKNOWN)
+    return entry->d_type;
+
+  if (statx(r->fd, entry->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+            want | STATX_TYPE, stx) == -1)
+    return -1;
+  if (entry->d_type != DT_UNKNOWN)
+    return entry->d_type;
+  return IFTODT(stx->stx_mode);
+}
+
+/* Appends the decimal digits of value at p and returns the end. */
+static char *put_number(char *p, unsigned long long value) {
+
+  char digits[20];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+/*
+   Renders the line of one entry into out, in the same format as
+   "F    %-20s     %lld\r\n" for regular files, "D        %s\r\n" for
+   directories and "U        %s\r\n" for anything else, without going
+   through printf.
+
+   Returns 0, or -2 if out could not grow.
+ */
+
+static int render_entry(struct strbuf *out, int type, const char *name,
+                        unsigned long long size) {
+
+  size_t name_len = strlen(name);
+  char *p;
+
+  if (sb_reserve(out, name_len + 64) == -1)
+    return -2;
+  p = out->data + out->len;
+
+  if (type == DT_REG) {
+    memcpy(p, "F    ", 5);
+    p += 5;
+    memcpy(p, name, name_len);
+    p += name_len;
+    if (name_len < 20) {
+      memset(p, ' ', 20 - name_len);
+      p += 20 - name_len;
+    }
+    memcpy(p, "     ", 5);
+    p = put_number(p + 5, size);
+  } else {
+    memcpy(p, type == DT_DIR ? "D        " : "U        ", 9);
+    memcpy(p + 9, name, name_len);
+    p += 9 + name_len;
+  }
+  *p++ = '\r';
+  *p++ = '\n';
 
-  // Get resources to see if the directory can be opened for reading
-  
-  DIR * dir = NULL;
-  
-  dir = opendir(directory);
-  if (!dir) return -1;
-  
-  // Setup to read the directory. When printing the directory
-  // only print regular files and directories. 
-
-  struct dirent *dirEntry;
+  out->len = p - out->data;
+  return 0;
+}
+
+/*
+   Renders the line of an entry returned by dir_next() into out.
+
+   Returns 1 if the entry was rendered, 0 if it was removed since the
+   directory was read, or -2 if out could not grow.
+ */
+
+static int list_entry(struct dir_reader *r, struct dirent64 *entry,
+                      struct strbuf *out) {
+
+  struct statx stx;
+  int type = entry->d_type;
+
+  // Only regular files (and entries of unknown type) need a lookup,
+  // and only for their size
+  if (type == DT_REG || type == DT_UNKNOWN)
+    type = dir_stat(r, entry, STATX_SIZE, &stx);
+  if (type == -1)
+    return 0;
+
+  if (render_entry(out, type, entry->d_name, type == DT_REG ? stx.stx_size : 0) < 0)
+    return -2;
+  return 1;
+}
+
+/*
+   Arguments:
+      r - an open reader.
+      out - buffer the lines are appended to.
+      limit - stop once about this many bytes have been rendered.
+
+   Returns the number of bytes appended to out, 0 once the directory
+   has been listed completely, or -1 on error.
+
+   Renders the next entries of the directory in the format of
+   renderFiles(). Called repeatedly, it streams a listing of any size
+   through a buffer of about limit bytes.
+ */
+
+ssize_t list_render(struct dir_reader *r, struct strbuf *out, size_t limit) {
+
+  size_t start = out->len;
+  struct dirent64 *entry;
+
+  while (out->len - start < limit) {
+    entry = dir_next(r);
+    if (!entry) {
+      if (errno)
+        return -1;
+      break;
+    }
+    if (list_entry(r, entry, out) < 0)
+      return -1;
+  }
+  return out->len - start;
+}
+
+/*
+   Arguments:
+      out - buffer the listing is appended to.
+      directory - a pointer to a null terminated string that names a
+                  directory
+      fd - if not -1, the rendered lines are written to fd whenever
+           LIST_FLUSH_SIZE bytes are pending.
+
+   Returns the number of entries listed, or the error values of
+   renderFiles().
+ */
+
+static int render_dir(struct strbuf *out, char * directory, int fd) {
+
+  struct dir_reader r;
+  struct dirent64 *entry;
   int entriesPrinted = 0;
-  
-  for (dirEntry = readdir(dir);
-       dirEntry;
-       dirEntry = readdir(dir)) {
-    if (dirEntry->d_type == DT_REG) {  // Regular file
-      struct stat buf;
-
-      // This call really should check the return value
-      stat(dirEntry->d_name, &buf);
-
-	dprintf(fd, "F    %-20s     %lld\r\n", dirEntry->d_name, buf.st_size);
-    } else if (dirEntry->d_type == DT_DIR) { // Directory
-      dprintf(fd, "D        %s\r\n", dirEntry->d_name);
-    } else {
-      dprintf(fd, "U        %s\r\n", dirEntry->d_name);
+  int rv;
+
+  rv = dir_open(&r, directory);
+  if (rv < 0)
+    return rv;
+
+  while ((entry = dir_next(&r)) != NULL) {
+    rv = list_entry(&r, entry, out);
+    if (rv == -2) {
+      dir_close(&r);
+      return -2;
+    }
+    entriesPrinted += rv;
+
+    while (fd >= 0 && sb_pending(out) >= LIST_FLUSH_SIZE) {
+      ssize_t n = write(fd, sb_head(out), sb_pending(out));
+      if (n <= 0) {
+        dir_close(&r);
+        return -2;
+      }
+      sb_consume(out, n);
+    }
+  }
+
+  rv = errno;
+  dir_close(&r);
+  return rv ? -1 : entriesPrinted;
+}
+
+/*
+   Arguments:
+      out - buffer the listing is appended to.
+      directory - a pointer to a null terminated string that names a
+                  directory
+
+   Returns
+      -1 the named directory does not exist or you don't have permission
+         to read it.
+      -2 insufficient resources to perform request
+
+
+   This function takes the name of a directory and renders a listing of
+   all the regular files and directories in the directory into out.
+
+
+ */
+
+int renderFiles(struct strbuf *out, char * directory) {
+  return render_dir(out, directory, -1);
+}
+
+/*
+   Arguments:
+      fd - a valid open file descriptor. This is not checked for validity
+           or for errors with it is used.
+      directory - a pointer to a null terminated string that names a
+                  directory
+
+   Returns the same values as renderFiles.
+
+   This function takes the name of a directory and lists all the regular
+   files and directories in the directory on fd. The listing is written
+   in large blocks rather than line by line.
+ */
+
+int listFiles(int fd, char * directory) {
+
+  struct strbuf out;
+  sb_init(&out);
+
+  int entriesPrinted = render_dir(&out, directory, fd);
+  while (entriesPrinted >= 0 && sb_pending(&out)) {
+    ssize_t rv = write(fd, sb_head(&out), sb_pending(&out));
+    if (rv <= 0) {
+      entriesPrinted = -2;
+      break;
     }
-    entriesPrinted++;
+    sb_consume(&out, rv);
   }
-  
-  // Release resources
-  closedir(dir);
+
+  sb_free(&out);
   return entriesPrinted;
 }
 
-   
+/* Names of the MLSX_* facts, in the order of their bits */
+static const char *fact_names[] = { "type", "size", "modify", "unique", "perm" };
+
+#define NUM_FACTS (sizeof(fact_names) / sizeof(fact_names[0]))
+
+/*
+   Arguments:
+      list - the argument of OPTS MLST, a list of fact names each
+             followed by ';', as in "type;size;modify;".
+
+   Returns the MLSX_* bits of the facts named in list. Names of facts
+   that are not supported are ignored, as RFC 3659 requires.
+ */
+
+unsigned int mlsx_parse_facts(const char *list) {
+
+  unsigned int facts = 0;
+  size_t len, i;
+
+  while (*list) {
+    len = strcspn(list, ";");
+    for (i = 0; i < NUM_FACTS; i++)
+      if (strlen(fact_names[i]) == len && !strncasecmp(list, fact_names[i], len))
+        facts |= 1 << i;
+    list += len;
+    if (*list == ';')
+      list++;
+  }
+  return facts;
+}
+
+/*
+   Appends the names of the facts, each followed by ';', to out.
+
+   Returns 0, or -2 if out could not grow.
+ */
+
+int mlsx_format_facts(struct strbuf *out, unsigned int facts) {
+
+  size_t i;
+
+  for (i = 0; i < NUM_FACTS; i++)
+    if (facts & (1 << i))
+      if (sb_printf(out, "%s;", fact_names[i]) == -1)
+        return -2;
+  return 0;
+}
+
+/* Appends the lowercase hex digits of value at p and returns the end. */
+static char *put_hex(char *p, unsigned long long value) {
+
+  char digits[16];
+  int n = 0;
+
+  do {
+    digits[n++] = "0123456789abcdef"[value & 15];
+    value >>= 4;
+  } while (value);
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+/* Appends value as exactly two decimal digits at p and returns the end. */
+static char *put_2digits(char *p, int value) {
+  *p++ = '0' + value / 10;
+  *p++ = '0' + value % 10;
+  return p;
+}
+
+/* Returns 1 if the process may access the file described by stx in the
+   way given by bit (4 read, 2 write, 1 execute), judging only by its
+   mode. */
+static int may_access(const struct statx *stx, unsigned int bit) {
+
+  uid_t uid = geteuid();
+
+  if (uid == 0)
+    return bit != 1 || (stx->stx_mode & 0111);
+  if (stx->stx_uid == uid)
+    return (stx->stx_mode >> 6) & bit;
+  if (stx->stx_gid == getegid())
+    return (stx->stx_mode >> 3) & bit;
+  return stx->stx_mode & bit;
+}
+
+/* Returns the statx fields needed for facts. */
+static unsigned int facts_statx_mask(unsigned int facts) {
+
+  unsigned int want = 0;
+
+  if (facts & MLSX_SIZE)
+    want |= STATX_SIZE;
+  if (facts & MLSX_MODIFY)
+    want |= STATX_MTIME;
+  if (facts & MLSX_UNIQUE)
+    want |= STATX_INO;
+  if (facts & MLSX_PERM)
+    want |= STATX_MODE | STATX_UID | STATX_GID;
+  return want;
+}
+
+/* Returns the value of the type fact of an entry of a listing. */
+static const char *fact_type(int type, const char *name) {
+
+  if (type == DT_DIR) {
+    if (!strcmp(name, "."))
+      return "cdir";
+    if (!strcmp(name, ".."))
+      return "pdir";
+    return "dir";
+  }
+  if (type == DT_REG)
+    return "file";
+  if (type == DT_LNK)
+    return "OS.unix=slink";
+  return "OS.unix=special";
+}
+
+/*
+   Renders the facts of one file followed by a space, its name and
+   CRLF into out, without going through printf. Only the facts in
+   facts are rendered, and of those only the ones that apply to the
+   type of the file. stx needs the fields of facts_statx_mask().
+
+   Returns 0, or -2 if out could not grow.
+ */
+
+static int render_facts(struct strbuf *out, unsigned int facts, int type,
+                        const char *type_name, const struct statx *stx,
+                        const char *name) {
+
+  size_t name_len = strlen(name);
+  struct tm tm;
+  time_t mtime;
+  char *p;
+
+  if (sb_reserve(out, name_len + 128) == -1)
+    return -2;
+  p = out->data + out->len;
+
+  if (facts & MLSX_TYPE) {
+    p = stpcpy(p, "type=");
+    p = stpcpy(p, type_name);
+    *p++ = ';';
+  }
+  if ((facts & MLSX_SIZE) && type == DT_REG) {
+    p = stpcpy(p, "size=");
+    p = put_number(p, stx->stx_size);
+    *p++ = ';';
+  }
+  if (facts & MLSX_MODIFY) {
+    mtime = stx->stx_mtime.tv_sec;
+    gmtime_r(&mtime, &tm);
+    p = stpcpy(p, "modify=");
+    p = put_number(p, tm.tm_year + 1900);
+    p = put_2digits(p, tm.tm_mon + 1);
+    p = put_2digits(p, tm.tm_mday);
+    p = put_2digits(p, tm.tm_hour);
+    p = put_2digits(p, tm.tm_min);
+    p = put_2digits(p, tm.tm_sec);
+    *p++ = ';';
+  }
+  if (facts & MLSX_UNIQUE) {
+    p = stpcpy(p, "unique=");
+    p = put_hex(p, makedev(stx->stx_dev_major, stx->stx_dev_minor));
+    *p++ = 'g';
+    p = put_hex(p, stx->stx_ino);
+    *p++ = ';';
+  }
+  if (facts & MLSX_PERM) {
+    // only the operations this server supports are listed
+    p = stpcpy(p, "perm=");
+    if (type == DT_DIR) {
+      if (may_access(stx, 1))
+        *p++ = 'e';
+      if (may_access(stx, 4))
+        *p++ = 'l';
+      if (may_access(stx, 2) && may_access(stx, 1))
+        *p++ = 'c';
+    } else if (type == DT_REG) {
+      if (may_access(stx, 4))
+        *p++ = 'r';
+      if (may_access(stx, 2)) {
+        *p++ = 'a';
+        *p++ = 'w';
+      }
+    }
+    *p++ = ';';
+  }
+
+  *p++ = ' ';
+  memcpy(p, name, name_len);
+  p += name_len;
+  *p++ = '\r';
+  *p++ = '\n';
+
+  out->len = p - out->data;
+  return 0;
+}
+
+/*
+   Arguments:
+      r - an open reader.
+      out - buffer the MLSD lines are appended to.
+      facts - the MLSX_* facts to render.
+      limit - stop once about this many bytes have been rendered.
+
+   Returns the number of bytes appended to out, 0 once the directory
+   has been listed completely, or -1 on error.
+
+   Renders the next entries of the directory in the MLSD format.
+   Called repeatedly, it streams a listing of any size through a
+   buffer of about limit bytes.
+ */
+
+ssize_t mlsd_render(struct dir_reader *r, struct strbuf *out, unsigned int facts,
+                    size_t limit) {
+
+  unsigned int want = facts_statx_mask(facts);
+  size_t start = out->len;
+  struct dirent64 *entry;
+  struct statx stx;
+  int type;
+
+  while (out->len - start < limit) {
+    entry = dir_next(r);
+    if (!entry) {
+      if (errno)
+        return -1;
+      break;
+    }
+    type = dir_stat(r, entry, want, &stx);
+    if (type == -1)
+      continue;  // removed since the directory was read
+    if (render_facts(out, facts, type, fact_type(type, entry->d_name), &stx,
+                     entry->d_name) < 0)
+      return -1;
+  }
+  return out->len - start;
+}
+
+/*
+   Arguments:
+      out - buffer the line is appended to.
+      facts - the MLSX_* facts to render.
+      path - the file to describe.
+      name - the name the file is shown with.
+
+   Returns
+      0 on success.
+      -1 the file does not exist or cannot be looked up.
+      -2 insufficient resources to perform request
+
+   Renders the MLST line of a single file, which starts with a space.
+ */
+
+int mlst_render(struct strbuf *out, unsigned int facts, const char *path,
+                const char *name) {
+
+  struct statx stx;
+  int type;
+
+  if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW,
+            facts_statx_mask(facts) | STATX_TYPE, &stx) == -1)
+    return -1;
+  type = IFTODT(stx.stx_mode);
+  if (sb_append(out, " ", 1) == -1)
+    return -2;
+  return render_facts(out, facts, type, fact_type(type, ""), &stx, name);
+}
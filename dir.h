@@ -1,7 +1,47 @@
+
 #ifndef _DIRH__
 
 #define _DIRH__
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define DIR_BUFFER_SIZE (64 * 1024) /* bytes of directory entries fetched per getdents64 call */
+
+/* Facts of MLSD and MLST lines (RFC 3659), selected with OPTS MLST */
+#define MLSX_TYPE   0x01
+#define MLSX_SIZE   0x02
+#define MLSX_MODIFY 0x04
+#define MLSX_UNIQUE 0x08
+#define MLSX_PERM   0x10
+#define MLSX_ALL    0x1f
+
+struct strbuf;
+struct pattern;
+
+/* Reads the entries of a directory in large batches */
+struct dir_reader {
+  int    fd;
+  char  *buf;
+  size_t len;  /* bytes of entries in buf */
+  size_t pos;  /* offset of the next entry in buf */
+  struct pattern *match; /* if not NULL, only names matching it are returned; freed by dir_close() */
+};
+
 int listFiles(int, char*);
+int renderFiles(struct strbuf *, char*);
+
+int dir_open(struct dir_reader *r, const char *directory);
+struct dirent64 *dir_next(struct dir_reader *r);
+int dir_stat(struct dir_reader *r, struct dirent64 *entry, unsigned int want, struct statx *stx);
+void dir_close(struct dir_reader *r);
+ssize_t list_render(struct dir_reader *r, struct strbuf *out, size_t limit);
+
+unsigned int mlsx_parse_facts(const char *list);
+int mlsx_format_facts(struct strbuf *out, unsigned int facts);
+ssize_t mlsd_render(struct dir_reader *r, struct strbuf *out, unsigned int facts, size_t limit);
+int mlst_render(struct strbuf *out, unsigned int facts, const char *path, const char *name);
 
 #endif
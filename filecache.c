@@ -0,0 +1,634 @@
+/* filecache.c
+ * Cache of the contents of small files, shared by every worker.
+ *
+ * Entries are found by the device and inode of the file, so every
+ * name of a file (relative paths, hard links, symbolic links) finds
+ * the same entry. A lookup stats the path, which is the only system
+ * call of a hit, and only serves the entry if the file still has the
+ * modification time and size its data was read with.
+ *
+ * The directory every entry was loaded from is watched with inotify,
+ * and a thread of the cache applies the events as they arrive, so the
+ * workers never read them. This is what keeps the rendered listings
+ * of directories fresh: a change to the size of a file does not
+ * change the directory itself. Watches are indexed by descriptor, each
+ * with the list of its entries, and a watch is removed with its last
+ * entry. A loader pins the watch of its directory before it reads, so
+ * that a change made while it reads keeps the result out of the cache.
+ *
+ * The lock of the cache is only held to look up, add or drop entries,
+ * never during a read of a file or of the inotify descriptor.
+ *
+ * When the memory budget is full, entries are evicted with the CLOCK
+ * algorithm. An entry that is evicted or invalidated while transfers
+ * are still sending its data is freed when the last of them is done.
+ */
+
+#include "filecache.h"
+#include "strbuf.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/* Changes to a directory entry that make cached data stale */
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* The inotify watch of a directory */
+struct watch {
+  int                 wd;
+  struct watch       *next;     /* next watch in the same hash bucket */
+  struct cache_entry *entries;  /* loaded from the directory */
+  int                 pins;     /* loaders reading from the directory */
+  unsigned            changes;  /* events seen for the directory */
+  int                 gone;     /* out of the index, the kernel removed it */
+};
+
+static struct {
+  pthread_mutex_t      lock;
+  int                  enabled;
+  int                  inotify_fd;
+  size_t               budget;
+  size_t               max_file_size;
+  struct cache_entry  *buckets[FILECACHE_BUCKETS];
+  struct watch        *watches[FILECACHE_WATCH_BUCKETS];
+  struct cache_entry  *clock[FILECACHE_MAX_ENTRIES];
+  int                  hand;
+  struct filecache_stats stats;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1 };
+
+static void *watch_main(void *arg);
+
+/** Returns the hash bucket of the file (listing is 0) or directory
+ *  listing (listing is 1) with the given identity.
+ */
+static unsigned hash_identity(dev_t dev, ino_t ino, int listing) {
+
+  uint64_t h = ((uint64_t) ino ^ ((uint64_t) dev << 32) ^ listing) * 0x9e3779b97f4a7c15ull;
+
+  return (h >> 32) % FILECACHE_BUCKETS;
+}
+
+/** Enables the cache with a budget of the given number of bytes. A
+ *  budget of 0 leaves the cache disabled.
+ *
+ *  Returns: 0 on success, -1 if the cache could not be enabled.
+ */
+int filecache_init(size_t budget) {
+
+  pthread_t thread;
+
+  if (budget == 0)
+    return 0;
+
+  // the thread of the cache waits for the events
+  cache.inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (cache.inotify_fd == -1) {
+    perror("filecache: inotify_init1");
+    return -1;
+  }
+  if (pthread_create(&thread, NULL, watch_main, NULL) != 0) {
+    fprintf(stderr, "filecache: cannot start the inotify thread\n");
+    close(cache.inotify_fd);
+    return -1;
+  }
+  pthread_detach(thread);
+
+  cache.budget        = budget;
+  cache.max_file_size = budget / 4 < FILECACHE_MAX_FILE_SIZE ? budget / 4 : FILECACHE_MAX_FILE_SIZE;
+  cache.stats.budget  = budget;
+  cache.enabled       = 1;
+  return 0;
+}
+
+/** Returns the watch with descriptor wd, or NULL if there is none.
+ *  Called with the lock held.
+ */
+static struct watch *find_watch(int wd) {
+
+  struct watch *w;
+
+  for (w = cache.watches[wd % FILECACHE_WATCH_BUCKETS]; w; w = w->next) {
+    if (w->wd == wd)
+      return w;
+  }
+  return NULL;
+}
+
+/** Takes a watch out of the index, once the kernel removed it or it
+ *  is about to be. Called with the lock held.
+ */
+static void watch_unlink(struct watch *w) {
+
+  struct watch **p = &cache.watches[w->wd % FILECACHE_WATCH_BUCKETS];
+
+  while (*p != w)
+    p = &(*p)->next;
+  *p = w->next;
+  w->gone = 1;
+}
+
+/** Removes a watch that has no entries and no loaders left, from the
+ *  kernel too unless it is gone already. Called with the lock held.
+ */
+static void watch_release(struct watch *w) {
+  if (w->entries || w->pins)
+    return;
+  if (!w->gone) {
+    inotify_rm_watch(cache.inotify_fd, w->wd);
+    watch_unlink(w);
+  }
+  free(w);
+}
+
+/** Watches the directory named by the first len bytes of path and pins
+ *  its watch, so that it stays while the caller reads from the
+ *  directory.
+ *
+ *  Returns: the watch, to be given back with watch_unpin() or to an
+ *           entry with insert(), or NULL on error. changes is set to
+ *           the number of events the watch has seen so far.
+ */
+static struct watch *watch_pin(const char *path, size_t len, unsigned *changes) {
+
+  char dir[PATH_MAX];
+  struct watch *w;
+  int wd;
+
+  if (len >= sizeof(dir))
+    return NULL;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+
+  pthread_mutex_lock(&cache.lock);
+  wd = inotify_add_watch(cache.inotify_fd, dir[0] ? dir : "/", WATCH_EVENTS | IN_ONLYDIR);
+  if (wd == -1) {
+    pthread_mutex_unlock(&cache.lock);
+    return NULL;
+  }
+  if ((w = find_watch(wd)) == NULL) {
+    if ((w = calloc(1, sizeof(*w))) == NULL) {
+      inotify_rm_watch(cache.inotify_fd, wd);
+      pthread_mutex_unlock(&cache.lock);
+      return NULL;
+    }
+    w->wd = wd;
+    w->next = cache.watches[wd % FILECACHE_WATCH_BUCKETS];
+    cache.watches[wd % FILECACHE_WATCH_BUCKETS] = w;
+  }
+  w->pins++;
+  *changes = w->changes;
+  pthread_mutex_unlock(&cache.lock);
+  return w;
+}
+
+/** Gives back a watch pinned by a loader that cached nothing.
+ */
+static void watch_unpin(struct watch *w) {
+  pthread_mutex_lock(&cache.lock);
+  w->pins--;
+  watch_release(w);
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/** Drops a reference to an entry, freeing it with the last one.
+ *  Called with the lock held.
+ */
+static void entry_unref(struct cache_entry *e) {
+  if (--e->refs > 0)
+    return;
+  free(e->data);
+  free(e->path);
+  free(e);
+}
+
+/** Removes an entry from the cache, and the watch of its directory
+ *  with its last entry. Transfers that still use its data keep it
+ *  alive. Called with the lock held.
+ */
+static void entry_remove(struct cache_entry *e) {
+
+  struct cache_entry **p = &cache.buckets[hash_identity(e->dev, e->ino, e->listing)];
+  struct watch *w = e->watch;
+
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+
+  if (e->watch_prev)
+    e->watch_prev->watch_next = e->watch_next;
+  else
+    w->entries = e->watch_next;
+  if (e->watch_next)
+    e->watch_next->watch_prev = e->watch_prev;
+  watch_release(w);
+
+  cache.clock[e->slot] = NULL;
+  cache.stats.entries--;
+  cache.stats.bytes -= e->size;
+  entry_unref(e);
+}
+
+/** Removes the entries that were read from the directory of watch w,
+ *  or only the one named name in it (and the listing of the directory)
+ *  if name is not NULL. Called with the lock held; w is freed with its
+ *  last entry unless it is pinned.
+ */
+static void invalidate(struct watch *w, const char *name) {
+
+  struct cache_entry *e, *next;
+
+  w->changes++;
+  for (e = w->entries; e; e = next) {
+    next = e->watch_next;
+    if (!name || e->listing || !strcmp(e->name, name)) {
+      entry_remove(e);
+      cache.stats.invalidations++;
+    }
+  }
+}
+
+/** Removes every entry, when events were lost. Called with the lock
+ *  held.
+ */
+static void invalidate_all(void) {
+
+  struct cache_entry *e;
+  struct watch *w;
+  int i;
+
+  for (i = 0; i < FILECACHE_WATCH_BUCKETS; i++) {
+    for (w = cache.watches[i]; w; w = w->next)
+      w->changes++;
+  }
+  for (i = 0; i < FILECACHE_MAX_ENTRIES; i++) {
+    if ((e = cache.clock[i]) != NULL) {
+      entry_remove(e);
+      cache.stats.invalidations++;
+    }
+  }
+}
+
+/** Applies the n bytes of inotify events in buf to the cache. Called
+ *  with the lock held.
+ */
+static void apply_events(const char *buf, ssize_t n) {
+
+  const struct inotify_event *ev;
+  const char *p;
+  struct watch *w;
+
+  for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+    ev = (const struct inotify_event *) p;
+    if (ev->mask & IN_Q_OVERFLOW) {
+      invalidate_all();
+    } else if ((w = find_watch(ev->wd)) == NULL) {
+      continue;
+    } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+      // held, so that it outlives its entries
+      w->pins++;
+      invalidate(w, NULL);
+      // after IN_IGNORED the wd may be given to another directory; the
+      // loaders still pinning the watch will not cache what they read
+      if (ev->mask & IN_IGNORED)
+        watch_unlink(w);
+      w->pins--;
+      watch_release(w);
+    } else if (ev->len) {
+      invalidate(w, ev->name);
+    }
+  }
+}
+
+/** The thread of the cache: reads the inotify events as they arrive
+ *  and applies them.
+ */
+static void *watch_main(void *arg) {
+
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+
+  while (1) {
+    n = read(cache.inotify_fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      log_perror(0, "filecache: inotify read");
+      // nothing tells the cache about changes any more
+      pthread_mutex_lock(&cache.lock);
+      cache.enabled = 0;
+      invalidate_all();
+      pthread_mutex_unlock(&cache.lock);
+      return NULL;
+    }
+    pthread_mutex_lock(&cache.lock);
+    apply_events(buf, n);
+    pthread_mutex_unlock(&cache.lock);
+  }
+  return NULL;
+}
+
+/** Looks up the entry of the file (listing is 0) or directory listing
+ *  (listing is 1) with the given identity. Called with the lock held.
+ */
+static struct cache_entry *lookup(dev_t dev, ino_t ino, int listing) {
+
+  struct cache_entry *e;
+
+  for (e = cache.buckets[hash_identity(dev, ino, listing)]; e; e = e->next) {
+    if (e->ino == ino && e->dev == dev && e->listing == listing)
+      return e;
+  }
+  return NULL;
+}
+
+/** Returns 1 if the data of entry e was read from the file as st
+ *  describes it now. A listing is checked against the time its
+ *  directory last changed; the sizes of its files are watched instead.
+ */
+static int same_version(const struct cache_entry *e, const struct stat *st) {
+  return e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+         (e->listing || e->size == st->st_size);
+}
+
+/** Evicts entries with the CLOCK algorithm until size more bytes and
+ *  one more entry fit in the cache, and returns a free slot of the
+ *  clock. Called with the lock held.
+ */
+static int make_room(size_t size) {
+
+  struct cache_entry *e;
+
+  while (cache.stats.bytes + size > cache.budget ||
+         cache.stats.entries == FILECACHE_MAX_ENTRIES) {
+    e = cache.clock[cache.hand];
+    if (e && e->referenced) {
+      e->referenced = 0;  // second chance
+    } else if (e) {
+      entry_remove(e);
+      cache.stats.evictions++;
+    }
+    cache.hand = (cache.hand + 1) % FILECACHE_MAX_ENTRIES;
+  }
+
+  while (cache.clock[cache.hand])
+    cache.hand = (cache.hand + 1) % FILECACHE_MAX_ENTRIES;
+  return cache.hand;
+}
+
+/** Returns a referenced entry of the given kind for path, or NULL if
+ *  there is none or the file changed since it was cached.
+ */
+static struct cache_entry *get(const char *path, int listing) {
+
+  struct cache_entry *e;
+  struct stat st;
+
+  if (!cache.enabled)
+    return NULL;
+
+  if (stat(path, &st) == -1 || !(listing ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode)))
+    return NULL;
+
+  pthread_mutex_lock(&cache.lock);
+  e = lookup(st.st_dev, st.st_ino, listing);
+  if (e && !same_version(e, &st)) {
+    entry_remove(e);
+    cache.stats.invalidations++;
+    e = NULL;
+  }
+  if (e) {
+    e->refs++;
+    e->referenced = 1;
+    cache.stats.hits++;
+  } else {
+    cache.stats.misses++;
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return e;
+}
+
+/** Adds a complete entry, read from the directory of the pinned watch
+ *  w, to the cache. If another worker added the same version of the
+ *  file first, the caller gets that one instead; if the directory
+ *  changed since the watch was pinned (changes no longer matches),
+ *  nothing is cached.
+ *
+ *  Returns: a referenced entry, or NULL if nothing was cached.
+ */
+static struct cache_entry *insert(struct cache_entry *e, struct watch *w, unsigned changes) {
+
+  struct cache_entry *old;
+  unsigned bucket = hash_identity(e->dev, e->ino, e->listing);
+  struct stat st;
+
+  e->refs = 2;  // the cache and the caller
+  st.st_mtim = e->mtime;
+  st.st_size = e->size;
+
+  pthread_mutex_lock(&cache.lock);
+  w->pins--;
+  if (w->gone || w->changes != changes || !cache.enabled) {
+    watch_release(w);
+    pthread_mutex_unlock(&cache.lock);
+    free(e->data);
+    free(e->path);
+    free(e);
+    return NULL;
+  }
+
+  old = lookup(e->dev, e->ino, e->listing);
+  if (old && (e->listing || same_version(old, &st))) {
+    old->refs++;
+    watch_release(w);
+    pthread_mutex_unlock(&cache.lock);
+    free(e->data);
+    free(e->path);
+    free(e);
+    return old;
+  }
+  if (old) {
+    entry_remove(old);
+    cache.stats.invalidations++;
+  }
+
+  // linked to the watch first, so that making room cannot remove it
+  e->watch = w;
+  e->watch_prev = NULL;
+  e->watch_next = w->entries;
+  if (w->entries)
+    w->entries->watch_prev = e;
+  w->entries = e;
+
+  e->slot = make_room(e->size);
+  cache.clock[e->slot] = e;
+  e->next = cache.buckets[bucket];
+  cache.buckets[bucket] = e;
+  cache.stats.entries++;
+  cache.stats.bytes += e->size;
+  pthread_mutex_unlock(&cache.lock);
+  return e;
+}
+
+/** Returns the cached contents of path, or NULL if they are not in
+ *  the cache. The caller must give the entry back with
+ *  filecache_put() once it is done with its data.
+ */
+struct cache_entry *filecache_get(const char *path) {
+  return get(path, 0);
+}
+
+/** Returns the cached listing of the directory at path, or NULL if it
+ *  is not in the cache. The caller must give the entry back with
+ *  filecache_put().
+ */
+struct cache_entry *filecache_get_listing(const char *path) {
+  return get(path, 1);
+}
+
+/** Reads the file open on fd, found at path, into the cache, unless
+ *  it is too large or changed while it was read. The file is read
+ *  without holding the lock, so the other workers are not held back.
+ *
+ *  Returns: the new entry, to be given back with filecache_put(), or
+ *           NULL if the file was not cached.
+ */
+struct cache_entry *filecache_load(const char *path, int fd) {
+
+  struct cache_entry *e;
+  struct stat before, after;
+  const char *slash = strrchr(path, '/');
+  struct watch *w;
+  unsigned changes;
+  size_t done = 0;
+  ssize_t n;
+
+  if (!cache.enabled || !slash)
+    return NULL;
+
+  if (fstat(fd, &before) == -1 || !S_ISREG(before.st_mode) ||
+      (size_t) before.st_size > cache.max_file_size)
+    return NULL;
+
+  // watch the directory before reading, so no change can go unnoticed
+  if ((w = watch_pin(path, slash - path, &changes)) == NULL)
+    return NULL;
+
+  e = calloc(1, sizeof(*e));
+  if (!e) {
+    watch_unpin(w);
+    return NULL;
+  }
+  e->path = strdup(path);
+  e->data = malloc(before.st_size ? before.st_size : 1);
+  if (!e->path || !e->data)
+    goto fail;
+
+  while (done < (size_t) before.st_size) {
+    n = pread(fd, e->data + done, before.st_size - done, done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      goto fail;
+    done += n;
+  }
+
+  if (fstat(fd, &after) == -1 || after.st_size != before.st_size ||
+      after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+      after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)
+    goto fail;
+
+  e->name  = e->path + (slash - path) + 1;
+  e->dev   = after.st_dev;
+  e->ino   = after.st_ino;
+  e->mtime = after.st_mtim;
+  e->size  = after.st_size;
+  return insert(e, w, changes);
+
+fail:
+  watch_unpin(w);
+  free(e->data);
+  free(e->path);
+  free(e);
+  return NULL;
+}
+
+/** Renders the listing of the directory at path with render and adds
+ *  it to the cache. render appends the listing to the buffer it is
+ *  given and returns a negative value on error, like renderFiles().
+ *
+ *  Returns: the new entry, to be given back with filecache_put(), or
+ *           NULL if the listing could not be rendered or cached.
+ */
+struct cache_entry *filecache_load_listing(const char *path,
+                                           int (*render)(struct strbuf *, char *)) {
+
+  struct cache_entry *e;
+  struct strbuf out;
+  struct stat st;
+  struct watch *w;
+  unsigned changes;
+
+  if (!cache.enabled)
+    return NULL;
+
+  // watch the directory before listing it, so no change can go unnoticed
+  if ((w = watch_pin(path, strlen(path), &changes)) == NULL)
+    return NULL;
+  if (stat(path, &st) == -1 || (e = calloc(1, sizeof(*e))) == NULL) {
+    watch_unpin(w);
+    return NULL;
+  }
+  e->path = strdup(path);
+  sb_init(&out);
+  if (!e->path || render(&out, e->path) < 0 || out.len > cache.budget / 4) {
+    watch_unpin(w);
+    sb_free(&out);
+    free(e->path);
+    free(e);
+    return NULL;
+  }
+
+  // the entry takes over the rendered buffer
+  e->data    = out.data ? out.data : malloc(1);
+  e->name    = e->path;
+  e->listing = 1;
+  e->dev     = st.st_dev;
+  e->ino     = st.st_ino;
+  e->mtime   = st.st_mtim;
+  e->size    = out.len;
+  if (!e->data) {
+    watch_unpin(w);
+    free(e->path);
+    free(e);
+    return NULL;
+  }
+  return insert(e, w, changes);
+}
+
+/** Gives back an entry returned by filecache_get(), filecache_load()
+ *  or one of their listing counterparts.
+ */
+void filecache_put(struct cache_entry *e) {
+  pthread_mutex_lock(&cache.lock);
+  entry_unref(e);
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/** Copies the counters of the cache to st.
+ */
+void filecache_get_stats(struct filecache_stats *st) {
+  pthread_mutex_lock(&cache.lock);
+  *st = cache.stats;
+  pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,67 @@
+/* filecache.h
+ * Cache of the contents of small files and of rendered directory
+ * listings, shared by every worker. A file or listing that is
+ * requested again is sent from memory after a single stat(2) shows
+ * that it is still the same file, unchanged; inotify reports the
+ * changes a stat cannot see, such as those to the entries of a listed
+ * directory.
+ */
+
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FILECACHE_DEFAULT_BUDGET (64 * 1024 * 1024) /* bytes of file data kept in memory */
+#define FILECACHE_MAX_FILE_SIZE (1024 * 1024)        /* larger files are never cached */
+#define FILECACHE_MAX_ENTRIES 8192
+#define FILECACHE_BUCKETS 4096
+#define FILECACHE_WATCH_BUCKETS 1024
+
+struct watch;
+
+struct cache_entry {
+  struct cache_entry *next;     /* next entry in the same hash bucket */
+  char               *path;     /* path it was loaded from, one of its names */
+  const char         *name;     /* last component of path */
+  struct watch       *watch;    /* inotify watch of the directory of path */
+  struct cache_entry *watch_prev, *watch_next; /* entries of the same watch */
+  int                 slot;     /* position in the clock */
+  int                 refs;     /* 1 while cached, plus 1 per transfer using data */
+  int                 referenced; /* used since the clock hand last passed */
+  int                 listing;  /* 1 if data is the listing of the directory at path */
+
+  /* identity of the file (or directory) the data was read from: the
+     entry is found by dev and ino, and only served while the file
+     still has the same mtime and size */
+  dev_t               dev;
+  ino_t               ino;
+  struct timespec     mtime;
+  off_t               size;
+  char               *data;
+};
+
+struct strbuf;
+
+struct filecache_stats {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;     /* entries dropped to make room */
+  unsigned long long invalidations; /* entries dropped because the file changed */
+  size_t             entries;
+  size_t             bytes;
+  size_t             budget;
+};
+
+int filecache_init(size_t budget);
+struct cache_entry *filecache_get(const char *path);
+struct cache_entry *filecache_load(const char *path, int fd);
+struct cache_entry *filecache_get_listing(const char *path);
+struct cache_entry *filecache_load_listing(const char *path,
+                                           int (*render)(struct strbuf *, char *));
+void filecache_put(struct cache_entry *e);
+void filecache_get_stats(struct filecache_stats *st);
+
+#endif
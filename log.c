@@ -0,0 +1,307 @@
+/* log.c
+ * Asynchronous logging (see log.h).
+ *
+ * Every thread gets a ring of records (see ring.h) the first time it
+ * logs, so logging never takes a lock nor makes a system call. The
+ * records of a thread come out in the order it logged them; those of
+ * different threads are interleaved one pass of the background thread
+ * at a time.
+ */
+
+#include "log.h"
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_LINE_MAX 512
+#define LOG_OUT_SIZE (64 * 1024)
+
+int log_level = LOG_INFO;
+
+static struct ring *rings;              /* every ring, the newest first */
+static __thread struct ring *thread_ring;
+static __thread int thread_worker = -1;
+static uint64_t lost, lost_reported;    /* records of threads that got no ring */
+
+static int log_fd = STDERR_FILENO;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static char out[LOG_OUT_SIZE];          /* formatted lines, under drain_lock */
+static size_t out_used;
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+/** Returns the ring of the calling thread, creating it the first time,
+ *  or NULL if there is no memory for it.
+ */
+static struct ring *get_ring(void) {
+  if (!thread_ring)
+    thread_ring = ring_create(&rings, LOG_RING_RECORDS, sizeof(struct log_record), thread_worker);
+  return thread_ring;
+}
+
+/** Returns the next free record of the calling thread's ring, filled
+ *  in but for its text, or NULL if the record has to be dropped. The
+ *  record is only seen by the flusher after log_commit().
+ */
+static struct log_record *log_begin(int level, uint64_t session, int err) {
+
+  struct ring *r = get_ring();
+  struct log_record *rec;
+  struct timespec ts;
+
+  if (!r) {
+    __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  if ((rec = ring_reserve(r)) == NULL)
+    return NULL;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->time_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->session = session;
+  rec->err     = err;
+  rec->level   = level;
+  rec->worker  = thread_worker;
+  return rec;
+}
+
+/** Hands the record of the last log_begin() over to the flusher.
+ */
+static void log_commit(void) {
+  ring_commit(thread_ring);
+}
+
+/** Logs a message, if level is not above log_level. Called through
+ *  log_msg().
+ *
+ *  Parameters: level: LOG_ERROR to LOG_DEBUG.
+ *              session: id of the session the message is about, or 0.
+ *              fmt: printf-like format of the message, which is cut at
+ *                   the size of a record.
+ *
+ *  errno is left as it was, so that it can still be looked at.
+ */
+void log_write(int level, uint64_t session, const char *fmt, ...) {
+
+  struct log_record *rec;
+  int err = errno;
+  va_list args;
+
+  if (level > log_level)
+    return;
+  if ((rec = log_begin(level, session, 0)) != NULL) {
+    va_start(args, fmt);
+    vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+    va_end(args);
+    log_commit();
+  }
+  errno = err;
+}
+
+/** Logs what failed with the description of errno, like perror(3).
+ */
+void log_perror(uint64_t session, const char *what) {
+
+  struct log_record *rec;
+  int err = errno;
+
+  if ((rec = log_begin(LOG_ERROR, session, err)) != NULL) {
+    snprintf(rec->text, sizeof(rec->text), "%s", what);
+    log_commit();
+  }
+  errno = err;
+}
+
+/** Tells the records of the calling thread apart as those of worker
+ *  id. Called before the thread first logs.
+ */
+void log_set_worker(int id) {
+  thread_worker = id;
+  if (thread_ring)
+    thread_ring->owner = id;
+}
+
+/** Returns the level named name ("error", "warn", "info" or "debug",
+ *  or its number), or -1 if there is none.
+ */
+int log_parse_level(const char *name) {
+
+  int i;
+
+  for (i = 0; i <= LOG_DEBUG; i++) {
+    if (strcasecmp(name, level_names[i]) == 0)
+      return i;
+  }
+  if (name[0] >= '0' && name[0] <= '0' + LOG_DEBUG && name[1] == '\0')
+    return name[0] - '0';
+  return -1;
+}
+
+/** Returns the records dropped so far because a ring was full.
+ */
+uint64_t log_dropped(void) {
+
+  struct ring *r;
+  uint64_t n = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  return n;
+}
+
+/** Writes out the formatted lines.
+ */
+static void out_flush(void) {
+
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < out_used) {
+    n = write(log_fd, out + done, out_used - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
+  out_used = 0;
+}
+
+/** Formats one line of the log at the end of out:
+ *
+ *    2026-01-31 12:34:56.789012 INFO  w0 s42 text: description of err
+ */
+static void out_line(uint64_t time_ns, int level, int worker, uint64_t session,
+                     int err, const char *text) {
+
+  static time_t stamp_sec = -1;
+  static char stamp[32];
+  time_t sec = time_ns / 1000000000;
+  char ids[48], desc[128];
+  struct tm tm;
+  int n;
+
+  if (LOG_OUT_SIZE - out_used < LOG_LINE_MAX)
+    out_flush();
+  // the date only changes once a second
+  if (sec != stamp_sec) {
+    localtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    stamp_sec = sec;
+  }
+  if (worker >= 0)
+    n = snprintf(ids, sizeof(ids), "w%d ", worker);
+  else
+    n = snprintf(ids, sizeof(ids), "- ");
+  if (session)
+    snprintf(ids + n, sizeof(ids) - n, "s%llu", (unsigned long long) session);
+  else
+    snprintf(ids + n, sizeof(ids) - n, "-");
+
+  n = snprintf(out + out_used, LOG_LINE_MAX, "%s.%06u %-5s %s %s%s%s\n", stamp,
+               (unsigned) (time_ns % 1000000000 / 1000), level_names[level], ids, text,
+               err ? ": " : "", err ? strerror_r(err, desc, sizeof(desc)) : "");
+  if (n >= LOG_LINE_MAX) {
+    n = LOG_LINE_MAX - 1;
+    out[out_used + n - 1] = '\n';
+  }
+  out_used += n;
+}
+
+/** Formats and writes out every record waiting in the rings, and how
+ *  many were dropped since the last time.
+ *
+ *  Returns: the number of records written.
+ */
+static int log_drain(void) {
+
+  struct ring *r;
+  const struct log_record *rec;
+  uint64_t dropped;
+  struct timespec ts;
+  int n = 0;
+
+  pthread_mutex_lock(&drain_lock);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    while ((rec = ring_peek(r)) != NULL) {
+      out_line(rec->time_ns, rec->level, rec->worker, rec->session, rec->err, rec->text);
+      ring_release(r);
+      n++;
+    }
+    if ((dropped = ring_new_drops(r)) != 0) {
+      char text[64];
+      snprintf(text, sizeof(text), "log: %llu records dropped, the ring was full",
+               (unsigned long long) dropped);
+      out_line((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec, LOG_WARN, r->owner, 0, 0, text);
+    }
+  }
+  dropped = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+  if (dropped != lost_reported) {
+    char text[64];
+    snprintf(text, sizeof(text), "log: %llu records dropped, out of memory",
+             (unsigned long long) (dropped - lost_reported));
+    out_line((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec, LOG_WARN, -1, 0, 0, text);
+    lost_reported = dropped;
+  }
+  out_flush();
+  pthread_mutex_unlock(&drain_lock);
+  return n;
+}
+
+/** Writes out every record logged so far. Called at exit, so that the
+ *  last messages are not lost.
+ */
+void log_flush(void) {
+  log_drain();
+}
+
+/** The background thread: drains the rings until they are empty, then
+ *  sleeps for LOG_FLUSH_MS.
+ */
+static void *log_main(void *arg) {
+
+  struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+  while (1) {
+    if (log_drain() == 0)
+      nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+/** Starts the background thread that writes the log.
+ *
+ *  Parameters: path: file the log is appended to, or NULL for stderr.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int log_init(const char *path) {
+
+  pthread_t thread;
+
+  if (path) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+      fprintf(stderr, "log: cannot open %s: %s\n", path, strerror(errno));
+      log_fd = STDERR_FILENO;
+      return -1;
+    }
+  }
+  if (pthread_create(&thread, NULL, log_main, NULL) != 0) {
+    fprintf(stderr, "log: cannot start the log thread\n");
+    return -1;
+  }
+  pthread_detach(thread);
+  atexit(log_flush);
+  return 0;
+}
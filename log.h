@@ -0,0 +1,50 @@
+/* log.h
+ * Logging of the server that never blocks an event loop. A thread that
+ * logs only copies a record into a ring of its own; a background thread
+ * formats the records and writes them out. When a ring is full, the
+ * record is dropped and counted rather than waited for.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdint.h>
+
+/* Levels, from the most to the least important */
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#define LOG_RING_RECORDS 1024  /* records a thread may have waiting, a power of two */
+#define LOG_RECORD_SIZE 256
+#define LOG_FLUSH_MS 10        /* how often the background thread looks for records */
+
+/* A message as the logging thread leaves it, formatted later */
+struct log_record {
+  uint64_t time_ns;    /* CLOCK_REALTIME */
+  uint64_t session;    /* id of the session it is about, 0 for none */
+  int32_t  err;        /* errno to describe after the text, 0 for none */
+  int16_t  level;
+  int16_t  worker;     /* worker of the thread, -1 for the others */
+  char     text[LOG_RECORD_SIZE - 24];
+};
+
+extern int log_level;
+
+int log_init(const char *path);
+int log_parse_level(const char *name);
+void log_set_worker(int id);
+void log_write(int level, uint64_t session, const char *fmt, ...)
+  __attribute__ ((format(printf, 3, 4)));
+void log_perror(uint64_t session, const char *what);
+void log_flush(void);
+uint64_t log_dropped(void);
+
+/* Logs a message of level about a session (0 for none) with a
+   printf-like format; the arguments are not even evaluated when the
+   level is filtered out */
+#define log_msg(level, session, ...) \
+  do { if ((level) <= log_level) log_write(level, session, __VA_ARGS__); } while (0)
+
+#endif
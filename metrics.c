@@ -0,0 +1,245 @@
+/* metrics.c
+ * Counters and command latency histograms of the server (see
+ * metrics.h).
+ *
+ * The segment is a POSIX shared memory object named after the port the
+ * server listens on, so that postoffice-top can map it read-only and
+ * poll it. Every worker has its own struct worker_metrics in it,
+ * aligned to a cache line, and is the only one to write it; values are
+ * stored with relaxed atomics, so a reader sees every counter whole,
+ * although a histogram may be a few samples ahead of its count while
+ * it is read. Readers add up the workers themselves.
+ *
+ * If the segment cannot be created, the metrics are kept in private
+ * memory and only SITE STATS sees them.
+ */
+
+#include "metrics.h"
+#include "command.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct metrics_segment *metrics;
+
+/** Returns the bytes of the segment of a server with num_workers
+ *  workers.
+ */
+size_t metrics_size(int num_workers) {
+  return sizeof(struct metrics_segment) + num_workers * sizeof(struct worker_metrics);
+}
+
+/** Maps the segment of the server listening on port, read-only.
+ *
+ *  Returns: the segment, or NULL with errno set if there is none or
+ *           its layout is not the one this program was built with.
+ */
+struct metrics_segment *metrics_attach(const char *port) {
+
+  struct metrics_segment *m;
+  char name[64];
+  struct stat st;
+  int fd;
+
+  snprintf(name, sizeof(name), METRICS_SHM_NAME, port);
+  if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct metrics_segment)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return NULL;
+  if (m->magic != METRICS_MAGIC || m->size != st.st_size ||
+      m->size != metrics_size(m->num_workers)) {
+    munmap(m, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+  return m;
+}
+
+/** Creates the shared memory segment of the server listening on port.
+ *  A segment left by a server that is still running is not touched.
+ *
+ *  Returns: the mapped segment, or NULL.
+ */
+static struct metrics_segment *create_segment(const char *port, size_t size) {
+
+  struct metrics_segment *old;
+  void *m;
+  char name[64];
+  int fd;
+
+  if ((old = metrics_attach(port)) != NULL) {
+    pid_t pid = old->pid;
+    munmap(old, old->size);
+    if (pid != getpid() && kill(pid, 0) == 0) {
+      fprintf(stderr, "metrics: server %d already publishes the metrics of port %s\n",
+              (int) pid, port);
+      return NULL;
+    }
+  }
+
+  // the name is replaced; a reader that still maps the old segment keeps it
+  snprintf(name, sizeof(name), METRICS_SHM_NAME, port);
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) == -1) {
+    perror("metrics: shm_open");
+    return NULL;
+  }
+  if (ftruncate(fd, size) == -1) {
+    perror("metrics: ftruncate");
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    perror("metrics: mmap");
+    shm_unlink(name);
+    return NULL;
+  }
+  return m;
+}
+
+/** Sets up the metrics of a server listening on port with num_workers
+ *  workers, with a latency histogram for each of the n verbs of the
+ *  command table and one for the lines with any other verb. Must be
+ *  called before the workers start.
+ *
+ *  Returns: 0 on success, -1 if not even private memory could be had.
+ */
+int metrics_init(const char *port, int num_workers, const struct command *table, int n) {
+
+  size_t size = metrics_size(num_workers);
+  int i;
+
+  if (n >= METRICS_MAX_VERBS) {
+    fprintf(stderr, "metrics: too many commands\n");
+    return -1;
+  }
+
+  metrics = create_segment(port, size);
+  if (!metrics) {
+    fprintf(stderr, "metrics: only available through SITE STATS\n");
+    metrics = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+      perror("metrics: mmap");
+      metrics = NULL;
+      return -1;
+    }
+  }
+
+  metrics->size        = size;
+  metrics->pid         = getpid();
+  metrics->num_workers = num_workers;
+  metrics->num_verbs   = n + 1;
+  metrics->started     = time(NULL);
+  for (i = 0; i < n; i++)
+    strncpy(metrics->verbs[i], table[i].name, METRICS_VERB_LEN - 1);
+  strcpy(metrics->verbs[n], "other");
+  // readers check the magic number last
+  __atomic_store_n(&metrics->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/** Returns the metrics written by worker id.
+ */
+struct worker_metrics *metrics_worker(int id) {
+  return &metrics->workers[id];
+}
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/** Adds up the counters of every worker.
+ */
+void metrics_sum(const struct metrics_segment *m, struct metrics_totals *t) {
+
+  int i, v;
+
+  memset(t, 0, sizeof(*t));
+  for (i = 0; i < m->num_workers; i++) {
+    const struct worker_metrics *w = &m->workers[i];
+    t->sessions        += LOAD(w->sessions);
+    t->sessions_total  += LOAD(w->sessions_total);
+    t->transfers       += LOAD(w->transfers);
+    t->transfers_total += LOAD(w->transfers_total);
+    t->bytes_sent      += LOAD(w->bytes_sent);
+    t->bytes_received  += LOAD(w->bytes_received);
+    t->pasv_ports      += LOAD(w->pasv_ports);
+    t->pasv_in_use     += LOAD(w->pasv_in_use);
+    t->pasv_refused    += LOAD(w->pasv_refused);
+    for (v = 0; v < m->num_verbs; v++)
+      t->commands += LOAD(w->verbs[v].count);
+  }
+}
+
+/** Merges the histograms of a verb of every worker into h.
+ */
+void metrics_verb(const struct metrics_segment *m, int verb, struct histogram *h) {
+
+  int i, b;
+
+  memset(h, 0, sizeof(*h));
+  for (i = 0; i < m->num_workers; i++) {
+    const struct histogram *w = &m->workers[i].verbs[verb];
+    uint64_t max = LOAD(w->max);
+    h->count += LOAD(w->count);
+    h->sum   += LOAD(w->sum);
+    if (max > h->max)
+      h->max = max;
+    for (b = 0; b < METRICS_HIST_BUCKETS; b++)
+      h->buckets[b] += LOAD(w->buckets[b]);
+  }
+}
+
+/** Returns the smallest value of a bucket.
+ */
+static uint64_t bucket_low(int b) {
+
+  int exp;
+
+  if (b < METRICS_SUB_BUCKETS)
+    return b;
+  exp = b / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+  return (uint64_t) (METRICS_SUB_BUCKETS + b % METRICS_SUB_BUCKETS) << (exp - METRICS_SUB_BITS);
+}
+
+/** Returns the value below which percent of the samples of h fall,
+ *  within the precision of its buckets, or 0 if h is empty.
+ */
+uint64_t histogram_percentile(const struct histogram *h, double percent) {
+
+  uint64_t total = 0, rank, seen = 0, mid;
+  int b;
+
+  for (b = 0; b < METRICS_HIST_BUCKETS; b++)
+    total += h->buckets[b];
+  if (!total)
+    return 0;
+  rank = (uint64_t) (percent / 100 * total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank)
+      break;
+  }
+  // the middle of the bucket, but never above the largest sample
+  if (b == METRICS_HIST_BUCKETS - 1)
+    return h->max;
+  mid = (bucket_low(b) + bucket_low(b + 1) - 1) / 2;
+  return mid < h->max ? mid : h->max;
+}
@@ -0,0 +1,129 @@
+/* metrics.h
+ * Counters and command latency histograms of the server, kept in a
+ * shared memory segment that SITE STATS and the postoffice-top tool
+ * read. Every worker only writes its own part of the segment, so
+ * updating a metric never takes a lock or contends for a cache line.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define METRICS_MAGIC 0x504f4d31   /* "POM1" */
+#define METRICS_SUB_BITS 4         /* 16 sub-buckets per power of two, within 6.25% */
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXP 36         /* latencies up to 2^37 ns (about 2 minutes) */
+#define METRICS_HIST_BUCKETS ((METRICS_MAX_EXP - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_VERBS 32       /* verbs of the command table, plus one for the others */
+#define METRICS_VERB_LEN 8
+#define METRICS_SHM_NAME "/postoffice.%s" /* segment of the server listening on a port */
+
+/* Log-linear (HDR style) histogram of latencies in ns */
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[METRICS_HIST_BUCKETS];
+};
+
+/* Metrics of one worker, only written by that worker */
+struct worker_metrics {
+  uint64_t sessions;        /* control connections open */
+  uint64_t sessions_total;  /* control connections accepted */
+  uint64_t transfers;       /* data connections moving data */
+  uint64_t transfers_total;
+  uint64_t bytes_sent;      /* on data connections, counted about once a second */
+  uint64_t bytes_received;
+  uint64_t pasv_ports;      /* listening sockets in the worker's pool */
+  uint64_t pasv_in_use;
+  uint64_t pasv_refused;    /* PASV refused because every port was in use */
+  struct histogram verbs[METRICS_MAX_VERBS];
+} __attribute__ ((aligned(64)));
+
+/* The shared memory segment */
+struct metrics_segment {
+  uint32_t magic;
+  uint32_t size;            /* bytes of the segment, to check the layout */
+  pid_t    pid;
+  int32_t  num_workers;
+  int32_t  num_verbs;       /* the last one counts unknown verbs */
+  int64_t  started;         /* time(2) the server started */
+  uint64_t cache_hits;      /* of the file cache, copied about once a second */
+  uint64_t cache_misses;
+  uint64_t cache_bytes;
+  char     verbs[METRICS_MAX_VERBS][METRICS_VERB_LEN];
+  struct worker_metrics workers[] __attribute__ ((aligned(64)));
+};
+
+/* Sum of the counters of every worker */
+struct metrics_totals {
+  uint64_t sessions, sessions_total;
+  uint64_t transfers, transfers_total;
+  uint64_t bytes_sent, bytes_received;
+  uint64_t pasv_ports, pasv_in_use, pasv_refused;
+  uint64_t commands;
+};
+
+struct command;
+
+extern struct metrics_segment *metrics;
+
+int metrics_init(const char *port, int num_workers, const struct command *table, int n);
+struct worker_metrics *metrics_worker(int id);
+struct metrics_segment *metrics_attach(const char *port);
+size_t metrics_size(int num_workers);
+void metrics_sum(const struct metrics_segment *m, struct metrics_totals *t);
+void metrics_verb(const struct metrics_segment *m, int verb, struct histogram *h);
+uint64_t histogram_percentile(const struct histogram *h, double percent);
+
+/** Returns the monotonic clock in ns, for the latency histograms.
+ */
+static inline uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Adds n to a counter of the calling worker. A relaxed load and
+ *  store rather than an atomic add: the worker is the only writer, and
+ *  readers only need to see whole values.
+ */
+static inline void metric_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/** Sets a gauge of the calling worker.
+ */
+static inline void metric_set(uint64_t *gauge, uint64_t value) {
+  __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+/** Returns the bucket of a histogram that counts value.
+ */
+static inline int histogram_bucket(uint64_t value) {
+
+  int exp;
+
+  if (value < METRICS_SUB_BUCKETS)
+    return value;
+  exp = 63 - __builtin_clzll(value);
+  if (exp > METRICS_MAX_EXP)
+    return METRICS_HIST_BUCKETS - 1;
+  return (exp - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+         ((value >> (exp - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/** Records a latency of ns in a histogram of the calling worker.
+ */
+static inline void histogram_record(struct histogram *h, uint64_t ns) {
+  metric_add(&h->buckets[histogram_bucket(ns)], 1);
+  metric_add(&h->count, 1);
+  metric_add(&h->sum, ns);
+  if (ns > h->max)
+    metric_set(&h->max, ns);
+}
+
+#endif
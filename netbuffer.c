@@ -1,109 +1,321 @@
-/* netbuffer.c
- * Creates a buffer for receiving data from a socket and reading individual lines.
- * Author  : Jonatan Schroeder
- * Modified: Nov 5, 2017
- */
-
-#include "netbuffer.h"
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-
-struct net_buffer {
-  int    fd;
-  size_t max_bytes; 
-  size_t avail_data;
-  // Buffer set as size zero, but since it's the last member of the
-  // struct, any additional memory allocated after this struct can be
-  // used as part of the buffer.
-  char   buf[0];
-};
-
-/** Creates a new buffer for handling data read from a socket.
- *
- *  Note: The maximum buffer size passed as parameter will also
- *  correspond to the maximum number of bytes other functions (like
- *  nb_read_line) can return at a time, so it is advisable to make
- *  this size at least as big as the maximum line size for the
- *  protocol handled in this socket.
- *  
- *  Parameters: fd: Socket file descriptor.
- *              max_buffer_size: Maximum number of bytes to be stored
- *                               locally for a connection. 
- *
- *  Returns: A net_buffer_t object that can be used in other functions
- *           to read buffered data.
- */
-net_buffer_t nb_create(int fd, size_t max_buffer_size) {
-
-  net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size);
-  nb->fd          = fd;
-  nb->max_bytes   = max_buffer_size;
-  nb->avail_data  = 0;
-  return nb;
-}
-
-/** Frees all memory used by a net_buffer_t object.
- *  
- *  Parameters: nb: buffer object to be freed.
- */
-void nb_destroy(net_buffer_t nb) {
-  free(nb);
-}
-
-/** Reads a single line from the socket/buffer. If the socket returns
- *  more than one line in a single call to recv, returns a single line
- *  and caches the remaining data for the next call. The returned
- *  string will also include a null byte, which allows the out buffer
- *  to the handled as a regular string.
- *
- *  If a line with more than max_buffer_size bytes is read, then
- *  return the first max_buffer_size bytes (with a terminating null
- *  byte). It is the responsibility of the caller to check if the last
- *  character in the string is a line-feed (\n) character.
- *
- *  This function does not check for null bytes found in the middle of
- *  the string.
- *
- *  Parameter: nb: buffer object where socket and cache data are stored.
- *             out: array of bytes where the read line will be
- *                  stored. It must have space for at least
- *                  max_buffer_size bytes (from nb_create function)
- *                  plus one (for terminating null byte).
- *
- *  Returns: If the connection was terminated properly, returns 0. If
- *           the connection was terminated abruptly or another unknown
- *           error is found, returns -1. Otherwise, returns the number
- *           of bytes in the read line.
- */
-int nb_read_line(net_buffer_t nb, char out[]) {
-
-  char *eos;
-  int rv; 
-  while ((eos = memchr(nb->buf, '\n', nb->avail_data)) == NULL) {
-    
-    if (nb->avail_data < nb->max_bytes) {
-      rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
-      if (rv < 0)
-	return rv;
-      if (rv == 0) {
-	eos = nb->buf + nb->avail_data - 1;
-	break;
-      }
-      nb->avail_data += rv;
-    } else {
-      eos = nb->buf + nb->max_bytes - 1;
-      break;
-    }
-  }
-  
-  rv = eos - nb->buf + 1;
-  memcpy(out, nb->buf, rv);
-  out[rv] = 0;
-  nb->avail_data -= rv;
-  if (nb->avail_data)
-    memmove(nb->buf, eos + 1, nb->avail_data);
-  return rv;
-}
+/* netbuffer.c
+ * Creates a buffer for receiving data from a socket and reading individual lines.
+ * Author  : Jonatan Schroeder
+ * Modified: Nov 5, 2017
+ *
+ * The data is kept in a ring, so taking a line out of the buffer
+ * never moves the data that follows it, and lines are returned as
+ * views into the ring rather than copies (nb_peek_line). A line that
+ * wraps around the end of the ring is made contiguous by copying the
+ * wrapped part to a spare area right after the ring. The search for
+ * the end of a line remembers how far it got, so the bytes of a line
+ * that arrives in many pieces are only looked at once.
+ */
+
+#include "netbuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct net_buffer {
+  int    fd;
+  size_t max_bytes;   /* size of the ring */
+  size_t head;        /* position in the ring of the first buffered byte */
+  size_t avail_data;  /* bytes buffered from head on, wrapping at max_bytes */
+  size_t scanned;     /* buffered bytes known not to contain a line-feed */
+  // Buffer set as size zero, but since it's the last member of the
+  // struct, any additional memory allocated after this struct can be
+  // used as part of the buffer: the ring, followed by as many spare
+  // bytes to make a wrapped line contiguous.
+  char   buf[0];
+};
+
+/** Returns the first line-feed in the n bytes at p, or NULL. Compares
+ *  16 bytes at a time where SSE2 is available.
+ */
+static char *find_newline(char *p, size_t n) {
+
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+  int mask;
+
+  for (; i + 16 <= n; i += 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), nl));
+    if (mask)
+      return p + i + __builtin_ctz(mask);
+  }
+  for (; i < n; i++)
+    if (p[i] == '\n')
+      return p + i;
+  return NULL;
+#else
+  return memchr(p, '\n', n);
+#endif
+}
+
+/** Creates a new buffer for handling data read from a socket.
+ *
+ *  Note: The maximum buffer size passed as parameter will also
+ *  correspond to the maximum number of bytes other functions (like
+ *  nb_read_line) can return at a time, so it is advisable to make
+ *  this size at least as big as the maximum line size for the
+ *  protocol handled in this socket.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              max_buffer_size: Maximum number of bytes to be stored
+ *                               locally for a connection.
+ *
+ *  Returns: A net_buffer_t object that can be used in other functions
+ *           to read buffered data, or NULL if there is not enough
+ *           memory.
+ */
+net_buffer_t nb_create(int fd, size_t max_buffer_size) {
+
+  net_buffer_t nb = malloc(sizeof(struct net_buffer) + 2 * max_buffer_size);
+  if (!nb)
+    return NULL;
+  nb->fd          = fd;
+  nb->max_bytes   = max_buffer_size;
+  nb->head        = 0;
+  nb->avail_data  = 0;
+  nb->scanned     = 0;
+  return nb;
+}
+
+/** Frees all memory used by a net_buffer_t object.
+ *
+ *  Parameters: nb: buffer object to be freed.
+ */
+void nb_destroy(net_buffer_t nb) {
+  free(nb);
+}
+
+/** Reads whatever data is currently available on the socket into the
+ *  free space of the ring, with a single call to recvmsg that does not
+ *  block even if the socket is blocking. This is the entry point for
+ *  event loops, to be called when the socket is reported readable.
+ *  Lines can then be taken with nb_peek_line and nb_consume.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *
+ *  Returns: If the connection was terminated properly, returns 0. If
+ *           the buffer is already full, returns -2 without reading
+ *           anything. If recvmsg fails, returns -1 and errno is set
+ *           (EAGAIN/EWOULDBLOCK if there was nothing to read).
+ *           Otherwise, returns the number of bytes read.
+ */
+ssize_t nb_feed(net_buffer_t nb) {
+
+  struct iovec iov[2];
+  struct msghdr msg;
+  size_t tail, free_bytes;
+  ssize_t rv;
+
+  free_bytes = nb->max_bytes - nb->avail_data;
+  if (free_bytes == 0)
+    return -2;
+
+  // the free space is the end of the ring and then its beginning
+  tail = (nb->head + nb->avail_data) % nb->max_bytes;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  iov[0].iov_base = nb->buf + tail;
+  if (tail + free_bytes <= nb->max_bytes) {
+    iov[0].iov_len = free_bytes;
+    msg.msg_iovlen = 1;
+  } else {
+    iov[0].iov_len = nb->max_bytes - tail;
+    iov[1].iov_base = nb->buf;
+    iov[1].iov_len = free_bytes - iov[0].iov_len;
+    msg.msg_iovlen = 2;
+  }
+
+  rv = recvmsg(nb->fd, &msg, MSG_DONTWAIT);
+  if (rv > 0)
+    nb->avail_data += rv;
+  return rv;
+}
+
+/** Makes the first len buffered bytes contiguous, copying the part
+ *  that wraps around to the spare bytes after the end of the ring.
+ *
+ *  Returns: a pointer to the first buffered byte.
+ */
+static char *unwrap(net_buffer_t nb, size_t len) {
+
+  size_t first = nb->max_bytes - nb->head;
+
+  if (len > first)
+    memcpy(nb->buf + nb->max_bytes, nb->buf, len - first);
+  return nb->buf + nb->head;
+}
+
+/** Finds the next line in the data already cached in the buffer,
+ *  without reading from the socket and without copying it. The line
+ *  includes its line-feed; if the buffer is full and has no line-feed,
+ *  the whole buffer is returned as a line. The line is not taken out
+ *  of the buffer until nb_consume is called.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             len: where the number of bytes of the line is stored.
+ *
+ *  Returns: a pointer to the line, or NULL if no complete line is
+ *           cached yet. The line can be modified in place, and stays
+ *           valid until the next call that reads from the socket.
+ */
+char *nb_peek_line(net_buffer_t nb, size_t *len) {
+
+  size_t first = nb->max_bytes - nb->head;  // bytes up to the end of the ring
+  char *eos;
+
+  if (first > nb->avail_data)
+    first = nb->avail_data;
+
+  // only the bytes that arrived since the last search are looked at
+  if (nb->scanned < first) {
+    eos = find_newline(nb->buf + nb->head + nb->scanned, first - nb->scanned);
+    if (eos) {
+      nb->scanned = eos - (nb->buf + nb->head);
+      *len = nb->scanned + 1;
+      return nb->buf + nb->head;
+    }
+    nb->scanned = first;
+  }
+  if (nb->scanned < nb->avail_data) {
+    eos = find_newline(nb->buf + nb->scanned - first, nb->avail_data - nb->scanned);
+    if (eos)
+      nb->scanned = first + (eos - nb->buf);
+    else
+      nb->scanned = nb->avail_data;
+  } else {
+    eos = NULL;
+  }
+
+  if (eos) {
+    *len = nb->scanned + 1;
+  } else if (nb->avail_data == nb->max_bytes) {
+    *len = nb->max_bytes;
+  } else {
+    return NULL;
+  }
+  return unwrap(nb, *len);
+}
+
+/** Takes the first len bytes, usually a line returned by
+ *  nb_peek_line, out of the buffer.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             len: number of bytes to discard.
+ */
+void nb_consume(net_buffer_t nb, size_t len) {
+
+  if (len >= nb->avail_data) {
+    // an empty ring starts over at its beginning, so lines rarely wrap
+    nb->head = 0;
+    nb->avail_data = 0;
+  } else {
+    nb->head = (nb->head + len) % nb->max_bytes;
+    nb->avail_data -= len;
+  }
+  nb->scanned = 0;
+}
+
+/** Reads a single line from the socket/buffer. If the socket returns
+ *  more than one line in a single call to recv, returns a single line
+ *  and caches the remaining data for the next call. The returned
+ *  string will also include a null byte, which allows the out buffer
+ *  to the handled as a regular string.
+ *
+ *  If a line with more than max_buffer_size bytes is read, then
+ *  return the first max_buffer_size bytes (with a terminating null
+ *  byte). It is the responsibility of the caller to check if the last
+ *  character in the string is a line-feed (\n) character.
+ *
+ *  This function does not check for null bytes found in the middle of
+ *  the string. It is kept for callers that read from a blocking socket
+ *  and want copies; nb_peek_line avoids the copy.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             out: array of bytes where the read line will be
+ *                  stored. It must have space for at least
+ *                  max_buffer_size bytes (from nb_create function)
+ *                  plus one (for terminating null byte).
+ *
+ *  Returns: If the connection was terminated properly, returns 0. If
+ *           the connection was terminated abruptly or another unknown
+ *           error is found, returns -1. Otherwise, returns the number
+ *           of bytes in the read line.
+ */
+int nb_read_line(net_buffer_t nb, char out[]) {
+
+  size_t tail, room;
+  ssize_t rv;
+  char *line;
+  size_t len;
+
+  while ((line = nb_peek_line(nb, &len)) == NULL) {
+    tail = (nb->head + nb->avail_data) % nb->max_bytes;
+    room = nb->max_bytes - nb->avail_data;
+    if (tail + room > nb->max_bytes)
+      room = nb->max_bytes - tail;
+    rv = recv(nb->fd, nb->buf + tail, room, 0);
+    if (rv < 0)
+      return rv;
+    if (rv == 0) {
+      // the connection was closed: what is left is the last line
+      if (!nb->avail_data)
+        return 0;
+      len = nb->avail_data;
+      line = unwrap(nb, len);
+      break;
+    }
+    nb->avail_data += rv;
+  }
+
+  memcpy(out, line, len);
+  out[len] = 0;
+  nb_consume(nb, len);
+  return len;
+}
+
+/** Reads whatever data is currently available on the socket into the
+ *  buffer. Same as nb_feed, kept for existing callers.
+ */
+int nb_fill(net_buffer_t nb) {
+  return nb_feed(nb);
+}
+
+/** Extracts a single line from the data already cached in the
+ *  buffer, without reading from the socket. The line is copied to out
+ *  in the same format as nb_read_line. If the buffer is full and has
+ *  no line-feed character, the whole buffer is returned as a line.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             out: array of bytes where the read line will be
+ *                  stored, with the same size requirements as in
+ *                  nb_read_line.
+ *
+ *  Returns: the number of bytes in the line, or 0 if no complete line
+ *           is cached yet.
+ */
+int nb_next_line(net_buffer_t nb, char out[]) {
+
+  size_t len;
+  char *line = nb_peek_line(nb, &len);
+
+  if (!line)
+    return 0;
+  memcpy(out, line, len);
+  out[len] = 0;
+  nb_consume(nb, len);
+  return len;
+}
@@ -1,18 +1,24 @@
-/* netbuffer.h
- * Creates a buffer for receiving data from a socket and reading individual lines.
- * Author  : Jonatan Schroeder
- * Modified: Nov 5, 2017
- */
-
-#ifndef _NET_BUFFER_H_
-#define _NET_BUFFER_H_
-
-#include <string.h>
-
-typedef struct net_buffer *net_buffer_t;
-
-net_buffer_t nb_create(int fd, size_t max_buffer_size);
-void nb_destroy(net_buffer_t nb);
-int nb_read_line(net_buffer_t nb, char out[]);
-
-#endif
+/* netbuffer.h
+ * Creates a buffer for receiving data from a socket and reading individual lines.
+ * Author  : Jonatan Schroeder
+ * Modified: Nov 5, 2017
+ */
+
+#ifndef _NET_BUFFER_H_
+#define _NET_BUFFER_H_
+
+#include <string.h>
+#include <sys/types.h>
+
+typedef struct net_buffer *net_buffer_t;
+
+net_buffer_t nb_create(int fd, size_t max_buffer_size);
+void nb_destroy(net_buffer_t nb);
+int nb_read_line(net_buffer_t nb, char out[]);
+int nb_fill(net_buffer_t nb);
+int nb_next_line(net_buffer_t nb, char out[]);
+ssize_t nb_feed(net_buffer_t nb);
+char *nb_peek_line(net_buffer_t nb, size_t *len);
+void nb_consume(net_buffer_t nb, size_t len);
+
+#endif
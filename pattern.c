@@ -0,0 +1,217 @@
+/* pattern.c
+ * Shell wildcard patterns for the arguments of NLST and LIST.
+ *
+ * The syntax is the one of the shell: '*' matches any run of
+ * characters, '?' any single character, "[...]" one character of a
+ * set ("[a-z]", "[!0-9]" or "[^0-9]" for the complement), and '\'
+ * takes the next character literally. As in the shell, names starting
+ * with '.' are only matched by patterns that start with '.'.
+ *
+ * Matching walks the tokens and backtracks only to the last '*', so
+ * it takes time linear in the name for the usual patterns. The fixed
+ * text at the start and at the end of a pattern ("*.csv") is compared
+ * before anything else, which rejects most names with one memcmp.
+ */
+
+#include "pattern.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SET_BIT(set, c)  ((set)[(unsigned char) (c) >> 3] |= 1 << ((unsigned char) (c) & 7))
+#define HAS_BIT(set, c)  ((set)[(unsigned char) (c) >> 3] & (1 << ((unsigned char) (c) & 7)))
+
+/** Returns 1 if s contains characters that make it a pattern rather
+ *  than a plain name.
+ */
+int pattern_has_magic(const char *s) {
+  return strpbrk(s, "*?[\\") != NULL;
+}
+
+/** Parses the set of a "[...]" token starting after the '['.
+ *
+ *  Returns: the position after the closing ']', or NULL if the set is
+ *           not closed (the '[' is then taken literally).
+ */
+static const char *parse_class(const char *s, unsigned char *set) {
+
+  int negate = 0;
+  int first = 1;
+  int c, i;
+
+  memset(set, 0, 32);
+  if (*s == '!' || *s == '^') {
+    negate = 1;
+    s++;
+  }
+
+  // a ']' right after the '[' (or "[!") is part of the set
+  while (*s && (*s != ']' || first)) {
+    first = 0;
+    c = (unsigned char) *s++;
+    if (c == '\\' && *s)
+      c = (unsigned char) *s++;
+    if (*s == '-' && s[1] && s[1] != ']') {
+      int last = (unsigned char) s[1];
+      s += 2;
+      if (last == '\\' && *s)
+        last = (unsigned char) *s++;
+      for (i = c; i <= last; i++)
+        SET_BIT(set, i);
+    } else {
+      SET_BIT(set, c);
+    }
+  }
+  if (*s != ']')
+    return NULL;
+
+  if (negate)
+    for (i = 0; i < 32; i++)
+      set[i] = ~set[i];
+  return s + 1;
+}
+
+/** Compiles the pattern s.
+ *
+ *  Returns: the compiled pattern, to be released with pattern_free(),
+ *           or NULL if there is not enough memory.
+ */
+struct pattern *pattern_compile(const char *s) {
+
+  size_t len = strlen(s);
+  struct pattern *p = calloc(1, sizeof(*p));
+  struct pattern_token *t;
+  const char *end;
+  char *out;
+
+  if (!p)
+    return NULL;
+  // every character is at most one token
+  p->tokens = calloc(len + 1, sizeof(*p->tokens));
+  p->text = malloc(len + 1);
+  if (!p->tokens || !p->text) {
+    pattern_free(p);
+    return NULL;
+  }
+  p->leading_dot = s[0] == '.';
+  out = p->text;
+
+  while (*s) {
+    t = &p->tokens[p->count];
+    if (*s == '*') {
+      s++;
+      // consecutive stars are one star
+      if (p->count && t[-1].kind == PATTERN_STAR)
+        continue;
+      t->kind = PATTERN_STAR;
+    } else if (*s == '?') {
+      s++;
+      t->kind = PATTERN_ANY;
+      p->min_len++;
+    } else if (*s == '[' && (end = parse_class(s + 1, t->set)) != NULL) {
+      s = end;
+      t->kind = PATTERN_CLASS;
+      p->min_len++;
+    } else {
+      if (*s == '\\' && s[1])
+        s++;
+      // characters are added to the literal token before them, if any
+      if (p->count && t[-1].kind == PATTERN_LITERAL) {
+        t[-1].len++;
+      } else {
+        t->kind = PATTERN_LITERAL;
+        t->text = out;
+        t->len  = 1;
+        p->count++;
+      }
+      *out++ = *s++;
+      p->min_len++;
+      continue;
+    }
+    p->count++;
+  }
+  return p;
+}
+
+/** Compares one token with the start of name, which has len bytes.
+ *
+ *  Returns: the bytes of name the token matched, or -1.
+ */
+static long match_token(const struct pattern_token *t, const char *name, size_t len) {
+
+  switch (t->kind) {
+  case PATTERN_LITERAL:
+    return len >= t->len && !memcmp(name, t->text, t->len) ? (long) t->len : -1;
+  case PATTERN_ANY:
+    return len ? 1 : -1;
+  case PATTERN_CLASS:
+    return len && HAS_BIT(t->set, *name) ? 1 : -1;
+  }
+  return -1;
+}
+
+/** Returns 1 if the name of len bytes matches the pattern, 0 if not.
+ */
+int pattern_match(const struct pattern *p, const char *name, size_t len) {
+
+  const struct pattern_token *t = p->tokens;
+  const struct pattern_token *last;
+  int first = 0, count = p->count;
+  int i, star = -1;
+  size_t n = 0, star_n = 0;
+  long m;
+
+  if (len < p->min_len || (name[0] == '.' && !p->leading_dot))
+    return 0;
+  if (count == 0)
+    return len == 0;
+
+  // the fixed text at both ends is checked first
+  last = &t[count - 1];
+  if (last->kind == PATTERN_LITERAL && count > 1) {
+    if (memcmp(name + len - last->len, last->text, last->len))
+      return 0;
+    len -= last->len;
+    count--;
+  }
+  if (t[0].kind == PATTERN_LITERAL) {
+    if ((m = match_token(&t[0], name, len)) < 0)
+      return 0;
+    n = m;
+    first = 1;
+  }
+
+  i = first;
+  while (i < count || n < len) {
+    if (i < count) {
+      if (t[i].kind == PATTERN_STAR) {
+        if (i == count - 1)
+          return 1;  // a final star takes the rest of the name
+        star   = i++;
+        star_n = n;
+        continue;
+      }
+      if ((m = match_token(&t[i], name + n, len - n)) >= 0) {
+        n += m;
+        i++;
+        continue;
+      }
+    }
+    // let the last star take one more character and try again
+    if (star < 0 || star_n >= len)
+      return 0;
+    n = ++star_n;
+    i = star + 1;
+  }
+  return 1;
+}
+
+/** Releases a compiled pattern. p may be NULL.
+ */
+void pattern_free(struct pattern *p) {
+  if (!p)
+    return;
+  free(p->tokens);
+  free(p->text);
+  free(p);
+}
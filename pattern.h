@@ -0,0 +1,40 @@
+/* pattern.h
+ * Shell wildcard patterns (*, ?, [...]) for the arguments of NLST and
+ * LIST. A pattern is compiled once into a list of tokens, so that
+ * matching it against every entry of a large directory does not parse
+ * it again for each name.
+ */
+
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+#include <stddef.h>
+
+enum pattern_kind {
+  PATTERN_LITERAL,  /* len bytes of text */
+  PATTERN_ANY,      /* any single character (?) */
+  PATTERN_STAR,     /* any run of characters (*) */
+  PATTERN_CLASS     /* one character of set ([...]) */
+};
+
+struct pattern_token {
+  int            kind;
+  size_t         len;
+  const char    *text;
+  unsigned char  set[32];  /* bit c is set if character c matches */
+};
+
+struct pattern {
+  int            count;        /* number of tokens */
+  int            leading_dot;  /* the pattern starts with '.', so it may match hidden names */
+  size_t         min_len;      /* shortest name the pattern can match */
+  struct pattern_token *tokens;
+  char          *text;         /* unescaped text of the literal tokens */
+};
+
+int pattern_has_magic(const char *s);
+struct pattern *pattern_compile(const char *s);
+int pattern_match(const struct pattern *p, const char *name, size_t len);
+void pattern_free(struct pattern *p);
+
+#endif
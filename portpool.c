@@ -0,0 +1,157 @@
+/* portpool.c
+ * Passive mode listening sockets bound ahead of time to the ports of
+ * a configured range (option -p).
+ *
+ * The ports of the range are dealt to the workers in turn, so that
+ * worker i of n gets the ports first + i, first + i + n, and so on,
+ * and no two workers ever hand out the same port. Every port is bound,
+ * listening and registered in the worker's event loop once, when the
+ * worker starts. A PASV then only takes the port at the head of the
+ * free list, which costs no system call at all, and the port goes
+ * back to the tail of the list when its data connection has been
+ * accepted or the session gives it up. Reusing the ports in turn
+ * rather than the last one given back leaves the most time for late
+ * connections meant for an earlier session to arrive while the port
+ * is free, in which case they are simply closed.
+ */
+
+#include "portpool.h"
+#include "session.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+int pasv_port_first = 0;
+int pasv_port_last  = 0;
+
+/** Event handler of a listening socket of the pool. Connections are
+ *  handed to the session the port is checked out to; connections to a
+ *  free port are closed.
+ */
+static void handle_port_accept(struct watcher *w, uint32_t events) {
+
+  struct pasv_port *pp = w->arg;
+  int fd;
+
+  if (pp->owner) {
+    transfer_accept_data(pp->owner, w->fd);
+    return;
+  }
+
+  while ((fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    close(fd);
+}
+
+/** Creates a socket listening on port.
+ *
+ *  Returns: the socket, or -1 on error.
+ */
+static int listen_on(unsigned short port) {
+
+  struct sockaddr_in addr;
+  int sockfd;
+  int yes = 1;
+
+  if ((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = INADDR_ANY;
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+      bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+      listen(sockfd, PORTPOOL_BACKLOG) == -1) {
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+/** Binds the worker's share of the port range and adds the listening
+ *  sockets to its event loop. A port that cannot be bound (because
+ *  another program uses it) is left out with a warning.
+ *
+ *  Returns: the pool, or NULL if no port at all could be bound.
+ */
+struct port_pool *portpool_create(struct worker *w, int num_workers) {
+
+  int range = pasv_port_last - pasv_port_first + 1;
+  int size = (range + num_workers - 1) / num_workers;
+  struct port_pool *p;
+  struct pasv_port *pp;
+  int port, fd;
+
+  p = calloc(1, sizeof(struct port_pool) + size * sizeof(struct pasv_port));
+  if (!p) {
+    log_perror(0, "portpool: calloc");
+    return NULL;
+  }
+
+  for (port = pasv_port_first + w->id; port <= pasv_port_last; port += num_workers) {
+    if ((fd = listen_on(port)) == -1) {
+      log_msg(LOG_WARN, 0, "portpool: cannot listen on port %d: %s", port, strerror(errno));
+      continue;
+    }
+    pp = &p->ports[p->count];
+    pp->port = port;
+    watcher_init(&pp->w, handle_port_accept, pp);
+    if (watcher_add(w, &pp->w, fd, EPOLLIN) == -1) {
+      close(fd);
+      continue;
+    }
+    p->count++;
+    portpool_put(p, pp);
+  }
+
+  if (p->count == 0) {
+    log_msg(LOG_ERROR, 0, "portpool: worker %d has no passive mode port", w->id);
+    free(p);
+    return NULL;
+  }
+  return p;
+}
+
+/** Checks the next free port out of the pool for session s.
+ *
+ *  Returns: the port, or NULL if every port is in use.
+ */
+struct pasv_port *portpool_get(struct port_pool *p, struct session *s) {
+
+  struct pasv_port *pp = p->head;
+
+  if (!pp)
+    return NULL;
+  p->head = pp->next;
+  if (!p->head)
+    p->tail = NULL;
+  p->free--;
+
+  pp->next  = NULL;
+  pp->owner = s;
+  return pp;
+}
+
+/** Gives a port back to the pool. Connections that are still queued
+ *  on it are closed when the event loop reports them.
+ */
+void portpool_put(struct port_pool *p, struct pasv_port *pp) {
+
+  pp->owner = NULL;
+  pp->next  = NULL;
+  if (p->tail)
+    p->tail->next = pp;
+  else
+    p->head = pp;
+  p->tail = pp;
+  p->free++;
+}
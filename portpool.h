@@ -0,0 +1,39 @@
+/* portpool.h
+ * Passive mode listening sockets bound ahead of time to the ports of
+ * a configured range. Each worker owns the ports of the range it was
+ * given; a PASV checks one out of the pool and gives it back once the
+ * data connection is accepted, so no socket is created per transfer.
+ */
+
+#ifndef _PORTPOOL_H_
+#define _PORTPOOL_H_
+
+#include "server.h"
+
+#define PORTPOOL_BACKLOG 5 /* connections queued on every listening socket */
+
+struct session;
+
+/* A listening socket of the pool. It stays in the worker's event loop
+ * for as long as the server runs, whether it is checked out or not. */
+struct pasv_port {
+  struct watcher     w;
+  unsigned short     port;
+  struct session    *owner;  /* session the port is checked out to, NULL if free */
+  struct pasv_port  *next;   /* next free port, in the order they were given back */
+};
+
+struct port_pool {
+  struct pasv_port  *head, *tail; /* free ports, taken from head and given back at tail */
+  int                free;
+  int                count;
+  struct pasv_port   ports[0];
+};
+
+extern int pasv_port_first, pasv_port_last; /* the range, 0 if none was configured */
+
+struct port_pool *portpool_create(struct worker *w, int num_workers);
+struct pasv_port *portpool_get(struct port_pool *p, struct session *s);
+void portpool_put(struct port_pool *p, struct pasv_port *pp);
+
+#endif
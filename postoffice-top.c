@@ -0,0 +1,172 @@
+/* postoffice-top.c
+ * Shows the metrics of a running PostOffice server (see metrics.h)
+ * every few seconds, like top(1). The server's shared memory segment
+ * is only read, so watching a server never slows it down.
+ *
+ * The rates and the latency percentiles are those of the last
+ * interval; the counts and the maximum latencies are since the server
+ * started.
+ */
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-i <seconds>] [-n <count>] [-b] <port>\n", prog);
+  fprintf(stderr, "     <port>   Port of the server to watch.\n");
+  fprintf(stderr, "     -i       Seconds between updates. Defaults to 1.\n");
+  fprintf(stderr, "     -n       Number of updates before exiting. Defaults to no limit.\n");
+  fprintf(stderr, "     -b       Print every update after the previous one instead of\n");
+  fprintf(stderr, "              redrawing the screen.\n");
+}
+
+/** Returns the monotonic clock in seconds.
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Prints a latency in ns as microseconds, or "-" if there is none.
+ */
+static void print_us(uint64_t ns, int any) {
+  if (any)
+    printf(" %9.1f", ns / 1000.0);
+  else
+    printf(" %9s", "-");
+}
+
+/** Prints one update: the counters, their rates since the previous
+ *  update prev, taken seconds ago, and the latencies of every verb used
+ *  so far. hist holds the histograms of the previous update and is
+ *  replaced by the current ones.
+ */
+static void show(const struct metrics_segment *m, const struct metrics_totals *t,
+                 const struct metrics_totals *prev, struct histogram *hist, double seconds) {
+
+  struct histogram cur, diff;
+  uint64_t lookups = m->cache_hits + m->cache_misses;
+  int v, b;
+
+  printf("PostOffice %d: up %llds, %d workers\n", (int) m->pid,
+         (long long) (time(NULL) - m->started), m->num_workers);
+  printf("sessions  %8llu open %12llu total\n",
+         (unsigned long long) t->sessions, (unsigned long long) t->sessions_total);
+  printf("transfers %8llu running %9llu total\n",
+         (unsigned long long) t->transfers, (unsigned long long) t->transfers_total);
+  printf("sent      %8.2f MB/s %12llu bytes\n",
+         (t->bytes_sent - prev->bytes_sent) / seconds / 1e6, (unsigned long long) t->bytes_sent);
+  printf("received  %8.2f MB/s %12llu bytes\n",
+         (t->bytes_received - prev->bytes_received) / seconds / 1e6,
+         (unsigned long long) t->bytes_received);
+  printf("commands  %8.0f /s   %12llu total\n",
+         (t->commands - prev->commands) / seconds, (unsigned long long) t->commands);
+  printf("cache     %7.1f%% hits %11llu bytes\n",
+         lookups ? 100.0 * m->cache_hits / lookups : 0.0, (unsigned long long) m->cache_bytes);
+  if (t->pasv_ports)
+    printf("pasv      %8llu of %llu ports in use, %llu refused\n",
+           (unsigned long long) t->pasv_in_use, (unsigned long long) t->pasv_ports,
+           (unsigned long long) t->pasv_refused);
+
+  printf("\n%-6s %10s %9s %9s %9s %9s %9s\n",
+         "verb", "count", "/s", "p50 us", "p90 us", "p99 us", "max us");
+  for (v = 0; v < m->num_verbs; v++) {
+    metrics_verb(m, v, &cur);
+    if (cur.count) {
+      diff = cur;
+      for (b = 0; b < METRICS_HIST_BUCKETS; b++)
+        diff.buckets[b] -= hist[v].buckets[b];
+      diff.count -= hist[v].count;
+      printf("%-6s %10llu %9.0f", m->verbs[v], (unsigned long long) cur.count,
+             diff.count / seconds);
+      print_us(histogram_percentile(&diff, 50), diff.count != 0);
+      print_us(histogram_percentile(&diff, 90), diff.count != 0);
+      print_us(histogram_percentile(&diff, 99), diff.count != 0);
+      print_us(cur.max, 1);
+      printf("\n");
+    }
+    hist[v] = cur;
+  }
+}
+
+int main(int argc, char *argv[]) {
+
+  struct metrics_segment *m;
+  struct metrics_totals t, prev;
+  struct histogram *hist;
+  double interval = 1, last;
+  long count = 0, i;
+  int batch = 0, opt;
+
+  while ((opt = getopt(argc, argv, "i:n:b")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atof(optarg);
+      if (interval <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      count = atol(optarg);
+      break;
+    case 'b':
+      batch = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if ((m = metrics_attach(argv[optind])) == NULL) {
+    fprintf(stderr, "%s: no metrics for port %s: %s\n", argv[0], argv[optind],
+            errno == EINVAL ? "unknown layout" : strerror(errno));
+    return 1;
+  }
+  hist = calloc(m->num_verbs, sizeof(struct histogram));
+  if (!hist) {
+    perror("calloc");
+    return 1;
+  }
+
+  // the first update shows the rates since the server started
+  memset(&prev, 0, sizeof(prev));
+  last = now() - (time(NULL) - m->started);
+  if (last > now() - 1)
+    last = now() - 1;
+
+  for (i = 0; !count || i < count; i++) {
+    double t_now;
+
+    if (i)
+      usleep(interval * 1e6);
+    if (kill(m->pid, 0) == -1 && errno == ESRCH) {
+      fprintf(stderr, "%s: server %d is not running\n", argv[0], (int) m->pid);
+      return 1;
+    }
+    metrics_sum(m, &t);
+    t_now = now();
+    if (!batch)
+      printf("\033[H\033[J");
+    show(m, &t, &prev, hist, t_now - last);
+    if (batch)
+      printf("\n");
+    fflush(stdout);
+    prev = t;
+    last = t_now;
+  }
+  return 0;
+}
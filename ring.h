@@ -0,0 +1,92 @@
+/* ring.h
+ * Ring of fixed-size records with a single producer, a thread of the
+ * server, and a single consumer, a background thread that writes the
+ * records out (see log.c and trace.c). The producer owns head and the
+ * consumer owns tail; each publishes its index with a release store
+ * and reads the other's with an acquire load, so neither ever takes a
+ * lock or waits. A record that finds the ring full is dropped and
+ * counted instead.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ring {
+  uint64_t     head __attribute__ ((aligned(64)));    /* next record, written by the producer */
+  uint64_t     tail __attribute__ ((aligned(64)));    /* next record, read by the consumer */
+  uint64_t     dropped __attribute__ ((aligned(64))); /* records there was no room for */
+  uint64_t     reported;  /* dropped records the consumer has told about */
+  int          owner;     /* worker of the producer, -1 for the other threads */
+  struct ring *next;      /* in the consumer's list of rings */
+  uint32_t     mask;      /* records - 1 */
+  uint32_t     size;      /* bytes of a record */
+  char         records[] __attribute__ ((aligned(64)));
+};
+
+/** Creates a ring of records (a power of two) records of size bytes,
+ *  and adds it to the consumer's list, which only ever grows.
+ *
+ *  Returns: the ring, or NULL if there is no memory for it.
+ */
+static inline struct ring *ring_create(struct ring **list, uint32_t records, uint32_t size,
+                                       int owner) {
+
+  struct ring *r;
+
+  if (posix_memalign((void **) &r, 64, sizeof(struct ring) + (size_t) records * size) != 0)
+    return NULL;
+  memset(r, 0, sizeof(struct ring));
+  r->owner = owner;
+  r->mask  = records - 1;
+  r->size  = size;
+  r->next  = __atomic_load_n(list, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(list, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return r;
+}
+
+/** Returns the record the producer fills next, or NULL if the ring is
+ *  full, in which case the record is counted as dropped. The consumer
+ *  only sees it after ring_commit().
+ */
+static inline void *ring_reserve(struct ring *r) {
+  if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask) {
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return r->records + (r->head & r->mask) * r->size;
+}
+
+static inline void ring_commit(struct ring *r) {
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/** Returns the oldest record the consumer has not read, or NULL if
+ *  there is none. The producer may reuse it after ring_release().
+ */
+static inline const void *ring_peek(struct ring *r) {
+  if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+    return NULL;
+  return r->records + (r->tail & r->mask) * r->size;
+}
+
+static inline void ring_release(struct ring *r) {
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/** Returns the records dropped since the consumer last asked.
+ */
+static inline uint64_t ring_new_drops(struct ring *r) {
+
+  uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  uint64_t n = dropped - r->reported;
+
+  r->reported = dropped;
+  return n;
+}
+
+#endif
@@ -0,0 +1,134 @@
+/* sched.c
+ * Scheduler of the transfers of a worker (see sched.h).
+ *
+ * When the data connection of a download becomes writable, the session
+ * joins the worker's run queue instead of sending right away, and its
+ * socket is left out of the event loop. After every batch of events,
+ * the worker runs one round of deficit round-robin over the queue:
+ * every transfer gets a quantum times its weight more bytes of credit
+ * and sends until the credit is used up, going back to the end
+ * of the queue, or until its socket is full, leaving the queue until
+ * the socket is writable again (and forgetting its credit, as idle
+ * queues do in DRR). A small file is thus sent in its first turn, at
+ * most one round after it was requested, while the bulk transfers
+ * share the rest of the bandwidth by weight.
+ *
+ * The quantum is SCHED_QUANTUM or the chunk size of the transfers (-c),
+ * whichever is larger, so that a turn of a transfer of weight 1 is at
+ * least one full step of its pump.
+ *
+ * Weights are given per user when the server starts (option -W), and
+ * can be changed for a session, which puts it in a class of its own,
+ * with SITE WEIGHT.
+ */
+
+#include "sched.h"
+#include "session.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* The weight of a user, found by name */
+struct user_weight {
+  char name[SCHED_MAX_NAME];
+  int  weight;
+};
+
+static struct user_weight weights[SCHED_MAX_USERS];
+static int num_weights;
+
+/** Gives the transfers of user a weight. Must be called before the
+ *  workers start.
+ *
+ *  Returns: 0 on success, -1 if the weight or the name is not valid or
+ *           there are too many users.
+ */
+int sched_set_user_weight(const char *user, int weight) {
+
+  int i;
+
+  if (weight < 1 || weight > SCHED_MAX_WEIGHT || strlen(user) >= SCHED_MAX_NAME)
+    return -1;
+  for (i = 0; i < num_weights; i++) {
+    if (!strcasecmp(weights[i].name, user)) {
+      weights[i].weight = weight;
+      return 0;
+    }
+  }
+  if (num_weights == SCHED_MAX_USERS)
+    return -1;
+  strcpy(weights[num_weights].name, user);
+  weights[num_weights++].weight = weight;
+  return 0;
+}
+
+/** Returns the weight of the transfers of user.
+ */
+int sched_user_weight(const char *user) {
+
+  int i;
+
+  for (i = 0; i < num_weights; i++)
+    if (!strcasecmp(weights[i].name, user))
+      return weights[i].weight;
+  return SCHED_DEFAULT_WEIGHT;
+}
+
+/** Adds a session whose transfer can send to the end of its worker's
+ *  run queue. Nothing is done if it is already queued.
+ */
+void sched_enqueue(struct session *s) {
+
+  struct worker *w = s->worker;
+
+  if (s->queued)
+    return;
+  s->queued   = 1;
+  s->run_next = NULL;
+  s->run_prev = w->run_tail;
+  if (w->run_tail)
+    w->run_tail->run_next = s;
+  else
+    w->run_head = s;
+  w->run_tail = s;
+}
+
+/** Takes a session out of its worker's run queue.
+ */
+void sched_remove(struct session *s) {
+
+  struct worker *w = s->worker;
+
+  if (!s->queued)
+    return;
+  if (s->run_prev)
+    s->run_prev->run_next = s->run_next;
+  else
+    w->run_head = s->run_next;
+  if (s->run_next)
+    s->run_next->run_prev = s->run_prev;
+  else
+    w->run_tail = s->run_prev;
+  s->run_prev = s->run_next = NULL;
+  s->queued = 0;
+}
+
+/** Runs one round of the worker's run queue: every session that was
+ *  queued when the round started gets one turn.
+ */
+void sched_run(struct worker *w) {
+
+  struct session *s, *last = w->run_tail;
+  long long quantum = transfer_chunk_size > SCHED_QUANTUM ? transfer_chunk_size : SCHED_QUANTUM;
+
+  while ((s = w->run_head) != NULL) {
+    sched_remove(s);
+    s->deficit += quantum * s->weight;
+    if (transfer_send(s, &s->deficit))
+      sched_enqueue(s);
+    else
+      s->deficit = 0;
+    if (s == last)
+      break;
+  }
+}
@@ -0,0 +1,27 @@
+/* sched.h
+ * Scheduler of the transfers of a worker. The transfers that can send
+ * take turns in deficit round-robin order, each sending a quantum of
+ * bytes proportional to its weight per round, so that a large download
+ * only slows down a small one by a round, however large it is.
+ */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#define SCHED_QUANTUM (64 * 1024) /* least bytes a transfer of weight 1 sends per round;
+                                     a larger chunk size (-c) raises it to one chunk */
+#define SCHED_DEFAULT_WEIGHT 1
+#define SCHED_MAX_WEIGHT 64
+#define SCHED_MAX_USERS 64        /* users that can be given a weight */
+#define SCHED_MAX_NAME 32
+
+struct worker;
+struct session;
+
+int sched_set_user_weight(const char *user, int weight);
+int sched_user_weight(const char *user);
+void sched_enqueue(struct session *s);
+void sched_remove(struct session *s);
+void sched_run(struct worker *w);
+
+#endif
@@ -0,0 +1,407 @@
+/* server.c
+ * Event loop that accepts control connections and drives every
+ * session of the ftp server. All sockets are non-blocking and are
+ * registered in a single epoll instance, so a slow client never
+ * stalls the others.
+ *
+ * Notes: The socket creation code is adapted from Beej's Guide to
+ * Network Programming (http://beej.us/guide/bgnet/).
+ */
+
+#include "server.h"
+#include "session.h"
+#include "uring.h"
+#include "portpool.h"
+#include "sched.h"
+#include "metrics.h"
+#include "filecache.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 256    // how many events are handled per call to epoll_wait
+#define TICK_INTERVAL 1000 // ms between scans for expired session deadlines
+
+/** Returns the current value of the monotonic clock in milliseconds.
+ */
+long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Creates a non-blocking server socket at the specified port number
+ *  for the ftp communication and starts listening for new
+ *  connections. Exits the program if the socket cannot be created.
+ *
+ *  Parameters: port: String corresponding to the port number (or
+ *                    name) where the server will listen for new
+ *                    connections.
+ *              reuse_port: if not 0, the socket is bound with
+ *                    SO_REUSEPORT so that every worker can have its
+ *                    own listening socket on the same port, and the
+ *                    kernel spreads new connections among them.
+ *
+ *  Returns: the file descriptor of the listening socket.
+ */
+int create_com_socket(const char *port, int reuse_port) {
+
+  int sockfd;
+  struct addrinfo hints, *servinfo, *p;
+  int yes = 1;
+  int rv;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family   = AF_INET;     // use IPv4 - can update to include ipv6 with AF_UNSPEC
+  hints.ai_socktype = SOCK_STREAM; // create a stream (TCP) socket server
+  hints.ai_flags    = AI_PASSIVE;  // use any available connection
+
+  // Gets information about available socket types and protocols
+  if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "control con getaddrinfo: %s\n", gai_strerror(rv));
+    exit(1);
+  }
+
+  // loop through all the results and bind to the first we can
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+
+    // create socket object
+    if ((sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         p->ai_protocol)) == -1) {
+      perror("control connection: socket");
+      continue;
+    }
+
+    // specify that, once the program finishes, the port can be reused by other processes
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+      perror("control con setsockopt");
+      exit(1);
+    }
+
+    if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+      perror("control con setsockopt SO_REUSEPORT");
+      exit(1);
+    }
+
+    // bind to the specified port number
+    if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+      close(sockfd);
+      perror("control connection: bind");
+      continue;
+    }
+
+    // if the code reaches this point, the socket was properly created and bound
+    break;
+  }
+
+  // all done with this structure
+  freeaddrinfo(servinfo);
+
+  // if p is null, the loop above could create a socket for any given address
+  if (p == NULL) {
+    fprintf(stderr, "control connection: failed to bind\n");
+    exit(1);
+  }
+
+  // sets up a queue of incoming connections to be received by the server
+  if (listen(sockfd, SOMAXCONN) == -1) {
+    perror("control connection listen");
+    exit(1);
+  }
+
+  return sockfd;
+}
+
+/** Initializes a watcher that is not yet registered in the event loop.
+ */
+void watcher_init(struct watcher *w, watcher_handler_t handler, void *arg) {
+  w->fd      = -1;
+  w->events  = 0;
+  w->handler = handler;
+  w->arg     = arg;
+}
+
+/** Registers fd in the worker's event loop with the given events.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int watcher_add(struct worker *wk, struct watcher *w, int fd, uint32_t events) {
+
+  struct epoll_event ev;
+
+  ev.events   = events;
+  ev.data.ptr = w;
+  if (epoll_ctl(wk->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    log_perror(0, "epoll_ctl add");
+    return -1;
+  }
+  w->fd     = fd;
+  w->events = events;
+  return 0;
+}
+
+/** Changes the events a registered watcher is interested in. Nothing
+ *  is done if the events did not change.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int watcher_set(struct worker *wk, struct watcher *w, uint32_t events) {
+
+  struct epoll_event ev;
+
+  if (w->fd < 0 || w->events == events)
+    return 0;
+
+  ev.events   = events;
+  ev.data.ptr = w;
+  if (epoll_ctl(wk->epoll_fd, EPOLL_CTL_MOD, w->fd, &ev) == -1) {
+    log_perror(0, "epoll_ctl mod");
+    return -1;
+  }
+  w->events = events;
+  return 0;
+}
+
+/** Removes the watcher's file descriptor from the event loop without
+ *  closing it. No events are reported for it until it is added again.
+ */
+void watcher_detach(struct worker *wk, struct watcher *w) {
+  if (w->fd >= 0)
+    epoll_ctl(wk->epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+  w->events = 0;
+}
+
+/** Closes the watcher's file descriptor, which also removes it from
+ *  the event loop.
+ */
+void watcher_close(struct worker *wk, struct watcher *w) {
+  if (w->fd >= 0)
+    close(w->fd);
+  w->fd     = -1;
+  w->events = 0;
+}
+
+/** Accepts every pending connection on the listening socket and
+ *  creates a session for each of them.
+ */
+static void handle_accept(struct watcher *w, uint32_t events) {
+
+  struct worker *wk = w->arg;
+  struct sockaddr_storage their_addr; // connector's address information
+  socklen_t sin_size;
+  int new_fd;
+
+  while (1) {
+    sin_size = sizeof(their_addr);
+    new_fd = accept4(w->fd, (struct sockaddr *) &their_addr, &sin_size,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new_fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log_perror(0, "accept");
+      return;
+    }
+
+    if (session_create(wk, new_fd) == NULL)
+      close(new_fd);
+  }
+}
+
+/** Prepares worker id of num_workers to serve the connections
+ *  arriving on listen_fd.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int worker_init(struct worker *w, int id, int num_workers, int listen_fd) {
+
+  memset(w, 0, sizeof(*w));
+  w->id = id;
+  w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (w->epoll_fd == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  watcher_init(&w->listener, handle_accept, w);
+  if (watcher_add(w, &w->listener, listen_fd, EPOLLIN) == -1) {
+    close(w->epoll_fd);
+    return -1;
+  }
+
+  w->metrics = metrics_worker(id);
+  if (pasv_port_first) {
+    if ((w->ports = portpool_create(w, num_workers)) == NULL) {
+      close(w->epoll_fd);
+      return -1;
+    }
+    metric_set(&w->metrics->pasv_ports, w->ports->count);
+  }
+
+  if (uring_enabled)
+    w->ring = uring_create(w, transfer_chunk_size);
+
+  w->next_tick = now_ms() + TICK_INTERVAL;
+  w->next_wake = LLONG_MAX;
+  return 0;
+}
+
+/** Expires every session whose data connection did not arrive in
+ *  time, and samples the rate of the transfers in progress. The first
+ *  worker also copies the counters of the file cache, which is shared,
+ *  to the metrics.
+ */
+static void worker_tick(struct worker *w) {
+
+  long long now = now_ms();
+  struct session *s, *next;
+  struct filecache_stats st;
+
+  if (now < w->next_tick)
+    return;
+  w->next_tick = now + TICK_INTERVAL;
+
+  if (w->id == 0) {
+    filecache_get_stats(&st);
+    metric_set(&metrics->cache_hits, st.hits);
+    metric_set(&metrics->cache_misses, st.misses);
+    metric_set(&metrics->cache_bytes, st.bytes);
+  }
+
+  for (s = w->sessions; s; s = next) {
+    next = s->next;
+    if (s->state == SESSION_WAIT_DATA && s->deadline <= now)
+      transfer_expire(s);
+    else if (s->state == SESSION_TRANSFER)
+      transfer_sample_rate(s, now);
+  }
+}
+
+/** Frees the sessions that were closed while handling the last batch
+ *  of events. This is deferred so that events for a closed session
+ *  that are still in the batch never see freed memory.
+ */
+static void worker_reap(struct worker *w) {
+
+  struct session *s;
+
+  while ((s = w->closed) != NULL) {
+    w->closed = s->next;
+    session_free(s);
+  }
+}
+
+/** Runs the worker's event loop forever.
+ */
+void worker_run(struct worker *w) {
+
+  struct epoll_event events[MAX_EVENTS];
+  int i, n, timeout;
+
+  log_set_worker(w->id);
+  log_msg(LOG_INFO, 0, "server: worker %d waiting for connections", w->id);
+
+  while (1) {
+    // requests queued by the last batch of events go to the kernel together
+    uring_submit(w->ring);
+
+    timeout = (w->next_wake < w->next_tick ? w->next_wake : w->next_tick) - now_ms();
+    if (timeout < 0 || w->run_head)
+      timeout = 0;
+
+    n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      log_perror(0, "epoll_wait");
+      return;
+    }
+
+    for (i = 0; i < n; i++) {
+      struct watcher *wt = events[i].data.ptr;
+      wt->handler(wt, events[i].events);
+    }
+
+    if (w->next_wake <= now_ms())
+      transfer_wake(w);
+    // the transfers that can send take one turn each
+    if (w->run_head)
+      sched_run(w);
+    worker_tick(w);
+    worker_reap(w);
+  }
+}
+
+/** Thread entry point of a worker. The worker is pinned to a core so
+ *  that its sessions stay in that core's caches.
+ */
+static void *worker_main(void *arg) {
+
+  struct worker *w = arg;
+  cpu_set_t cpus;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (num_cpus > 1) {
+    CPU_ZERO(&cpus);
+    CPU_SET(w->id % num_cpus, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  worker_run(w);
+  return NULL;
+}
+
+/** Starts num_workers workers serving connections on port and waits
+ *  for them. With a single worker, the event loop runs in the calling
+ *  thread; otherwise every worker gets its own thread and its own
+ *  SO_REUSEPORT listening socket.
+ *
+ *  Returns: -1 if the workers could not be started or if they stopped.
+ */
+int server_run(const char *port, int num_workers) {
+
+  struct worker *workers;
+  int i;
+
+  if (num_workers == 1) {
+    struct worker w;
+    if (worker_init(&w, 0, 1, create_com_socket(port, 0)) == -1)
+      return -1;
+    worker_run(&w);
+    return -1;
+  }
+
+  workers = calloc(num_workers, sizeof(struct worker));
+  if (!workers) {
+    perror("server: calloc");
+    return -1;
+  }
+
+  for (i = 0; i < num_workers; i++) {
+    if (worker_init(&workers[i], i, num_workers, create_com_socket(port, 1)) == -1)
+      return -1;
+  }
+
+  for (i = 0; i < num_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      fprintf(stderr, "server: could not start worker %d\n", i);
+      return -1;
+    }
+  }
+
+  for (i = 0; i < num_workers; i++)
+    pthread_join(workers[i].thread, NULL);
+  return -1;
+}
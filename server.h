@@ -0,0 +1,64 @@
+/* server.h
+ * Event loop that accepts control connections and drives every
+ * session of the ftp server.
+ */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_WORKERS 256 /* upper limit for the number of worker threads */
+
+struct session;
+struct watcher;
+struct uring;
+struct port_pool;
+struct worker_metrics;
+
+typedef void (*watcher_handler_t)(struct watcher *w, uint32_t events);
+
+/* A file descriptor registered in the event loop. The handler is
+ * called with the epoll events reported for the descriptor. */
+struct watcher {
+  int               fd;
+  uint32_t          events;  /* events currently registered in epoll */
+  watcher_handler_t handler;
+  void             *arg;
+};
+
+/* Each worker thread owns an epoll instance, a listening socket and
+ * the sessions it accepted. Nothing in a worker is shared with the
+ * other workers, so the event loop never takes a lock. */
+struct worker {
+  int              id;
+  pthread_t        thread;
+  int              epoll_fd;
+  struct watcher   listener;
+  struct session  *sessions;      /* sessions currently being served */
+  struct session  *closed;        /* sessions to be freed after the current batch */
+  int              num_sessions;
+  long long        next_tick;     /* monotonic time (ms) of the next timer scan */
+  struct session  *throttled;     /* sessions whose transfer waits for tokens */
+  long long        next_wake;     /* monotonic time (ms) the first of them goes on */
+  struct session  *run_head, *run_tail; /* transfers that can send, see sched.c */
+  struct uring    *ring;          /* io_uring for file transfers, NULL if not used */
+  struct port_pool *ports;        /* passive mode listening sockets, NULL without a port range */
+  struct worker_metrics *metrics; /* written only by this worker, see metrics.c */
+};
+
+int create_com_socket(const char *port, int reuse_port);
+int worker_init(struct worker *w, int id, int num_workers, int listen_fd);
+void worker_run(struct worker *w);
+int server_run(const char *port, int num_workers);
+
+void watcher_init(struct watcher *w, watcher_handler_t handler, void *arg);
+int watcher_add(struct worker *wk, struct watcher *w, int fd, uint32_t events);
+int watcher_set(struct worker *wk, struct watcher *w, uint32_t events);
+void watcher_detach(struct worker *wk, struct watcher *w);
+void watcher_close(struct worker *wk, struct watcher *w);
+
+long long now_ms(void);
+
+#endif
@@ -0,0 +1,487 @@
+/* session.c
+ * State kept for every client connected to the ftp server, and the
+ * handling of its control connection.
+ */
+
+#include "session.h"
+#include "zmode.h"
+#include "command.h"
+#include "sched.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* Fixes a problem in OSX that it does not define MSG_NOSIGNAL */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0x2000 /* don't raise SIGPIPE */
+#endif
+
+static void handle_control(struct watcher *w, uint32_t events);
+static int send_pending(struct session *s);
+
+static uint64_t next_session_id;  /* ids of the sessions, across the workers */
+
+/** Creates a session for a newly accepted control connection, adds
+ *  it to the worker's event loop and greets the client.
+ *
+ *  Parameters: w: worker that will serve the session.
+ *              fd: non-blocking socket of the control connection.
+ *
+ *  Returns: the new session, or NULL if it could not be created (in
+ *           which case fd is left open).
+ */
+struct session *session_create(struct worker *w, int fd) {
+
+  struct session *s = calloc(1, sizeof(struct session));
+  socklen_t len;
+  int one = 1;
+  if (!s) {
+    log_perror(0, "session: calloc");
+    return NULL;
+  }
+
+  s->worker = w;
+  s->state  = SESSION_IDLE;
+  s->id     = __atomic_add_fetch(&next_session_id, 1, __ATOMIC_RELAXED);
+
+  // the addresses are looked up once, rather than on every PASV
+  len = sizeof(s->local_addr);
+  if (getsockname(fd, (struct sockaddr *) &s->local_addr, &len) == -1) {
+    log_perror(s->id, "session: getsockname");
+    free(s);
+    return NULL;
+  }
+  len = sizeof(s->peer_addr);
+  if (getpeername(fd, (struct sockaddr *) &s->peer_addr, &len) == -1) {
+    log_perror(s->id, "session: getpeername");
+    free(s);
+    return NULL;
+  }
+  s->traced = trace_sample(s->id);
+  if (log_level >= LOG_INFO || s->traced) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &s->peer_addr.sin_addr, addr, sizeof(addr));
+    log_msg(LOG_INFO, s->id, "server: got connection from %s", addr);
+    if (s->traced)
+      trace_session(s, addr);
+  }
+
+  // replies are coalesced by the session (see session_resume), so
+  // whatever is written can go out at once
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // clients send ABOR as urgent data; it is read in line with the rest
+  setsockopt(fd, SOL_SOCKET, SO_OOBINLINE, &one, sizeof(one));
+  s->nb     = nb_create(fd, MAX_LINE_LENGTH + 1);
+  if (!s->nb) {
+    log_perror(s->id, "session: nb_create");
+    free(s);
+    return NULL;
+  }
+  sb_init(&s->out);
+  transfer_init(&s->xfer);
+  strcpy(s->cwd, main_dir);
+  s->z_level = ZMODE_DEFAULT_LEVEL;
+  s->mlst_facts = MLSX_ALL;
+  bucket_init(&s->shape, -1);
+  s->weight = SCHED_DEFAULT_WEIGHT;
+
+  watcher_init(&s->ctl, handle_control, s);
+  watcher_init(&s->pasv, NULL, s);
+  watcher_init(&s->data, NULL, s);
+
+  if (watcher_add(w, &s->ctl, fd, EPOLLIN) == -1) {
+    nb_destroy(s->nb);
+    free(s);
+    return NULL;
+  }
+
+  // link the session in the worker's list
+  s->next = w->sessions;
+  if (w->sessions)
+    w->sessions->prev = s;
+  w->sessions = s;
+  w->num_sessions++;
+  metric_add(&w->metrics->sessions_total, 1);
+  metric_set(&w->metrics->sessions, w->num_sessions);
+
+  // start communicating by asking for a username
+  session_reply(s, "220 Welcome. Server is ready. Provide a username. \r\n");
+  return s;
+}
+
+/** Closes all the resources that are in use including the
+ *  communication/data sockets. The memory of the session is only
+ *  released by session_free, once the worker is done with the current
+ *  batch of events. Usually called after a quit command or a terminal
+ *  error.
+ */
+void session_close(struct session *s) {
+
+  struct worker *w = s->worker;
+
+  if (s->state == SESSION_CLOSING)
+    return;
+  s->state = SESSION_CLOSING;
+
+  // the last replies (such as the one to QUIT) may still be queued
+  send_pending(s);
+  transfer_reset(s);
+  close_data_con_resources(s);
+  watcher_close(w, &s->ctl);
+
+  // move the session from the list of live sessions to the closed ones
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    w->sessions = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  w->num_sessions--;
+  metric_set(&w->metrics->sessions, w->num_sessions);
+
+  s->prev = NULL;
+  s->next = w->closed;
+  w->closed = s;
+}
+
+/** Releases the memory of a session previously closed with
+ *  session_close.
+ */
+void session_free(struct session *s) {
+  nb_destroy(s->nb);
+  sb_free(&s->out);
+  sb_free(&s->xfer.buf);
+  free(s);
+}
+
+/** Sends as much of the pending replies as the socket accepts without
+ *  blocking.
+ *
+ *  Returns: 0 on success (even if some data is still pending), -1 if
+ *           the connection failed.
+ */
+static int send_pending(struct session *s) {
+
+  while (sb_pending(&s->out)) {
+    ssize_t rv = send(s->ctl.fd, sb_head(&s->out), sb_pending(&s->out),
+                      MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (rv == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    sb_consume(&s->out, rv);
+  }
+  return 0;
+}
+
+/** Registers the control connection for the events the session
+ *  currently needs: readable when it can accept new commands and
+ *  writable when there are replies that could not be sent yet. During
+ *  a transfer, commands are read until one has to wait for the end of
+ *  the transfer.
+ */
+void session_update_events(struct session *s) {
+
+  uint32_t events = 0;
+  size_t len;
+
+  if (s->state == SESSION_CLOSING)
+    return;
+  if (sb_pending(&s->out) < MAX_PENDING_REPLY &&
+      (s->state == SESSION_IDLE || !nb_peek_line(s->nb, &len)))
+    events |= EPOLLIN;
+  if (sb_pending(&s->out))
+    events |= EPOLLOUT;
+  watcher_set(s->worker, &s->ctl, events);
+}
+
+/** Sends as much of the pending replies as the socket accepts without
+ *  blocking. Closes the session if the connection failed.
+ *
+ *  Returns: 0 on success (even if some data is still pending), -1 if
+ *           the session was closed.
+ */
+static int session_flush(struct session *s) {
+
+  if (send_pending(s) == -1) {
+    log_perror(s->id, "server: error on sending data on control connection");
+    session_close(s);
+    return -1;
+  }
+  return 0;
+}
+
+/** Sends a potentially-formatted reply to the client on the control
+ *  connection. The reply is queued in the session and sent as soon as
+ *  the socket accepts it, so this function never blocks.
+ *
+ *  Parameters: s: the session to reply to.
+ *              fmt: String to be sent, including potential
+ *                   printf-like format directives.
+ *              additional parameters based on string format.
+ *
+ *  While the session is running a batch of commands (see
+ *  session_resume), replies are only queued, so that the replies of
+ *  pipelined commands leave together.
+ *
+ *  Returns: 0 if the reply was queued or sent, -1 if the session
+ *           is closed.
+ */
+int session_reply(struct session *s, const char *fmt, ...) {
+
+  char small[BUFFER_SIZE];
+  va_list args;
+  int size;
+
+  if (s->state == SESSION_CLOSING)
+    return -1;
+
+  va_start(args, fmt);
+  size = vsnprintf(small, sizeof(small), fmt, args);
+  va_end(args);
+  if (size < 0)
+    return -1;
+
+  if ((size_t) size < sizeof(small)) {
+    if (sb_append(&s->out, small, size) == -1)
+      return -1;
+  } else {
+    // Too long for the local buffer; format it again straight into the queue
+    if (sb_reserve(&s->out, size + 1) == -1)
+      return -1;
+    va_start(args, fmt);
+    vsnprintf(s->out.data + s->out.len, size + 1, fmt, args);
+    va_end(args);
+    s->out.len += size;
+  }
+
+  if (s->batch)
+    return 0;
+  if (session_flush(s) == -1)
+    return -1;
+  session_update_events(s);
+  return 0;
+}
+
+/** Runs the commands already buffered from the control connection,
+ *  as long as the session is able to take new commands, sends all
+ *  their replies at once and then updates the events the session
+ *  waits for. While a transfer is in progress, only the commands that
+ *  are allowed during a transfer (ABOR, STAT, NOOP) are run; the first
+ *  other command waits until the transfer is over.
+ */
+void session_resume(struct session *s) {
+
+  const struct command *c;
+  char *line;
+  size_t len;
+
+  s->batch++;
+
+  // lines are handled in place in the control connection's buffer
+  while (s->state != SESSION_CLOSING && (line = nb_peek_line(s->nb, &len)) != NULL) {
+    if (s->state != SESSION_IDLE &&
+        (s->skip_line || !(c = command_find_line(line, len)) || !c->transfer))
+      break;
+    // the replies coalesced so far are sent once they reach the limit;
+    // if the client does not take them, the rest of the lines wait
+    if (sb_pending(&s->out) >= MAX_PENDING_REPLY &&
+        (send_pending(s) == -1 || sb_pending(&s->out) >= MAX_PENDING_REPLY))
+      break;
+    nb_consume(s->nb, len);
+    if (line[len - 1] != '\n') {
+      if (!s->skip_line)
+        session_reply(s, "500 Command line too long.\r\n");
+      s->skip_line = 1;
+      continue;
+    }
+    if (s->skip_line) {
+      s->skip_line = 0;  // the end of the line that was too long
+      continue;
+    }
+    line[len - 1] = '\0';
+    handle_command(s, line);
+  }
+
+  if (--s->batch || s->state == SESSION_CLOSING)
+    return;
+  if (session_flush(s) == -1)
+    return;
+  session_update_events(s);
+}
+
+/** Event handler for the control connection.
+ */
+static void handle_control(struct watcher *w, uint32_t events) {
+
+  struct session *s = w->arg;
+  int result;
+
+  if (s->state == SESSION_CLOSING)
+    return;
+
+  if (events & EPOLLOUT) {
+    if (session_flush(s) == -1)
+      return;
+  }
+
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    result = nb_feed(s->nb);
+    if (result == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return;
+      // netbuffer couldn't read; connection error
+      log_perror(s->id, "server: error on reading data on control connection");
+      session_close(s);
+      return;
+    }
+    if (result == 0) { // client left
+      log_msg(LOG_INFO, s->id, "server: client left");
+      session_close(s);
+      return;
+    }
+  }
+
+  session_resume(s);
+}
+
+/** Builds the path of name relative to the working directory of the
+ *  session. Absolute names are used as they are.
+ *
+ *  Returns: 0 on success, -1 if the path does not fit in size bytes.
+ */
+int session_path(struct session *s, const char *name, char *out, size_t size) {
+
+  int len;
+
+  if (name[0] == '/')
+    len = snprintf(out, size, "%s", name);
+  else
+    len = snprintf(out, size, "%s/%s", s->cwd, name);
+  if (len < 0 || (size_t) len >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+/** Returns 1 if the resolved (canonical) path is the directory the
+ *  server was started from or is inside it, 0 otherwise.
+ */
+static int inside_main_dir(const char *resolved) {
+
+  size_t len_main = strlen(main_dir);
+
+  if (strncmp(resolved, main_dir, len_main))
+    return 0;
+  return resolved[len_main] == '/' || resolved[len_main] == '\0' || len_main == 1;
+}
+
+/** Checks that a file can be created at path: the directory that
+ *  would contain it must exist and be inside the directory the server
+ *  was started from.
+ *
+ *  Returns: 0 if the file can be created there, -1 with errno set
+ *           otherwise.
+ */
+int session_check_new_file(const char *path) {
+
+  char parent[PATH_MAX];
+  char resolved[PATH_MAX];
+  char *slash;
+
+  if (strlen(path) >= sizeof(parent)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(parent, path);
+  slash = strrchr(parent, '/');
+  if (!slash || slash[1] == '\0') {
+    errno = EISDIR;
+    return -1;
+  }
+  if (slash == parent)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+
+  if (!realpath(parent, resolved))
+    return -1;
+  if (!inside_main_dir(resolved)) {
+    errno = EACCES;
+    return -1;
+  }
+  return 0;
+}
+
+/** Resolves name relative to the working directory of the session
+ *  into a canonical path in out, which must hold PATH_MAX bytes. The
+ *  file must exist inside the directory the server was started from.
+ *
+ *  Returns: 0 on success, -1 on error with errno set.
+ */
+int session_resolve(struct session *s, const char *name, char *out) {
+
+  char path[PATH_MAX];
+
+  if (session_path(s, name, path, sizeof(path)) == -1)
+    return -1;
+  if (!realpath(path, out))
+    return -1;
+
+  // cannot leave the initial starting dir
+  if (!inside_main_dir(out)) {
+    errno = EACCES;
+    return -1;
+  }
+  return 0;
+}
+
+/** Changes the working directory of the session. Each session keeps
+ *  its own working directory, so the process working directory is
+ *  never changed. The new directory must be inside the directory the
+ *  server was started from.
+ *
+ *  Returns: 0 on success, -1 on error with errno set.
+ */
+int session_chdir(struct session *s, const char *name) {
+
+  char resolved[PATH_MAX];
+  struct stat st;
+
+  if (session_resolve(s, name, resolved) == -1)
+    return -1;
+
+  if (stat(resolved, &st) == -1)
+    return -1;
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return -1;
+  }
+  if (access(resolved, X_OK) == -1)
+    return -1;
+  if (strlen(resolved) > MAX_PATH_LENGTH) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  strcpy(s->cwd, resolved);
+  return 0;
+}
@@ -0,0 +1,97 @@
+/* session.h
+ * State kept for every client connected to the ftp server.
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "server.h"
+#include "netbuffer.h"
+#include "strbuf.h"
+#include "transfer.h"
+#include "shaper.h"
+
+#define BUFFER_SIZE 256
+#define MAX_LINE_LENGTH 1024 /* Maximum line length for the ftp communication */
+#define MAX_PATH_LENGTH 1024 /* Maximum path length for changing the directory*/
+
+/* Stop reading new commands while this many reply bytes are waiting
+ * to be sent to a client that is not reading them. */
+#define MAX_PENDING_REPLY (64 * 1024)
+
+enum session_state {
+  SESSION_IDLE,       /* waiting for the next command */
+  SESSION_WAIT_DATA,  /* a transfer is waiting for the data connection */
+  SESSION_TRANSFER,   /* a transfer is in progress on the data connection */
+  SESSION_CLOSING     /* closed, waiting to be freed */
+};
+
+struct session {
+  struct worker   *worker;
+  struct session  *prev, *next;  /* links in the worker's session list */
+  int              state;
+  uint64_t         id;           /* tells the session apart in the log, from 1 */
+  int              traced;       /* its spans are recorded (see trace.h) */
+  uint64_t         pasv_start;   /* start of the span waiting for the data connection */
+
+  struct watcher   ctl;          /* control connection */
+  struct watcher   pasv;         /* passive mode listening socket */
+  struct pasv_port *pasv_port;   /* listening socket checked out of the worker's pool instead */
+  struct watcher   data;         /* accepted data connection */
+
+  struct sockaddr_in local_addr; /* server side of the control connection */
+  struct sockaddr_in peer_addr;  /* client side, the only host data connections are taken from */
+
+  net_buffer_t     nb;           /* buffered input of the control connection */
+  int              skip_line;    /* the rest of a line that was too long is dropped */
+  struct strbuf    out;          /* replies waiting to be sent */
+  int              batch;        /* > 0 while replies are queued to be sent together */
+
+  int              logged_in;    /* 1 if the user has been logged in correctly */
+  int              passive_mode; /* 1 if the passive mode has been activated */
+  char             cwd[MAX_PATH_LENGTH + 1];
+  off_t            alloc_size;   /* bytes announced by ALLO for the next upload */
+  off_t            restart_offset; /* offset set by REST for the next RETR/STOR */
+  int              type_ascii;   /* 1 after TYPE A, 0 after TYPE I */
+  int              mode_z;       /* 1 if MODE Z compresses the data connection */
+  int              z_level;      /* deflate level set with OPTS MODE Z LEVEL */
+  unsigned int     mlst_facts;   /* MLSX_* facts of MLSD/MLST, set with OPTS MLST */
+
+  int              num_args;     /* arguments of the command being handled */
+
+  struct transfer  xfer;
+  long long        deadline;     /* monotonic time (ms) the data connection must arrive by */
+
+  struct token_bucket  shape;    /* limit of the data this session sends (see shaper.c) */
+  struct token_bucket *user_shape; /* limit of the data its user sends, NULL before USER */
+  int              throttled;    /* the transfer waits for tokens, in the worker's throttled list */
+  long long        wake;         /* monotonic time (ms) a throttled transfer goes on */
+  struct session  *throttle_prev, *throttle_next;
+
+  int              weight;       /* share of the worker's bandwidth (see sched.c) */
+  long long        deficit;      /* bytes the transfer may still send in this round */
+  int              queued;       /* the transfer can send, in the worker's run queue */
+  struct session  *run_prev, *run_next;
+};
+
+extern char main_dir[MAX_PATH_LENGTH + 1];
+
+struct session *session_create(struct worker *w, int fd);
+void session_close(struct session *s);
+void session_free(struct session *s);
+void session_resume(struct session *s);
+void session_update_events(struct session *s);
+
+int session_reply(struct session *s, const char *fmt, ...)
+  __attribute__ ((format(printf, 2, 3)));
+int session_path(struct session *s, const char *name, char *out, size_t size);
+int session_resolve(struct session *s, const char *name, char *out);
+int session_chdir(struct session *s, const char *name);
+int session_check_new_file(const char *path);
+
+/* Implemented by the command handlers in PostOffice.c */
+void handle_command(struct session *s, char *line);
+
+#endif
@@ -0,0 +1,196 @@
+/* shaper.c
+ * Bandwidth shaping of the data the server sends (see shaper.h).
+ *
+ * A bucket gains rate bytes worth of tokens per second, up to
+ * SHAPER_BURST_MS worth of them, and every byte sent takes one. A
+ * transfer step is not cut short to fit the tokens left: the bytes it
+ * sent are charged afterwards, which may leave a bucket in debt, and
+ * the transfer then waits until every bucket it goes through is out of
+ * debt again. The rate over time is exact, and the send paths (sendfile,
+ * splice, MODE Z...) do not have to know about shaping.
+ *
+ * The global bucket and the users' buckets are shared by the workers
+ * and protected by a mutex, which is only taken when one of them has
+ * a limit. The bucket of a session is only used by its worker.
+ */
+
+#include "shaper.h"
+#include "server.h"
+
+#include <string.h>
+#include <pthread.h>
+
+/* The bucket of a user, found by name */
+struct user_bucket {
+  char                name[SHAPER_MAX_NAME];
+  struct token_bucket bucket;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct token_bucket global;
+static struct user_bucket users[SHAPER_MAX_USERS];
+static int num_users;
+static long long user_rate;      /* rate of the buckets of new users */
+static long long session_rate;   /* rate of the buckets of new sessions */
+static int shared_limits;        /* 1 if a shared bucket has a limit; read without the lock */
+
+/** Updates shared_limits after a change of rates. Called with the lock
+ *  held.
+ */
+static void update_shared_limits(void) {
+
+  int limited = global.rate || user_rate;
+  int i;
+
+  for (i = 0; i < num_users && !limited; i++)
+    limited = users[i].bucket.rate != 0;
+  __atomic_store_n(&shared_limits, limited, __ATOMIC_RELAXED);
+}
+
+/** Sets the rates of the three levels. Must be called before the
+ *  workers start.
+ */
+void shaper_init(const struct shaper_rates *rates) {
+  bucket_init(&global, rates->global);
+  user_rate    = rates->user;
+  session_rate = rates->session;
+  update_shared_limits();
+}
+
+/** Initializes a full bucket with rate bytes per second; rate -1
+ *  takes the rate of new sessions.
+ */
+void bucket_init(struct token_bucket *b, long long rate) {
+  b->rate   = rate < 0 ? session_rate : rate;
+  b->tokens = b->rate * SHAPER_BURST_MS / 1000;
+  b->last   = now_ms();
+}
+
+/** Adds the tokens the bucket gained since it was last used.
+ */
+static void refill(struct token_bucket *b, long long now) {
+
+  long long burst = b->rate * SHAPER_BURST_MS / 1000;
+
+  if (now <= b->last)
+    return;
+  b->tokens += b->rate * (now - b->last) / 1000;
+  if (b->tokens > burst)
+    b->tokens = burst;
+  b->last = now;
+}
+
+/** Takes bytes tokens from a bucket with a limit.
+ *
+ *  Returns: the ms until the bucket is out of debt, 0 if it is not in
+ *           debt.
+ */
+static long long take(struct token_bucket *b, size_t bytes, long long now) {
+  refill(b, now);
+  b->tokens -= bytes;
+  if (b->tokens >= 0)
+    return 0;
+  return (-b->tokens * 1000 + b->rate - 1) / b->rate;
+}
+
+/** Returns the bucket of user, created with the users' rate the first
+ *  time the user logs in, or NULL if there is no room for it.
+ */
+struct token_bucket *shaper_user_bucket(const char *user) {
+
+  struct token_bucket *b = NULL;
+  int i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < num_users; i++) {
+    if (!strcmp(users[i].name, user)) {
+      b = &users[i].bucket;
+      break;
+    }
+  }
+  if (!b && num_users < SHAPER_MAX_USERS && strlen(user) < SHAPER_MAX_NAME) {
+    strcpy(users[num_users].name, user);
+    b = &users[num_users++].bucket;
+    bucket_init(b, user_rate);
+  }
+  pthread_mutex_unlock(&lock);
+  return b;
+}
+
+/** Changes the rate of a bucket (of a user or of a session), which
+ *  takes effect right away.
+ */
+void shaper_set_rate(struct token_bucket *b, long long rate) {
+
+  long long burst = rate * SHAPER_BURST_MS / 1000;
+
+  pthread_mutex_lock(&lock);
+  b->rate = rate;
+  b->last = now_ms();
+  if (b->tokens > burst)
+    b->tokens = burst;
+  update_shared_limits();
+  pthread_mutex_unlock(&lock);
+}
+
+/** Changes the rate of the whole server.
+ */
+void shaper_set_global_rate(long long rate) {
+
+  long long burst = rate * SHAPER_BURST_MS / 1000;
+
+  pthread_mutex_lock(&lock);
+  global.rate = rate;
+  global.last = now_ms();
+  if (global.tokens > burst)
+    global.tokens = burst;
+  update_shared_limits();
+  pthread_mutex_unlock(&lock);
+}
+
+/** Gets the global rate, the rate of the bucket of user (or of new
+ *  users if user is NULL) and the rate of new sessions.
+ */
+void shaper_get_rates(struct token_bucket *user, struct shaper_rates *rates) {
+  pthread_mutex_lock(&lock);
+  rates->global  = global.rate;
+  rates->user    = user ? user->rate : user_rate;
+  rates->session = session_rate;
+  pthread_mutex_unlock(&lock);
+}
+
+/** Returns 1 if data sent by a session with this bucket is limited at
+ *  any level.
+ */
+int shaper_limited(const struct token_bucket *session) {
+  return session->rate || __atomic_load_n(&shared_limits, __ATOMIC_RELAXED);
+}
+
+/** Charges bytes sent by a session to its bucket, to the bucket of its
+ *  user (which may be NULL) and to the global bucket. With bytes 0,
+ *  only tells whether the session may send.
+ *
+ *  Returns: the ms the session has to wait before it sends again, 0 if
+ *           it may send now.
+ */
+long long shaper_charge(struct token_bucket *session, struct token_bucket *user, size_t bytes) {
+
+  long long now, wait = 0, w;
+
+  if (!session->rate && !__atomic_load_n(&shared_limits, __ATOMIC_RELAXED))
+    return 0;
+
+  now = now_ms();
+  if (session->rate)
+    wait = take(session, bytes, now);
+
+  if (__atomic_load_n(&shared_limits, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&lock);
+    if (global.rate && (w = take(&global, bytes, now)) > wait)
+      wait = w;
+    if (user && user->rate && (w = take(user, bytes, now)) > wait)
+      wait = w;
+    pthread_mutex_unlock(&lock);
+  }
+  return wait;
+}
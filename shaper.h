@@ -0,0 +1,40 @@
+/* shaper.h
+ * Bandwidth shaping of the data the server sends, with token buckets
+ * at three levels: the whole server, each user and each session. Data
+ * is only sent while every bucket above the transfer has tokens left;
+ * a transfer that runs out waits on the event loop's timer, so it
+ * never holds up a thread or the other sessions.
+ */
+
+#ifndef _SHAPER_H_
+#define _SHAPER_H_
+
+#include <stddef.h>
+
+#define SHAPER_BURST_MS 200    /* a bucket saves up at most this many ms of its rate */
+#define SHAPER_MAX_USERS 64    /* users that get a bucket of their own */
+#define SHAPER_MAX_NAME 32
+
+struct token_bucket {
+  long long rate;    /* bytes per second, 0 for no limit */
+  long long tokens;  /* bytes that may be sent now, negative after a burst */
+  long long last;    /* monotonic time (ms) tokens were last added */
+};
+
+/* Rates of the three levels, in bytes per second (0 for no limit) */
+struct shaper_rates {
+  long long global;
+  long long user;     /* of every user, unless set for one with shaper_set_rate */
+  long long session;  /* of new sessions */
+};
+
+void shaper_init(const struct shaper_rates *rates);
+void bucket_init(struct token_bucket *b, long long rate);
+struct token_bucket *shaper_user_bucket(const char *user);
+void shaper_set_rate(struct token_bucket *b, long long rate);
+void shaper_set_global_rate(long long rate);
+void shaper_get_rates(struct token_bucket *user, struct shaper_rates *rates);
+int shaper_limited(const struct token_bucket *session);
+long long shaper_charge(struct token_bucket *session, struct token_bucket *user, size_t bytes);
+
+#endif
@@ -0,0 +1,127 @@
+/* strbuf.c
+ * Growable byte buffer used to stage data before it is sent on a socket.
+ */
+
+#include "strbuf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define SB_MIN_CAPACITY 256
+
+/** Initializes an empty buffer. No memory is allocated until data is
+ *  added to it.
+ */
+void sb_init(struct strbuf *sb) {
+  sb->data = NULL;
+  sb->off  = 0;
+  sb->len  = 0;
+  sb->cap  = 0;
+}
+
+/** Releases the memory held by the buffer and leaves it empty.
+ */
+void sb_free(struct strbuf *sb) {
+  free(sb->data);
+  sb_init(sb);
+}
+
+/** Discards all the data in the buffer, keeping the allocated memory
+ *  for later use.
+ */
+void sb_reset(struct strbuf *sb) {
+  sb->off = 0;
+  sb->len = 0;
+}
+
+/** Makes sure there is room for at least extra more bytes after the
+ *  end of the pending data. Consumed bytes at the front are reclaimed
+ *  before the buffer is grown.
+ *
+ *  Returns: 0 on success, -1 if memory could not be allocated.
+ */
+int sb_reserve(struct strbuf *sb, size_t extra) {
+
+  if (sb->off && sb->off == sb->len)
+    sb_reset(sb);
+
+  if (sb->len + extra <= sb->cap)
+    return 0;
+
+  // Slide the pending bytes to the front if that makes enough room
+  if (sb->off && sb_pending(sb) + extra <= sb->cap) {
+    memmove(sb->data, sb->data + sb->off, sb_pending(sb));
+    sb->len -= sb->off;
+    sb->off  = 0;
+    return 0;
+  }
+
+  size_t cap = sb->cap ? sb->cap : SB_MIN_CAPACITY;
+  while (cap < sb->len + extra)
+    cap *= 2;
+
+  char *data = realloc(sb->data, cap);
+  if (!data)
+    return -1;
+  sb->data = data;
+  sb->cap  = cap;
+  return 0;
+}
+
+/** Appends size bytes of data to the end of the buffer.
+ *
+ *  Returns: 0 on success, -1 if memory could not be allocated.
+ */
+int sb_append(struct strbuf *sb, const void *data, size_t size) {
+
+  if (sb_reserve(sb, size) < 0)
+    return -1;
+  memcpy(sb->data + sb->len, data, size);
+  sb->len += size;
+  return 0;
+}
+
+/** Appends a printf-like formatted string to the end of the
+ *  buffer. The terminating null byte is not counted as pending data.
+ *
+ *  Returns: the number of bytes appended, or -1 on error.
+ */
+int sb_printf(struct strbuf *sb, const char *fmt, ...) {
+
+  va_list args;
+  int size;
+  size_t room = SB_MIN_CAPACITY;
+
+  while (1) {
+    if (sb_reserve(sb, room) < 0)
+      return -1;
+
+    va_start(args, fmt);
+    size = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, args);
+    va_end(args);
+
+    if (size < 0)
+      return -1;
+
+    // If there was enough room for the entire string, keep it
+    if ((size_t) size < sb->cap - sb->len) {
+      sb->len += size;
+      return size;
+    }
+
+    // Try again with more space
+    room = size + 1;
+  }
+}
+
+/** Marks the first size pending bytes of the buffer as consumed.
+ */
+void sb_consume(struct strbuf *sb, size_t size) {
+
+  if (size >= sb_pending(sb))
+    sb_reset(sb);
+  else
+    sb->off += size;
+}
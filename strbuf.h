@@ -0,0 +1,38 @@
+/* strbuf.h
+ * Growable byte buffer used to stage data before it is sent on a socket.
+ */
+
+#ifndef _STRBUF_H_
+#define _STRBUF_H_
+
+#include <stddef.h>
+
+/* Bytes in the range [off, len) of data are pending; everything
+ * before off has already been consumed. */
+struct strbuf {
+  char   *data;
+  size_t  off;
+  size_t  len;
+  size_t  cap;
+};
+
+void sb_init(struct strbuf *sb);
+void sb_free(struct strbuf *sb);
+void sb_reset(struct strbuf *sb);
+int sb_reserve(struct strbuf *sb, size_t extra);
+int sb_append(struct strbuf *sb, const void *data, size_t size);
+int sb_printf(struct strbuf *sb, const char *fmt, ...)
+  __attribute__ ((format(printf, 2, 3)));
+void sb_consume(struct strbuf *sb, size_t size);
+
+/* Number of bytes that are still pending in the buffer. */
+static inline size_t sb_pending(const struct strbuf *sb) {
+  return sb->len - sb->off;
+}
+
+/* Pointer to the first pending byte in the buffer. */
+static inline char *sb_head(const struct strbuf *sb) {
+  return sb->data + sb->off;
+}
+
+#endif
@@ -0,0 +1,256 @@
+/* trace.c
+ * Tracing of sampled sessions (see trace.h).
+ *
+ * Every worker puts the spans of its traced sessions in a ring of its
+ * own (see ring.h) and a background thread writes them out as JSON, so
+ * a traced session never waits for the file; spans that find the ring
+ * full are dropped and counted. The file is a JSON array of events
+ * whose closing bracket is only written at exit: the trace event
+ * format allows it to be missing, so the trace of a server that was
+ * killed can be opened too.
+ */
+
+#include "trace.h"
+#include "ring.h"
+#include "session.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TRACE_OUT_SIZE (64 * 1024)
+#define TRACE_EVENT_MAX 1024
+
+int trace_every;
+
+static struct ring *rings;
+static __thread struct ring *thread_ring;
+
+static int trace_fd = -1;
+static uint64_t trace_start;            /* the 0 of the timestamps */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static char out[TRACE_OUT_SIZE];        /* events, under drain_lock */
+static size_t out_used;
+static int events;                      /* events written so far */
+static unsigned char named[MAX_WORKERS]; /* workers whose track has a name */
+
+/** Returns 1 if the session with that id is to be traced.
+ */
+int trace_sample(uint64_t session) {
+  return trace_every && session % trace_every == 0;
+}
+
+/** Records a span of a traced session, from start to now, in the ring
+ *  of the calling worker. Called through trace_end().
+ */
+void trace_write(struct session *s, uint64_t start, const char *cat, const char *name,
+                 long long bytes, const char *detail) {
+
+  struct trace_span *span;
+  uint64_t now = metrics_now_ns();
+
+  if (!thread_ring &&
+      !(thread_ring = ring_create(&rings, TRACE_RING_SPANS, sizeof(struct trace_span),
+                                  s->worker->id)))
+    return;
+  if ((span = ring_reserve(thread_ring)) == NULL)
+    return;
+  span->start   = start;
+  span->dur     = now - start;
+  span->session = s->id;
+  span->bytes   = bytes;
+  span->cat     = cat;
+  span->name    = name;
+  span->worker  = s->worker->id;
+  if (detail)
+    snprintf(span->detail, sizeof(span->detail), "%s", detail);
+  else
+    span->detail[0] = '\0';
+  ring_commit(thread_ring);
+}
+
+/** Names the track of a traced session after its id and the address
+ *  of the client.
+ */
+void trace_session(struct session *s, const char *peer) {
+  trace_write(s, metrics_now_ns(), "session", NULL, -1, peer);
+}
+
+/** Returns the spans dropped so far because a ring was full.
+ */
+uint64_t trace_dropped(void) {
+
+  struct ring *r;
+  uint64_t n = 0;
+
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  return n;
+}
+
+/** Writes out the formatted events.
+ */
+static void out_flush(void) {
+
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < out_used) {
+    n = write(trace_fd, out + done, out_used - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
+  out_used = 0;
+}
+
+/** Appends text to out as the contents of a JSON string. Bytes outside
+ *  of printable ASCII are escaped, so that a file name that is not
+ *  UTF-8 cannot break the file.
+ */
+static void out_string(const char *text) {
+
+  const unsigned char *c;
+
+  for (c = (const unsigned char *) text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      out[out_used++] = '\\';
+      out[out_used++] = *c;
+    } else if (*c < 0x20 || *c >= 0x7f) {
+      out_used += sprintf(out + out_used, "\\u%04x", *c);
+    } else {
+      out[out_used++] = *c;
+    }
+  }
+}
+
+/** Starts a new event at the end of out.
+ */
+static void out_event(const char *fmt, ...) __attribute__ ((format(printf, 1, 2)));
+
+static void out_event(const char *fmt, ...) {
+
+  va_list args;
+
+  if (TRACE_OUT_SIZE - out_used < TRACE_EVENT_MAX)
+    out_flush();
+  out_used += sprintf(out + out_used, events++ ? ",\n" : "[\n");
+  va_start(args, fmt);
+  out_used += vsnprintf(out + out_used, TRACE_EVENT_MAX / 2, fmt, args);
+  va_end(args);
+}
+
+/** Formats one span as a trace event: a complete ("X") event on the
+ *  track of its session, or the name of that track.
+ */
+static void out_span(const struct trace_span *span) {
+
+  if (span->worker >= 0 && span->worker < MAX_WORKERS && !named[span->worker]) {
+    out_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+              "\"args\":{\"name\":\"worker %d\"}}", span->worker, span->worker);
+    named[span->worker] = 1;
+  }
+
+  if (!span->name) {
+    out_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%llu,"
+              "\"args\":{\"name\":\"session %llu ", span->worker,
+              (unsigned long long) span->session, (unsigned long long) span->session);
+    out_string(span->detail);
+    out_used += sprintf(out + out_used, "\"}}");
+    return;
+  }
+
+  out_event("{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%llu,\"args\":{", span->name, span->cat,
+            (span->start - trace_start) / 1000.0, span->dur / 1000.0,
+            span->worker, (unsigned long long) span->session);
+  if (span->bytes >= 0)
+    out_used += sprintf(out + out_used, "\"bytes\":%lld%s", (long long) span->bytes,
+                        span->detail[0] ? "," : "");
+  if (span->detail[0]) {
+    out_used += sprintf(out + out_used, "\"detail\":\"");
+    out_string(span->detail);
+    out[out_used++] = '"';
+  }
+  out_used += sprintf(out + out_used, "}}");
+}
+
+/** Writes out every span waiting in the rings.
+ *
+ *  Returns: the number of spans written.
+ */
+static int trace_drain(void) {
+
+  const struct trace_span *span;
+  struct ring *r;
+  int n = 0;
+
+  pthread_mutex_lock(&drain_lock);
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    while ((span = ring_peek(r)) != NULL) {
+      out_span(span);
+      ring_release(r);
+      n++;
+    }
+  }
+  out_flush();
+  pthread_mutex_unlock(&drain_lock);
+  return n;
+}
+
+/** Writes the last spans and closes the array of events at exit.
+ */
+static void trace_close(void) {
+  trace_drain();
+  pthread_mutex_lock(&drain_lock);
+  out_used += sprintf(out + out_used, events ? "\n]\n" : "[]\n");
+  out_flush();
+  pthread_mutex_unlock(&drain_lock);
+}
+
+/** The background thread: writes the spans every TRACE_FLUSH_MS.
+ */
+static void *trace_main(void *arg) {
+
+  struct timespec ts = { 0, TRACE_FLUSH_MS * 1000000L };
+
+  while (1) {
+    if (trace_drain() == 0)
+      nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+/** Starts tracing one session in every into the file at path, which is
+ *  replaced.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int trace_init(const char *path, int every) {
+
+  pthread_t thread;
+
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd == -1) {
+    fprintf(stderr, "trace: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  trace_start = metrics_now_ns();
+  if (pthread_create(&thread, NULL, trace_main, NULL) != 0) {
+    fprintf(stderr, "trace: cannot start the trace thread\n");
+    return -1;
+  }
+  pthread_detach(thread);
+  atexit(trace_close);
+  trace_every = every;
+  return 0;
+}
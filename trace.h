@@ -0,0 +1,53 @@
+/* trace.h
+ * Opt-in tracing of a sample of the sessions into a file in the Chrome
+ * trace event format, which chrome://tracing and ui.perfetto.dev show
+ * as a timeline: one track per session, grouped by worker. A traced
+ * session records a span for every command, the wait for each data
+ * connection, the files and directories it opens or stats, every chunk
+ * of its transfers and each transfer as a whole. Sessions that are not
+ * traced only pay for a test of s->traced.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "metrics.h"
+
+#include <stdint.h>
+
+#define TRACE_RING_SPANS 4096  /* spans a worker may have waiting, a power of two */
+#define TRACE_SPAN_SIZE 128
+#define TRACE_FLUSH_MS 50      /* how often the background thread writes the spans */
+
+/* A span as the worker leaves it, turned into JSON later */
+struct trace_span {
+  uint64_t    start;     /* metrics_now_ns() */
+  uint64_t    dur;       /* ns */
+  uint64_t    session;
+  int64_t     bytes;     /* -1 for none */
+  const char *cat;       /* string constants */
+  const char *name;      /* NULL for the name of the session's track */
+  int32_t     worker;
+  char        detail[TRACE_SPAN_SIZE - 52]; /* a path, for instance */
+};
+
+struct session;
+
+extern int trace_every;  /* one session in trace_every is traced, 0 for none */
+
+int trace_init(const char *path, int every);
+int trace_sample(uint64_t session);
+void trace_session(struct session *s, const char *peer);
+void trace_write(struct session *s, uint64_t start, const char *cat, const char *name,
+                 long long bytes, const char *detail);
+uint64_t trace_dropped(void);
+
+/* Start of a span of session s, 0 if it is not traced */
+#define trace_now(s) ((s)->traced ? metrics_now_ns() : 0)
+
+/* Records a span of session s from start, returned by trace_now(), to
+   now; bytes is -1 and detail NULL if there are none */
+#define trace_end(s, start, cat, name, bytes, detail) \
+  do { if (start) trace_write(s, start, cat, name, bytes, detail); } while (0)
+
+#endif
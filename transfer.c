@@ -0,0 +1,1017 @@
+/* transfer.c
+ * Passive mode data connections and the non-blocking transfers that
+ * run on them. A transfer is driven by the event loop: every time the
+ * data connection becomes writable, another part of the data is sent,
+ * so a large transfer never holds back the other sessions.
+ */
+
+#include "transfer.h"
+#include "session.h"
+#include "uring.h"
+#include "zmode.h"
+#include "ascii.h"
+#include "filecache.h"
+#include "portpool.h"
+#include "shaper.h"
+#include "sched.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+/* Fixes a problem in OSX that it does not define MSG_NOSIGNAL */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0x2000 /* don't raise SIGPIPE */
+#endif
+
+#define BACKLOG 5           // how many pending connections queue will hold
+#define PUMP_CHUNKS 4       // chunks sent per writable event before yielding to other sessions
+
+size_t transfer_chunk_size = DEFAULT_CHUNK_SIZE;
+
+static void handle_data_accept(struct watcher *w, uint32_t events);
+static void handle_data(struct watcher *w, uint32_t events);
+static void unthrottle(struct session *s);
+static void count_bytes(struct session *s);
+
+/* Names of the spans of whole transfers, by source */
+static const char *source_names[] = {
+  "none", "send file", "send cached", "send listing", "receive"
+};
+
+/** Initializes an empty transfer.
+ */
+void transfer_init(struct transfer *x) {
+  x->source  = XFER_NONE;
+  x->method  = XFER_SENDFILE;
+  x->file_fd = -1;
+  x->cache   = NULL;
+  x->dir.fd  = -1;
+  x->dir.buf = NULL;
+  x->mlsd    = 0;
+  x->facts   = 0;
+  x->offset  = 0;
+  x->pipe[0] = x->pipe[1] = -1;
+  x->piped   = 0;
+  x->slot    = -1;
+  x->preallocated = 0;
+  x->ascii   = 0;
+  x->cr_pending = 0;
+  x->bytes   = 0;
+  x->started = x->rate_time = 0;
+  x->trace_start = 0;
+  x->rate_bytes = 0;
+  x->rate    = -1;
+  x->counted = 0;
+  sb_init(&x->buf);
+  x->z       = NULL;
+  x->z_level = -1;
+  x->z_deflate = x->z_finish = x->z_done = 0;
+  sb_init(&x->zin);
+}
+
+/** Releases the resources of the session's transfer and leaves it
+ *  empty. Must be called while the data connection is still open.
+ */
+void transfer_reset(struct session *s) {
+  struct transfer *x = &s->xfer;
+
+  if (s->throttled)
+    unthrottle(s);
+  if (s->queued)
+    sched_remove(s);
+  if (x->started) {
+    struct worker_metrics *m = s->worker->metrics;
+    count_bytes(s);
+    metric_set(&m->transfers, m->transfers - 1);
+    trace_end(s, x->trace_start, "transfer", source_names[x->source], x->bytes, NULL);
+  }
+  if (x->method == XFER_URING)
+    uring_transfer_release(s);
+  if (x->file_fd >= 0) {
+    // give back the space ALLO reserved past the end of the upload
+    if (x->source == XFER_RECEIVE && x->preallocated)
+      ftruncate(x->file_fd, x->offset);
+    close(x->file_fd);
+  }
+  if (x->cache)
+    filecache_put(x->cache);
+  if (x->dir.fd >= 0)
+    dir_close(&x->dir);
+  if (x->pipe[0] >= 0) {
+    close(x->pipe[0]);
+    close(x->pipe[1]);
+  }
+  zmode_end(x);
+  sb_free(&x->buf);
+  sb_free(&x->zin);
+  transfer_init(x);
+}
+
+/** Sends the reply to PASV for a socket listening on port at the
+ *  address the client reached the control connection on.
+ */
+static void reply_pasv(struct session *s, unsigned short port) {
+
+  unsigned char *ip = (unsigned char *) &s->local_addr.sin_addr;
+
+  log_msg(LOG_DEBUG, s->id, "datasocket: listening on %d", port);
+  session_reply(s, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\n",
+                ip[0], ip[1], ip[2], ip[3], port / 256, port % 256);
+}
+
+/*
+ *  create_data_socket(s)
+ *
+ *  Gets a socket for the data communication, starts listening on it
+ *  and sends the connection info to the client. With a port range
+ *  (see portpool.c), the socket is checked out of the worker's pool
+ *  of listening sockets; otherwise a new socket is bound to an
+ *  available port. The data connection itself is accepted by the event
+ *  loop.
+ *
+ *  Returns the listening file descriptor, or -1 on error.
+ */
+int create_data_socket(struct session *s) {
+
+  struct sockaddr_in data_sock_addr;
+  int sockfd;
+  int yes = 1;
+
+  s->pasv_start = trace_now(s);
+  if (s->worker->ports) {
+    struct port_pool *p = s->worker->ports;
+    if ((s->pasv_port = portpool_get(p, s)) == NULL) {
+      log_msg(LOG_WARN, s->id, "datasocket: every port of the range is in use");
+      metric_add(&s->worker->metrics->pasv_refused, 1);
+      return -1;
+    }
+    metric_set(&s->worker->metrics->pasv_in_use, p->count - p->free);
+    reply_pasv(s, s->pasv_port->port);
+    return s->pasv_port->w.fd;
+  }
+
+  if ((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+    log_perror(s->id, "datasocket: socket");
+    return -1;
+  }
+
+  memset(&data_sock_addr, 0, sizeof data_sock_addr);
+  data_sock_addr.sin_family = AF_INET;  // use ipv4
+  data_sock_addr.sin_port = 0;  // to get a random available dynamic port
+  data_sock_addr.sin_addr.s_addr = INADDR_ANY;
+
+  // specify that, once the program finishes, the port can be reused by other processes
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+    log_perror(s->id, "datasocket: setsockopt");
+    close(sockfd);
+    return -1;
+  }
+
+  // bind to the specified port number
+  if (bind(sockfd, (struct sockaddr *) &data_sock_addr, sizeof(data_sock_addr)) == -1) {
+    log_perror(s->id, "datasocket: bind");
+    close(sockfd);
+    return -1;
+  }
+
+  // get the port information after bind to data connection socket
+  struct sockaddr_in my_addr_port;
+  socklen_t addrlen = sizeof(my_addr_port);
+  if (getsockname(sockfd, (struct sockaddr *) &my_addr_port, &addrlen) == -1) {
+    close(sockfd);
+    return -1;
+  }
+  unsigned short port = ntohs(my_addr_port.sin_port);
+
+  if (listen(sockfd, BACKLOG) == -1) {
+    log_perror(s->id, "datasocket: listen");
+    close(sockfd);
+    return -1;
+  }
+
+  s->pasv.handler = handle_data_accept;
+  if (watcher_add(s->worker, &s->pasv, sockfd, EPOLLIN) == -1) {
+    close(sockfd);
+    return -1;
+  }
+
+  reply_pasv(s, port);
+  return sockfd;
+}
+
+/** Stops listening for the session's data connection: the listening
+ *  socket is closed, or given back to the pool it came from.
+ */
+static void release_pasv(struct session *s) {
+  watcher_close(s->worker, &s->pasv);
+  if (s->pasv_port) {
+    struct port_pool *p = s->worker->ports;
+    portpool_put(p, s->pasv_port);
+    s->pasv_port = NULL;
+    metric_set(&s->worker->metrics->pasv_in_use, p->count - p->free);
+  }
+}
+
+/*
+ *  close_data_con_resources(s)
+ *
+ *  Closes the sockets that are used for opening and maintaining
+ *  data connection. Usually called after completing a passive connection
+ *  or after an error when opening a data connection or during a data
+ *  exchange over the data connection. Resets passive_mode back to 0.
+ */
+void close_data_con_resources(struct session *s) {
+  s->passive_mode = 0;
+  release_pasv(s);
+  watcher_close(s->worker, &s->data);
+}
+
+/** Ends the current transfer, closes the data connection, sends the
+ *  final reply and lets the session take new commands again.
+ */
+void transfer_finish(struct session *s, const char *reply) {
+
+  transfer_reset(s);
+  close_data_con_resources(s);
+  s->state    = SESSION_IDLE;
+  s->deadline = 0;
+  // sent together with the replies of the commands waiting behind it
+  s->batch++;
+  session_reply(s, "%s", reply);
+  s->batch--;
+  session_resume(s);
+}
+
+/** Starts sending the data of the current transfer, or waits for the
+ *  client to open the data connection if it has not done so yet.
+ */
+static void transfer_begin(struct session *s) {
+
+  struct transfer *x = &s->xfer;
+
+  if (s->mode_z && !x->z) {
+    if (zmode_start(x, x->source != XFER_RECEIVE,
+                    x->z_level >= 0 ? x->z_level : s->z_level) == -1) {
+      transfer_finish(s, "451 Requested action aborted. Local error in processing.\r\n");
+      return;
+    }
+  }
+
+  if (s->data.fd >= 0) {
+    s->state = SESSION_TRANSFER;
+    x->started = x->rate_time = now_ms();
+    x->trace_start = trace_now(s);
+    metric_add(&s->worker->metrics->transfers, 1);
+    metric_add(&s->worker->metrics->transfers_total, 1);
+    if (x->source == XFER_RECEIVE)
+      watcher_set(s->worker, &s->data, EPOLLIN);
+    else if (x->z || x->ascii || shaper_limited(&s->shape) || uring_transfer_start(s) == -1)
+      watcher_set(s->worker, &s->data, EPOLLOUT);
+  } else if (s->pasv.fd >= 0 || s->pasv_port) {
+    s->state    = SESSION_WAIT_DATA;
+    s->deadline = now_ms() + DATA_ACCEPT_TIMEOUT;
+  } else {
+    transfer_finish(s, "425 No connection was established.\r\n");
+    return;
+  }
+  session_update_events(s);
+}
+
+/** Starts sending the contents of an open file on the data
+ *  connection, starting at offset. The transfer owns fd from now on.
+ *  In TYPE A the file is converted, so it has to be read into memory.
+ */
+void transfer_start_file(struct session *s, int fd, off_t offset) {
+  s->xfer.source  = XFER_FILE;
+  s->xfer.ascii   = s->type_ascii;
+  s->xfer.method  = s->type_ascii ? XFER_READ : XFER_SENDFILE;
+  s->xfer.file_fd = fd;
+  s->xfer.offset  = offset;
+  transfer_begin(s);
+}
+
+/** Starts sending cached file contents or a cached listing on the
+ *  data connection, starting at offset. The transfer owns the reference to e from now
+ *  on.
+ */
+void transfer_start_cached(struct session *s, struct cache_entry *e, off_t offset) {
+  s->xfer.source  = XFER_CACHE;
+  s->xfer.ascii   = s->type_ascii && !e->listing;  // listings already end lines with CRLF
+  s->xfer.method  = XFER_READ;
+  s->xfer.cache   = e;
+  s->xfer.offset  = offset;
+  transfer_begin(s);
+}
+
+/** Starts storing the data received on the data connection in an
+ *  open file, starting at offset. The transfer owns fd from now on.
+ */
+void transfer_start_receive(struct session *s, int fd, off_t offset) {
+  s->xfer.source  = XFER_RECEIVE;
+  s->xfer.ascii   = s->type_ascii;
+  s->xfer.method  = s->type_ascii ? XFER_READ : XFER_SPLICE;
+  s->xfer.file_fd = fd;
+  s->xfer.offset  = offset;
+  transfer_begin(s);
+}
+
+/** Starts sending the listing (MLSD lines if mlsd is set, NLST lines
+ *  otherwise) of the directory already opened in the transfer's dir
+ *  reader. The lines are rendered a chunk at a time as the data
+ *  connection takes them, so the memory used does not depend on the
+ *  size of the directory.
+ */
+void transfer_start_listing(struct session *s, int mlsd, unsigned int facts) {
+  s->xfer.source = XFER_LISTING;
+  s->xfer.method = XFER_READ;
+  s->xfer.mlsd   = mlsd;
+  s->xfer.facts  = facts;
+  transfer_begin(s);
+}
+
+/** Gives up on a transfer whose data connection did not arrive in
+ *  time.
+ */
+void transfer_expire(struct session *s) {
+  transfer_finish(s, "425 No connection was established.\r\n");
+}
+
+/** Cancels the transfer in progress for ABOR: the data connection is
+ *  closed, whatever is still in flight is dropped, and the session
+ *  takes new commands again. As RFC 959 asks, the transfer is answered
+ *  with 426 before the 226 to the ABOR itself.
+ */
+void transfer_abort(struct session *s) {
+
+  transfer_reset(s);
+  close_data_con_resources(s);
+  s->state    = SESSION_IDLE;
+  s->deadline = 0;
+  session_reply(s, "426 Connection closed; transfer aborted.\r\n");
+  session_reply(s, "226 Abort successful.\r\n");
+}
+
+/** Adds the bytes the transfer moved since they were last counted to
+ *  the worker's metrics. The pumps only count the bytes of their own
+ *  transfer; they are added up here about once a second, and when the
+ *  transfer ends.
+ */
+static void count_bytes(struct session *s) {
+
+  struct transfer *x = &s->xfer;
+  struct worker_metrics *m = s->worker->metrics;
+
+  metric_add(x->source == XFER_RECEIVE ? &m->bytes_received : &m->bytes_sent,
+             x->bytes - x->counted);
+  x->counted = x->bytes;
+}
+
+/** Takes a sample of the rate of the transfer in progress, which
+ *  STAT reports, and counts its bytes in the metrics. Called by the
+ *  worker about once a second.
+ */
+void transfer_sample_rate(struct session *s, long long now) {
+
+  struct transfer *x = &s->xfer;
+
+  count_bytes(s);
+  if (now <= x->rate_time)
+    return;
+  x->rate       = (double) (x->bytes - x->rate_bytes) * 1000 / (now - x->rate_time);
+  x->rate_bytes = x->bytes;
+  x->rate_time  = now;
+}
+
+/** Reads the next chunk of the file (or of its cached contents) at
+ *  the current offset and appends it to sb, with CRLF line endings if
+ *  the transfer is in TYPE A. For XFER_LISTING the next lines of the
+ *  listing are rendered instead.
+ *
+ *  Returns: the bytes read from the file, 0 at its end, -1 on error.
+ */
+ssize_t transfer_read_file(struct transfer *x, struct strbuf *sb) {
+
+  size_t room = x->ascii ? 2 * transfer_chunk_size : transfer_chunk_size;
+  char *in;
+  ssize_t rv;
+
+  if (x->source == XFER_LISTING)
+    return x->mlsd ? mlsd_render(&x->dir, sb, x->facts, transfer_chunk_size)
+                   : list_render(&x->dir, sb, transfer_chunk_size);
+
+  if (sb_reserve(sb, room) == -1)
+    return -1;
+
+  // in TYPE A the chunk is read into the upper half of the room and
+  // expanded from there to the front, which never overtakes the input
+  in = sb->data + sb->len + room - transfer_chunk_size;
+  if (x->cache) {
+    rv = x->offset < x->cache->size ? x->cache->size - x->offset : 0;
+    if (rv > (ssize_t) transfer_chunk_size)
+      rv = transfer_chunk_size;
+    memcpy(in, x->cache->data + x->offset, rv);
+  } else {
+    do {
+      rv = pread(x->file_fd, in, transfer_chunk_size, x->offset);
+    } while (rv == -1 && errno == EINTR);
+  }
+  if (rv <= 0)
+    return rv;
+
+  x->offset += rv;
+  sb->len   += x->ascii ? ascii_to_crlf(sb->data + sb->len, in, rv) : (size_t) rv;
+  return rv;
+}
+
+/** Writes size bytes to the file at the current offset.
+ */
+static int write_all(struct transfer *x, const char *data, size_t size) {
+
+  ssize_t rv;
+
+  while (size > 0) {
+    rv = pwrite(x->file_fd, data, size, x->offset);
+    if (rv == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data      += rv;
+    size      -= rv;
+    x->offset += rv;
+  }
+  return 0;
+}
+
+/** Writes n bytes received on the data connection to the file at the
+ *  current offset, with LF line endings if the transfer is in TYPE A
+ *  (data is converted in place). A call with n 0 marks the end of the
+ *  data.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int transfer_write_file(struct transfer *x, char *data, size_t n) {
+
+  size_t used, size;
+
+  if (x->ascii) {
+    // a CR that ended the last call is only dropped if a LF follows it
+    if (x->cr_pending) {
+      x->cr_pending = 0;
+      if ((n == 0 || data[0] != '\n') && write_all(x, "\r", 1) == -1)
+        return -1;
+    }
+    if (n == 0)
+      return 0;
+    size = ascii_from_crlf(data, data, n, &used);
+    x->cr_pending = used < n;
+    n = size;
+  }
+  return write_all(x, data, n);
+}
+
+/* Outcome of a single step of a transfer */
+enum pump_result {
+  PUMP_AGAIN,     /* some data was moved, the transfer can continue */
+  PUMP_BLOCKED,   /* the data connection would block */
+  PUMP_DONE,      /* everything was sent */
+  PUMP_FALLBACK,  /* the method is not supported for these descriptors */
+  PUMP_FAILED     /* the transfer failed; errno is set */
+};
+
+/** Moves the next chunk of the file, at most max bytes, straight from
+ *  the page cache to the socket with sendfile, without copying it to
+ *  user space.
+ */
+static int pump_sendfile(struct session *s, size_t max) {
+
+  struct transfer *x = &s->xfer;
+  ssize_t rv = sendfile(s->data.fd, x->file_fd, &x->offset, max);
+
+  if (rv > 0) {
+    x->bytes += rv;
+    return PUMP_AGAIN;
+  }
+  if (rv == 0)
+    return PUMP_DONE;
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    return PUMP_BLOCKED;
+  if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+    return PUMP_FALLBACK;
+  return PUMP_FAILED;
+}
+
+/** Moves the next chunk of the file, at most max bytes, to the socket
+ *  through a pipe with splice. Used when sendfile does not support the
+ *  file. Bytes that the socket did not take yet stay in the pipe for
+ *  the next call.
+ */
+static int pump_splice(struct session *s, size_t max) {
+
+  struct transfer *x = &s->xfer;
+  ssize_t rv;
+
+  if (x->pipe[0] < 0) {
+    if (pipe2(x->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+      return PUMP_FALLBACK;
+    fcntl(x->pipe[1], F_SETPIPE_SZ, (int) transfer_chunk_size);
+  }
+
+  if (x->piped == 0) {
+    rv = splice(x->file_fd, &x->offset, x->pipe[1], NULL, max,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv == 0)
+      return PUMP_DONE;
+    if (rv == -1) {
+      if (errno == EINVAL || errno == ENOSYS)
+        return PUMP_FALLBACK;
+      if (errno == EAGAIN || errno == EINTR)
+        return PUMP_AGAIN;
+      return PUMP_FAILED;
+    }
+    x->piped = rv;
+  }
+
+  rv = splice(x->pipe[0], NULL, s->data.fd, NULL, x->piped < max ? x->piped : max,
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rv == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PUMP_BLOCKED;
+    return PUMP_FAILED;
+  }
+  x->piped -= rv;
+  x->bytes += rv;
+  return PUMP_AGAIN;
+}
+
+/** Reads the next chunk of the file into the transfer's buffer and
+ *  sends at most max bytes of it. Used when neither sendfile nor splice
+ *  can be used, and for TYPE A.
+ */
+static int pump_read(struct session *s, size_t max) {
+
+  struct transfer *x = &s->xfer;
+  ssize_t rv;
+
+  if (!sb_pending(&x->buf)) {
+    rv = transfer_read_file(x, &x->buf);
+    if (rv == 0)
+      return PUMP_DONE;
+    if (rv == -1)
+      return PUMP_FAILED;
+  }
+
+  rv = send(s->data.fd, sb_head(&x->buf), sb_pending(&x->buf) < max ? sb_pending(&x->buf) : max,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (rv == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PUMP_BLOCKED;
+    return PUMP_FAILED;
+  }
+  sb_consume(&x->buf, rv);
+  x->bytes += rv;
+  return PUMP_AGAIN;
+}
+
+/** Sends the next chunk of cached file contents, at most max bytes,
+ *  straight from the cache.
+ */
+static int pump_cache(struct session *s, size_t max) {
+
+  struct transfer *x = &s->xfer;
+  size_t size;
+  ssize_t rv;
+
+  if (x->offset >= x->cache->size)
+    return PUMP_DONE;
+  size = x->cache->size - x->offset;
+  if (size > max)
+    size = max;
+
+  rv = send(s->data.fd, x->cache->data + x->offset, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (rv == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PUMP_BLOCKED;
+    return PUMP_FAILED;
+  }
+  x->offset += rv;
+  x->bytes  += rv;
+  return PUMP_AGAIN;
+}
+
+/** Writes n bytes that are waiting in the transfer's pipe to the
+ *  file, at the current offset.
+ */
+static int drain_pipe_to_file(struct transfer *x, size_t n) {
+
+  while (n > 0) {
+    ssize_t rv = splice(x->pipe[0], NULL, x->file_fd, &x->offset, n, SPLICE_F_MOVE);
+    if (rv == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    n -= rv;
+  }
+  return 0;
+}
+
+/** Moves the next chunk of data received on the socket to the file
+ *  through a pipe with splice, so it never passes through user space.
+ */
+static int pump_receive_splice(struct session *s) {
+
+  struct transfer *x = &s->xfer;
+  ssize_t rv;
+
+  if (x->pipe[0] < 0) {
+    if (pipe2(x->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+      return PUMP_FALLBACK;
+    fcntl(x->pipe[1], F_SETPIPE_SZ, (int) transfer_chunk_size);
+  }
+
+  rv = splice(s->data.fd, NULL, x->pipe[1], NULL, transfer_chunk_size,
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rv == 0)
+    return PUMP_DONE;
+  if (rv == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PUMP_BLOCKED;
+    if (errno == EINVAL || errno == ENOSYS)
+      return PUMP_FALLBACK;
+    return PUMP_FAILED;
+  }
+
+  x->bytes += rv;
+  return drain_pipe_to_file(x, rv) == -1 ? PUMP_FAILED : PUMP_AGAIN;
+}
+
+/** Receives the next chunk of data into the transfer's buffer and
+ *  writes it to the file. Used when splice cannot be used, and for
+ *  TYPE A.
+ */
+static int pump_receive_read(struct session *s) {
+
+  struct transfer *x = &s->xfer;
+  ssize_t rv;
+
+  if (sb_reserve(&x->buf, transfer_chunk_size) == -1)
+    return PUMP_FAILED;
+  rv = recv(s->data.fd, x->buf.data + x->buf.len, transfer_chunk_size, MSG_DONTWAIT);
+  if (rv == 0)
+    return transfer_write_file(x, NULL, 0) == -1 ? PUMP_FAILED : PUMP_DONE;
+  if (rv == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PUMP_BLOCKED;
+    return PUMP_FAILED;
+  }
+
+  x->bytes += rv;
+  rv = transfer_write_file(x, x->buf.data + x->buf.len, rv);
+  sb_reset(&x->buf);
+  return rv == -1 ? PUMP_FAILED : PUMP_AGAIN;
+}
+
+/** Sends the next part of the compressed stream of a MODE Z
+ *  transfer, at most max bytes, compressing more data once the previous
+ *  part was sent.
+ */
+static int pump_deflate(struct session *s, size_t max) {
+
+  struct transfer *x = &s->xfer;
+  ssize_t rv;
+
+  if (!sb_pending(&x->buf)) {
+    if (x->z_done)
+      return PUMP_DONE;
+    if (zmode_deflate(x) == -1)
+      return PUMP_FAILED;
+  }
+
+  rv = send(s->data.fd, sb_head(&x->buf), sb_pending(&x->buf) < max ? sb_pending(&x->buf) : max,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (rv == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PUMP_BLOCKED;
+    return PUMP_FAILED;
+  }
+  sb_consume(&x->buf, rv);
+  x->bytes += rv;
+  return PUMP_AGAIN;
+}
+
+/** Receives the next chunk of the compressed stream of a MODE Z
+ *  upload and writes the inflated data to the file.
+ */
+static int pump_inflate(struct session *s) {
+
+  struct transfer *x = &s->xfer;
+  ssize_t rv;
+
+  if (sb_reserve(&x->zin, transfer_chunk_size) == -1)
+    return PUMP_FAILED;
+  rv = recv(s->data.fd, x->zin.data + x->zin.len, transfer_chunk_size, MSG_DONTWAIT);
+  if (rv == 0) {
+    if (x->z_done)
+      return transfer_write_file(x, NULL, 0) == -1 ? PUMP_FAILED : PUMP_DONE;
+    errno = EBADMSG;  // the stream was cut short
+    return PUMP_FAILED;
+  }
+  if (rv == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PUMP_BLOCKED;
+    return PUMP_FAILED;
+  }
+  x->zin.len += rv;
+  x->bytes   += rv;
+
+  return zmode_inflate(x) == -1 ? PUMP_FAILED : PUMP_AGAIN;
+}
+
+/** Runs one step of the transfer with the best method available for
+ *  it, falling back from sendfile to splice to plain reads when a
+ *  method turns out not to be supported. At most max bytes are sent;
+ *  a step of an upload receives up to a chunk.
+ */
+static int pump_step(struct session *s, size_t max) {
+
+  struct transfer *x = &s->xfer;
+  int rv;
+
+  if (x->z)
+    return x->z_deflate ? pump_deflate(s, max) : pump_inflate(s);
+
+  if (x->source == XFER_CACHE)
+    return x->ascii ? pump_read(s, max) : pump_cache(s, max);
+
+  if (x->source == XFER_LISTING)
+    return pump_read(s, max);
+
+  if (x->source == XFER_RECEIVE) {
+    if (x->method == XFER_SPLICE) {
+      rv = pump_receive_splice(s);
+      if (rv != PUMP_FALLBACK)
+        return rv;
+      x->method = XFER_READ;
+    }
+    return pump_receive_read(s);
+  }
+
+  while (1) {
+    switch (x->method) {
+    case XFER_SENDFILE: rv = pump_sendfile(s, max); break;
+    case XFER_SPLICE:   rv = pump_splice(s, max);   break;
+    default:            return pump_read(s, max);
+    }
+    if (rv != PUMP_FALLBACK)
+      return rv;
+    x->method++;
+  }
+}
+
+/** Takes a session out of the worker's list of throttled sessions.
+ */
+static void unthrottle(struct session *s) {
+
+  struct worker *w = s->worker;
+
+  if (s->throttle_prev)
+    s->throttle_prev->throttle_next = s->throttle_next;
+  else
+    w->throttled = s->throttle_next;
+  if (s->throttle_next)
+    s->throttle_next->throttle_prev = s->throttle_prev;
+  s->throttle_prev = s->throttle_next = NULL;
+  s->throttled = 0;
+}
+
+/** Stops sending the data of a transfer that used up its tokens for
+ *  delay ms. The data connection is left out of the event loop until
+ *  then, and the worker's timer takes the transfer up again (see
+ *  transfer_wake). Also called by the io_uring backend, whose
+ *  transfers are not in the event loop in the first place.
+ */
+void transfer_throttle(struct session *s, long long delay) {
+
+  struct worker *w = s->worker;
+
+  watcher_set(w, &s->data, 0);
+  s->wake = now_ms() + delay;
+  if (!s->throttled) {
+    s->throttled = 1;
+    s->throttle_next = w->throttled;
+    if (w->throttled)
+      w->throttled->throttle_prev = s;
+    w->throttled = s;
+  }
+  if (s->wake < w->next_wake)
+    w->next_wake = s->wake;
+}
+
+/** Takes up the throttled transfers of the worker whose wait is over,
+ *  and finds out when the next one is.
+ */
+void transfer_wake(struct worker *w) {
+
+  long long now = now_ms();
+  struct session *s, *next;
+
+  w->next_wake = LLONG_MAX;
+  for (s = w->throttled; s; s = next) {
+    next = s->throttle_next;
+    if (s->wake <= now) {
+      unthrottle(s);
+      if (s->xfer.method == XFER_URING)
+        uring_transfer_resume(s);
+      else
+        watcher_set(w, &s->data, EPOLLOUT);
+    } else if (s->wake < w->next_wake) {
+      w->next_wake = s->wake;
+    }
+  }
+}
+
+/** Ends the transfer after a step that completed or failed.
+ */
+static void pump_end(struct session *s, int rv) {
+
+  if (rv == PUMP_DONE)
+    transfer_finish(s, "226 Closing data connection. Requested file action successful.\r\n");
+  else if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN)
+    transfer_finish(s, "426 Connection failure.\r\n");
+  else if (errno == ENOSPC || errno == EDQUOT)
+    transfer_finish(s, "452 Requested action not taken. Insufficient storage space.\r\n");
+  else
+    transfer_finish(s, "451 Requested action aborted. Local error in processing.\r\n");
+}
+
+/** Receives the data of an upload until the socket has no more, the
+ *  transfer is complete or the session has used up its share of this
+ *  event. Uploads are not shaped.
+ */
+static void transfer_pump(struct session *s) {
+
+  uint64_t start;
+  off_t received;
+  int chunks, rv;
+
+  for (chunks = 0; chunks < PUMP_CHUNKS; chunks++) {
+    start    = trace_now(s);
+    received = s->xfer.bytes;
+    rv = pump_step(s, transfer_chunk_size);
+    trace_end(s, start, "transfer", "chunk", s->xfer.bytes - received, NULL);
+    if (rv == PUMP_BLOCKED)
+      return;  // wait until the socket is ready again
+    if (rv != PUMP_AGAIN) {
+      pump_end(s, rv);
+      return;
+    }
+  }
+}
+
+/** Sends the data of the transfer until budget bytes have been sent,
+ *  the socket would block or the transfer is complete. The bytes sent
+ *  are taken from budget, which may end up below zero by less than a
+ *  chunk, and charged to the session's token buckets; the transfer
+ *  waits when they run out (see shaper.c).
+ *
+ *  Returns: 1 if the transfer could send more right away, 0 if it
+ *           waits for the socket or for tokens, or if it ended.
+ */
+int transfer_send(struct session *s, long long *budget) {
+
+  struct transfer *x = &s->xfer;
+  long long delay;
+  uint64_t start;
+  size_t max;
+  off_t sent;
+  int rv;
+
+  while (*budget > 0) {
+    if ((delay = shaper_charge(&s->shape, s->user_shape, 0)) > 0) {
+      transfer_throttle(s, delay);
+      return 0;
+    }
+    max  = *budget < (long long) transfer_chunk_size ? (size_t) *budget : transfer_chunk_size;
+    sent  = x->bytes;
+    start = trace_now(s);
+    rv    = pump_step(s, max);
+    trace_end(s, start, "transfer", "chunk", x->bytes - sent, NULL);
+    if (x->bytes > sent) {
+      *budget -= x->bytes - sent;
+      shaper_charge(&s->shape, s->user_shape, x->bytes - sent);
+    }
+
+    if (rv == PUMP_BLOCKED) {
+      watcher_set(s->worker, &s->data, EPOLLOUT);  // wait until the socket is ready again
+      return 0;
+    }
+    if (rv != PUMP_AGAIN) {
+      pump_end(s, rv);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** Event handler for the passive mode listening socket. Accepts the
+ *  data connection and starts the pending transfer, if any.
+ */
+static void handle_data_accept(struct watcher *w, uint32_t events) {
+  transfer_accept_data(w->arg, w->fd);
+}
+
+/** Accepts the data connection of session s on its passive mode
+ *  listening socket listen_fd. Only a connection from the host of the
+ *  control connection is taken; connections from anywhere else are
+ *  closed, so that nobody else can steal or inject the data of a
+ *  transfer by connecting to the port first.
+ */
+void transfer_accept_data(struct session *s, int listen_fd) {
+
+  struct sockaddr_in peer;
+  socklen_t peer_len;
+  int new_fd;
+
+  if (s->state == SESSION_CLOSING || listen_fd < 0)
+    return;
+
+  while (1) {
+    peer_len = sizeof(peer);
+    new_fd = accept4(listen_fd, (struct sockaddr *) &peer, &peer_len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new_fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return;
+      log_perror(s->id, "datasocket: accept");
+      if (s->state == SESSION_WAIT_DATA)
+        transfer_finish(s, "426 Connection failure.\r\n");
+      return;
+    }
+    if (peer.sin_family == AF_INET &&
+        peer.sin_addr.s_addr == s->peer_addr.sin_addr.s_addr)
+      break;
+    log_msg(LOG_WARN, s->id, "datasocket: refused a data connection from another host");
+    close(new_fd);
+  }
+
+  // only one data connection is accepted per PASV
+  release_pasv(s);
+  trace_end(s, s->pasv_start, "data", "accept", -1, NULL);
+  s->pasv_start = 0;
+
+  s->data.handler = handle_data;
+  if (watcher_add(s->worker, &s->data, new_fd, 0) == -1) {
+    close(new_fd);
+    if (s->state == SESSION_WAIT_DATA)
+      transfer_finish(s, "426 Connection failure.\r\n");
+    return;
+  }
+
+  if (s->state == SESSION_WAIT_DATA)
+    transfer_begin(s);
+}
+
+/** Event handler for the data connection.
+ */
+static void handle_data(struct watcher *w, uint32_t events) {
+
+  struct session *s = w->arg;
+
+  if (s->state == SESSION_CLOSING || w->fd < 0)
+    return;
+
+  if (s->state != SESSION_TRANSFER) {
+    // the client dropped the data connection before it was used
+    if (events & (EPOLLHUP | EPOLLERR))
+      close_data_con_resources(s);
+    return;
+  }
+
+  if (events & EPOLLERR) {
+    transfer_finish(s, "426 Connection failure.\r\n");
+    return;
+  }
+
+  if (s->xfer.source == XFER_RECEIVE) {
+    transfer_pump(s);
+  } else if (s->xfer.method != XFER_URING) {
+    // the data is sent when the worker's scheduler gets to the session
+    // (see sched.c); until then, the socket being writable is not news
+    watcher_set(s->worker, &s->data, 0);
+    sched_enqueue(s);
+  }
+}
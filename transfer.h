@@ -0,0 +1,97 @@
+/* transfer.h
+ * Passive mode data connections and the non-blocking transfers that
+ * run on them.
+ */
+
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "strbuf.h"
+#include "dir.h"
+
+#define DATA_ACCEPT_TIMEOUT 15000 /* ms to wait for the client to open the data connection */
+#define DEFAULT_CHUNK_SIZE (256 * 1024) /* bytes moved per step of a file transfer */
+#define MIN_CHUNK_SIZE 4096
+#define MAX_CHUNK_SIZE (64 * 1024 * 1024)
+
+enum transfer_source {
+  XFER_NONE,
+  XFER_FILE,    /* file_fd from offset up to its end */
+  XFER_CACHE,   /* cached file contents (see filecache.c) from offset up to their end */
+  XFER_LISTING, /* lines of the directory read by dir, rendered as they are sent */
+  XFER_RECEIVE  /* data received on the connection, written to file_fd from offset */
+};
+
+/* How file data is moved to the data connection, from the cheapest
+ * to the most expensive. A transfer starts with sendfile and moves
+ * down the list if the kernel rejects a method for its descriptors. */
+enum transfer_method {
+  XFER_SENDFILE,  /* sendfile(2) from the file to the socket */
+  XFER_SPLICE,    /* splice(2) from the file to a pipe and then to the socket */
+  XFER_READ,      /* pread into buf and send */
+  XFER_URING      /* registered buffers on the worker's io_uring (see uring.c) */
+};
+
+struct transfer {
+  int            source;
+  int            method;
+  int            file_fd;
+  struct cache_entry *cache; /* cached contents sent by XFER_CACHE */
+  struct dir_reader dir;   /* directory listed by XFER_LISTING */
+  int            mlsd;     /* XFER_LISTING renders MLSD lines rather than NLST lines */
+  unsigned int   facts;    /* MLSX_* facts of the MLSD lines */
+  off_t          offset;   /* next byte of the file to be sent */
+  int            pipe[2];  /* pipe used by XFER_SPLICE */
+  size_t         piped;    /* bytes in the pipe not sent yet */
+  int            slot;     /* ring slot used by XFER_URING */
+  int            preallocated; /* file space was reserved with fallocate */
+  int            ascii;    /* TYPE A: LF in the file is CRLF on the connection */
+  int            cr_pending; /* TYPE A upload: a received CR has not been written yet */
+  off_t          bytes;    /* bytes moved on the data connection */
+  long long      started;  /* monotonic time (ms) the data connection was ready */
+  uint64_t       trace_start; /* start of the span of a traced transfer (see trace.h) */
+  long long      rate_time;  /* time (ms) of the last rate sample, see transfer_sample_rate */
+  off_t          rate_bytes; /* bytes at the last rate sample */
+  double         rate;     /* bytes/s between the last two samples, -1 before the first */
+  off_t          counted;  /* bytes already added to the worker's metrics */
+  struct strbuf  buf;
+
+  /* MODE Z state (see zmode.c); z is NULL when the data is not compressed */
+  struct z_stream_s *z;
+  int            z_level;   /* deflate level for this transfer, -1 for the session's */
+  int            z_deflate; /* 1 if z deflates outgoing data, 0 if it inflates incoming data */
+  int            z_finish;  /* all the input has been given to deflate */
+  int            z_done;    /* the end of the compressed stream was reached */
+  struct strbuf  zin;       /* data waiting to be deflated or inflated */
+};
+
+extern size_t transfer_chunk_size;
+
+struct session;
+struct worker;
+struct cache_entry;
+struct z_stream_s;
+
+void transfer_init(struct transfer *x);
+void transfer_reset(struct session *s);
+
+int create_data_socket(struct session *s);
+void close_data_con_resources(struct session *s);
+ssize_t transfer_read_file(struct transfer *x, struct strbuf *sb);
+int transfer_write_file(struct transfer *x, char *data, size_t n);
+void transfer_start_file(struct session *s, int fd, off_t offset);
+void transfer_start_cached(struct session *s, struct cache_entry *e, off_t offset);
+void transfer_start_receive(struct session *s, int fd, off_t offset);
+void transfer_start_listing(struct session *s, int mlsd, unsigned int facts);
+void transfer_finish(struct session *s, const char *reply);
+void transfer_expire(struct session *s);
+void transfer_abort(struct session *s);
+void transfer_sample_rate(struct session *s, long long now);
+void transfer_throttle(struct session *s, long long delay);
+void transfer_wake(struct worker *w);
+int transfer_send(struct session *s, long long *budget);
+void transfer_accept_data(struct session *s, int listen_fd);
+
+#endif
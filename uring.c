@@ -0,0 +1,510 @@
+/* uring.c
+ * Optional io_uring backend for file transfers. The ring is driven
+ * directly through the io_uring system calls, so no extra library is
+ * needed; if the kernel does not support io_uring (or it is disabled)
+ * the workers keep using the sendfile path in transfer.c.
+ *
+ * Every transfer that runs on the ring takes one of URING_SLOTS
+ * slots. Slot i owns registered buffer i and the registered file
+ * table entries 2i (the file) and 2i+1 (the data connection). Each
+ * step of the transfer is a READ_FIXED of the next chunk of the file
+ * linked to a WRITE_FIXED of the same buffer to the socket, so the
+ * data never leaves the registered buffer.
+ */
+
+#include "uring.h"
+#include "session.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES (URING_SLOTS * 4)
+
+/* Operation encoded in the low bits of a request's user_data */
+#define URING_READ  1
+#define URING_WRITE 2
+
+int uring_enabled = 0;
+
+struct uring_slot {
+  struct session *session;  /* NULL once the session gave up on the transfer */
+  int             in_use;
+  int             inflight; /* requests submitted but not completed yet */
+  char           *buf;
+  size_t          len;      /* bytes of buf holding file data */
+  size_t          sent;     /* bytes of buf already written to the socket */
+  off_t           size;     /* size of the file being sent */
+};
+
+struct uring {
+  struct worker        *worker;
+  int                   fd;
+  struct watcher        event;   /* eventfd signalled when requests complete */
+
+  unsigned             *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned             *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe  *sqes;
+  struct io_uring_cqe  *cqes;
+  unsigned              sq_entries;
+  unsigned              sq_local_tail;
+  unsigned              queued;  /* requests written to the ring but not submitted */
+
+  void                 *sq_ring, *cq_ring;
+  size_t                sq_ring_size, cq_ring_size;
+
+  char                 *buffers;
+  size_t                buf_size;
+  struct uring_slot     slots[URING_SLOTS];
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_complete(struct watcher *w, uint32_t events);
+
+/** Releases everything allocated for a ring. Works on partially
+ *  created rings.
+ */
+static void uring_destroy(struct uring *r) {
+  if (r->event.fd >= 0)
+    watcher_close(r->worker, &r->event);
+  if (r->sqes && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+  if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  if (r->sq_ring && r->sq_ring != MAP_FAILED)
+    munmap(r->sq_ring, r->sq_ring_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r->buffers);
+  free(r);
+}
+
+/** Creates the ring of a worker, with URING_SLOTS registered buffers
+ *  of buffer_size bytes each.
+ *
+ *  Returns: the new ring, or NULL if io_uring cannot be used on this
+ *           system.
+ */
+struct uring *uring_create(struct worker *w, size_t buffer_size) {
+
+  struct io_uring_params p;
+  struct iovec iovs[URING_SLOTS];
+  int files[URING_SLOTS * 2];
+  int event_fd;
+  int i;
+
+  struct uring *r = calloc(1, sizeof(struct uring));
+  if (!r)
+    return NULL;
+  r->worker   = w;
+  r->fd       = -1;
+  r->buf_size = buffer_size < URING_MAX_BUFFER ? buffer_size : URING_MAX_BUFFER;
+  watcher_init(&r->event, uring_complete, r);
+
+  memset(&p, 0, sizeof(p));
+  r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+  if (r->fd < 0)
+    goto fail;
+
+  // map the submission and completion rings and the submission entries
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_size > r->sq_ring_size)
+      r->sq_ring_size = r->cq_ring_size;
+    r->cq_ring_size = r->sq_ring_size;
+  }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else {
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED)
+      goto fail;
+  }
+
+  r->sq_entries = p.sq_entries;
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  r->sq_head  = (unsigned *) ((char *) r->sq_ring + p.sq_off.head);
+  r->sq_tail  = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+  r->sq_mask  = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+  r->cq_head  = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+  r->cq_tail  = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+  r->cq_mask  = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+  r->sq_local_tail = *r->sq_tail;
+
+  // register one buffer per slot
+  if (posix_memalign((void **) &r->buffers, 4096, URING_SLOTS * r->buf_size) != 0) {
+    r->buffers = NULL;
+    goto fail;
+  }
+  for (i = 0; i < URING_SLOTS; i++) {
+    r->slots[i].buf  = r->buffers + i * r->buf_size;
+    iovs[i].iov_base = r->slots[i].buf;
+    iovs[i].iov_len  = r->buf_size;
+  }
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iovs, URING_SLOTS) < 0)
+    goto fail;
+
+  // register an empty file table; entries are filled in per transfer
+  for (i = 0; i < URING_SLOTS * 2; i++)
+    files[i] = -1;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_FILES, files, URING_SLOTS * 2) < 0)
+    goto fail;
+
+  // completions wake up the event loop through an eventfd
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0)
+    goto fail;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0 ||
+      watcher_add(w, &r->event, event_fd, EPOLLIN) == -1) {
+    close(event_fd);
+    goto fail;
+  }
+
+  return r;
+
+ fail:
+  log_perror(0, "io_uring not available, using sendfile");
+  uring_destroy(r);
+  return NULL;
+}
+
+/** Returns a cleared submission entry, or NULL if the ring is full.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned index;
+  struct io_uring_sqe *sqe;
+
+  if (r->sq_local_tail - head >= r->sq_entries) {
+    uring_submit(r);
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries)
+      return NULL;
+  }
+
+  index = r->sq_local_tail & *r->sq_mask;
+  sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  r->sq_local_tail++;
+  r->queued++;
+  return sqe;
+}
+
+/** Makes room for n more submission entries, submitting the queued
+ *  ones if needed.
+ *
+ *  Returns: 0 if n entries are free, -1 if the ring is still full.
+ */
+static int uring_reserve(struct uring *r, unsigned n) {
+  if (r->sq_entries - (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) < n)
+    uring_submit(r);
+  return r->sq_entries - (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) < n ? -1 : 0;
+}
+
+/** Submits every request queued since the last call with a single
+ *  system call. Called by the worker once per pass of its event loop,
+ *  so the requests of all the active transfers go in one batch.
+ */
+void uring_submit(struct uring *r) {
+
+  int rv;
+
+  if (!r || !r->queued)
+    return;
+
+  __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+  rv = sys_io_uring_enter(r->fd, r->queued, 0, 0);
+  if (rv < 0) {
+    if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+      log_perror(0, "io_uring_enter");
+    return;  // try again on the next pass
+  }
+  r->queued -= rv;
+}
+
+/** Queues the write of the unsent part of a slot's buffer to the data
+ *  connection.
+ */
+static int uring_queue_write(struct uring *r, int i, int flags) {
+
+  struct uring_slot *slot = &r->slots[i];
+  struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+  if (!sqe)
+    return -1;
+  sqe->opcode    = IORING_OP_WRITE_FIXED;
+  sqe->flags     = IOSQE_FIXED_FILE | flags;
+  sqe->fd        = 2 * i + 1;
+  sqe->addr      = (uintptr_t) (slot->buf + slot->sent);
+  sqe->len       = slot->len - slot->sent;
+  sqe->off       = 0;
+  sqe->buf_index = i;
+  sqe->user_data = ((uint64_t) i << 8) | URING_WRITE;
+  slot->inflight++;
+  return 0;
+}
+
+/** Queues the read of the next chunk of the file into the slot's
+ *  buffer, linked to the write of that chunk to the data connection.
+ */
+static int uring_queue_chunk(struct uring *r, int i) {
+
+  struct uring_slot *slot = &r->slots[i];
+  struct transfer *x = &slot->session->xfer;
+  off_t left = slot->size - x->offset;
+  struct io_uring_sqe *sqe;
+
+  // both requests must fit, or the link would be broken
+  if (uring_reserve(r, 2) == -1)
+    return -1;
+
+  slot->len  = left < (off_t) r->buf_size ? (size_t) left : r->buf_size;
+  slot->sent = 0;
+
+  sqe = uring_get_sqe(r);
+  if (!sqe)
+    return -1;
+  sqe->opcode    = IORING_OP_READ_FIXED;
+  sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+  sqe->fd        = 2 * i;
+  sqe->addr      = (uintptr_t) slot->buf;
+  sqe->len       = slot->len;
+  sqe->off       = x->offset;
+  sqe->buf_index = i;
+  sqe->user_data = ((uint64_t) i << 8) | URING_READ;
+  slot->inflight++;
+
+  return uring_queue_write(r, i, 0);
+}
+
+/** Points the registered file table entries of slot i to the given
+ *  file and socket (or clears them when both are -1).
+ */
+static int uring_set_files(struct uring *r, int i, int file_fd, int sock_fd) {
+
+  int fds[2] = { file_fd, sock_fd };
+  struct io_uring_files_update update;
+
+  memset(&update, 0, sizeof(update));
+  update.offset = 2 * i;
+  update.fds    = (uintptr_t) fds;
+  return sys_io_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &update, 2) == 2 ? 0 : -1;
+}
+
+/** Returns a slot to the free list once it has no requests in flight.
+ */
+static void uring_slot_free(struct uring *r, int i) {
+  uring_set_files(r, i, -1, -1);
+  r->slots[i].in_use = 0;
+}
+
+/** Sends the file of the session's current transfer through the
+ *  worker's ring. The data connection is taken out of the event loop
+ *  and put in blocking mode: io_uring polls it internally, so no
+ *  thread is ever parked on it.
+ *
+ *  Returns: 0 if the transfer was started on the ring, -1 if it must
+ *           use the regular path instead.
+ */
+int uring_transfer_start(struct session *s) {
+
+  struct uring *r = s->worker->ring;
+  struct transfer *x = &s->xfer;
+  struct uring_slot *slot;
+  struct stat st;
+  uint32_t events;
+  int i, flags, method;
+
+  if (!r || x->source != XFER_FILE)
+    return -1;
+  if (fstat(x->file_fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= x->offset)
+    return -1;
+
+  for (i = 0; i < URING_SLOTS && r->slots[i].in_use; i++)
+    ;
+  if (i == URING_SLOTS)
+    return -1;
+  // the first chunk must be queued before the session leaves the
+  // event loop, or a full ring would leave it with neither
+  if (uring_reserve(r, 2) == -1 || uring_set_files(r, i, x->file_fd, s->data.fd) == -1)
+    return -1;
+
+  events = s->data.events;
+  method = x->method;
+  watcher_detach(s->worker, &s->data);
+  flags = fcntl(s->data.fd, F_GETFL);
+  fcntl(s->data.fd, F_SETFL, flags & ~O_NONBLOCK);
+
+  slot = &r->slots[i];
+  slot->session  = s;
+  slot->in_use   = 1;
+  slot->inflight = 0;
+  slot->size     = st.st_size;
+  x->method      = XFER_URING;
+  x->slot        = i;
+
+  if (uring_queue_chunk(r, i) == -1) {
+    // cannot happen after the reservation, but never leave the
+    // session without a way to finish: give it back to the event loop
+    slot->session = NULL;
+    if (!slot->inflight)
+      uring_slot_free(r, i);
+    fcntl(s->data.fd, F_SETFL, flags);
+    watcher_add(s->worker, &s->data, s->data.fd, events);
+    x->method = method;
+    return -1;
+  }
+  return 0;
+}
+
+/** Queues the next chunk of a transfer that waited for tokens (see
+ *  transfer_throttle).
+ */
+void uring_transfer_resume(struct session *s) {
+  if (uring_queue_chunk(s->worker->ring, s->xfer.slot) == -1)
+    transfer_finish(s, "451 Requested action aborted. Local error in processing.\r\n");
+}
+
+/** Detaches the session from its ring slot when its transfer ends or
+ *  is abandoned. If requests are still in flight, the data connection
+ *  is shut down so that they complete quickly, and the slot is freed
+ *  when their completions arrive.
+ */
+void uring_transfer_release(struct session *s) {
+
+  struct uring *r = s->worker->ring;
+  struct uring_slot *slot = &r->slots[s->xfer.slot];
+
+  slot->session = NULL;
+  if (slot->inflight) {
+    if (s->data.fd >= 0)
+      shutdown(s->data.fd, SHUT_RDWR);
+  } else
+    uring_slot_free(r, s->xfer.slot);
+}
+
+/** Handles the completion of a single request.
+ */
+static void uring_handle(struct uring *r, uint64_t user_data, int res) {
+
+  int i = user_data >> 8;
+  struct uring_slot *slot = &r->slots[i];
+  struct session *s = slot->session;
+  struct transfer *x;
+  long long delay;
+
+  slot->inflight--;
+  if (!s) {
+    if (!slot->inflight)
+      uring_slot_free(r, i);
+    return;
+  }
+  x = &s->xfer;
+
+  if ((user_data & 0xff) == URING_READ) {
+    if (res < 0) {
+      // the linked write is cancelled and completes on its own
+      errno = -res;
+      transfer_finish(s, "451 Requested action aborted. Local error in processing.\r\n");
+      return;
+    }
+    // a short read breaks the link; the write is resubmitted below
+    slot->len  = res;
+    x->offset += res;
+    return;
+  }
+
+  if (res == -ECANCELED) {
+    // the file was shorter than expected
+    if (slot->len == 0)
+      transfer_finish(s, "226 Closing data connection. Requested file action successful.\r\n");
+    else if (uring_queue_write(r, i, 0) == -1)
+      transfer_finish(s, "451 Requested action aborted. Local error in processing.\r\n");
+    return;
+  }
+  if (res < 0) {
+    errno = -res;
+    transfer_finish(s, "426 Connection failure.\r\n");
+    return;
+  }
+
+  slot->sent += res;
+  x->bytes   += res;
+  // charged like the steps of the other methods; a limit set while the
+  // transfer runs holds back its next chunk
+  delay = shaper_charge(&s->shape, s->user_shape, res);
+  if (slot->sent < slot->len) {
+    if (uring_queue_write(r, i, 0) == -1)
+      transfer_finish(s, "451 Requested action aborted. Local error in processing.\r\n");
+  } else if (x->offset >= slot->size) {
+    transfer_finish(s, "226 Closing data connection. Requested file action successful.\r\n");
+  } else if (delay > 0) {
+    transfer_throttle(s, delay);
+  } else if (uring_queue_chunk(r, i) == -1) {
+    transfer_finish(s, "451 Requested action aborted. Local error in processing.\r\n");
+  }
+}
+
+/** Event handler for the ring's eventfd. Reaps every completion that
+ *  is available.
+ */
+static void uring_complete(struct watcher *w, uint32_t events) {
+
+  struct uring *r = w->arg;
+  uint64_t count;
+  unsigned head, tail;
+
+  if (read(w->fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    log_perror(0, "io_uring eventfd");
+
+  head = *r->cq_head;
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+
+    head++;
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    uring_handle(r, user_data, res);
+  }
+}
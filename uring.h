@@ -0,0 +1,30 @@
+/* uring.h
+ * Optional io_uring backend for file transfers. Each worker owns a
+ * ring with registered buffers and a registered file table; every
+ * transfer that uses the ring reads the file into a registered buffer
+ * and writes it to the data connection with linked requests, and the
+ * requests of all the transfers of the worker are submitted together
+ * once per pass of the event loop.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+
+#define URING_SLOTS 32                   /* transfers a ring can run at the same time */
+#define URING_MAX_BUFFER (1024 * 1024)   /* largest registered buffer per transfer */
+
+struct worker;
+struct session;
+struct uring;
+
+extern int uring_enabled;
+
+struct uring *uring_create(struct worker *w, size_t buffer_size);
+void uring_submit(struct uring *r);
+int uring_transfer_start(struct session *s);
+void uring_transfer_resume(struct session *s);
+void uring_transfer_release(struct session *s);
+
+#endif
@@ -7,7 +7,32 @@
 // Given the name of the program print out usage instructions. */
 void usage(char *progName) {
 
-  fprintf(stderr, "Usage: %s <port>\n", progName);
+  fprintf(stderr, "Usage: %s [-w <workers>] [-c <bytes>] [-m <MiB>] [-u] [-p <first>-<last>]\n"
+          "       [-r <global>[,<user>[,<session>]]] [-W <user>=<weight>,...]\n"
+          "       [-l <level>] [-L <file>] [-T <file> [-s <n>]] <port>\n", progName);
   fprintf(stderr, "     <port>   Specifies the port the server will accept connections on.\n");
   fprintf(stderr, "              The port value must >= 1024 and <= 65535.\n");
+  fprintf(stderr, "     -w       Number of worker threads, each with its own listening\n");
+  fprintf(stderr, "              socket and event loop. 0 uses one worker per core.\n");
+  fprintf(stderr, "              Defaults to 1.\n");
+  fprintf(stderr, "     -c       Bytes moved per step of a file transfer, between 4096\n");
+  fprintf(stderr, "              and 67108864. Defaults to 262144.\n");
+  fprintf(stderr, "     -m       MiB of memory for caching small files. 0 disables the\n");
+  fprintf(stderr, "              cache. Defaults to 64.\n");
+  fprintf(stderr, "     -u       Send files through io_uring when the kernel supports it.\n");
+  fprintf(stderr, "     -p       Range of ports for passive mode data connections, such\n");
+  fprintf(stderr, "              as 50000-50999, bound when the server starts. Defaults\n");
+  fprintf(stderr, "              to a new ephemeral port for every PASV.\n");
+  fprintf(stderr, "     -r       Limits in KiB/s of the data sent by the whole server, by\n");
+  fprintf(stderr, "              each user and by each session. 0 is no limit, the\n");
+  fprintf(stderr, "              default. SITE RATE changes them while the server runs.\n");
+  fprintf(stderr, "     -W       Weights of the transfers of users, between 1 and 64,\n");
+  fprintf(stderr, "              when they share the bandwidth of a worker. Defaults\n");
+  fprintf(stderr, "              to 1; SITE WEIGHT changes it for a session.\n");
+  fprintf(stderr, "     -l       Level of the messages logged: error, warn, info or\n");
+  fprintf(stderr, "              debug. Defaults to info.\n");
+  fprintf(stderr, "     -L       File the log is appended to. Defaults to stderr.\n");
+  fprintf(stderr, "     -T       File a trace of the sessions is written to, in the\n");
+  fprintf(stderr, "              Chrome trace event format (see ui.perfetto.dev).\n");
+  fprintf(stderr, "     -s       Trace one session in n. Defaults to 1, every session.\n");
 }
@@ -0,0 +1,202 @@
+/* zmode.c
+ * MODE Z (deflate transmission mode) for data connections. The
+ * compressed stream is produced and consumed one chunk at a time, so
+ * a compressed transfer is driven by the event loop exactly like a
+ * plain one.
+ */
+
+#include "zmode.h"
+#include "transfer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define ZMODE_MAX_ENTROPY 7.5 /* bits per byte above which a sample is taken as compressed */
+
+/* Extensions of formats that are already compressed; deflating them
+ * again costs CPU and gains nothing. */
+static const char *compressed_exts[] = {
+  "gz", "tgz", "bz2", "tbz", "xz", "txz", "lz", "lz4", "lzma", "zst", "br", "z",
+  "zip", "jar", "apk", "7z", "rar", "cab", "deb", "rpm",
+  "jpg", "jpeg", "png", "gif", "webp", "heic",
+  "mp3", "aac", "ogg", "opus", "flac", "m4a",
+  "mp4", "m4v", "mkv", "webm", "avi", "mov",
+  "pdf", "docx", "xlsx", "pptx", "odt", "ods",
+  NULL
+};
+
+/** Prepares the transfer to deflate the data it sends (deflating is
+ *  not 0) or to inflate the data it receives. Level is the deflate
+ *  level, from 0 (stored, no compression) to 9.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int zmode_start(struct transfer *x, int deflating, int level) {
+
+  z_stream *z = calloc(1, sizeof(z_stream));
+  int rv;
+
+  if (!z)
+    return -1;
+
+  rv = deflating ? deflateInit(z, level) : inflateInit(z);
+  if (rv != Z_OK) {
+    free(z);
+    errno = rv == Z_MEM_ERROR ? ENOMEM : EINVAL;
+    return -1;
+  }
+
+  x->z         = z;
+  x->z_deflate = deflating;
+  x->z_finish  = 0;
+  x->z_done    = 0;
+  return 0;
+}
+
+/** Releases the zlib state of the transfer.
+ */
+void zmode_end(struct transfer *x) {
+  if (!x->z)
+    return;
+  if (x->z_deflate)
+    deflateEnd(x->z);
+  else
+    inflateEnd(x->z);
+  free(x->z);
+  x->z = NULL;
+}
+
+/** Compresses the next part of the transfer's data into its buffer,
+ *  which must have nothing pending. File data is read at the current
+ *  offset as needed (see transfer_read_file); other data must be
+ *  waiting in the zin buffer.
+ *  Sets z_done once the end of the stream has been produced.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int zmode_deflate(struct transfer *x) {
+
+  z_stream *z = x->z;
+  ssize_t n;
+  int rv;
+
+  sb_reset(&x->buf);
+  if (sb_reserve(&x->buf, transfer_chunk_size) == -1)
+    return -1;
+
+  while (!x->z_done && x->buf.len == 0) {
+    if (!sb_pending(&x->zin) && !x->z_finish) {
+      sb_reset(&x->zin);
+      n = transfer_read_file(x, &x->zin);
+      if (n == -1)
+        return -1;
+      if (n == 0)
+        x->z_finish = 1;
+    }
+
+    z->next_in   = (Bytef *) sb_head(&x->zin);
+    z->avail_in  = sb_pending(&x->zin);
+    z->next_out  = (Bytef *) x->buf.data;
+    z->avail_out = x->buf.cap;
+
+    rv = deflate(z, x->z_finish ? Z_FINISH : Z_NO_FLUSH);
+    if (rv == Z_STREAM_ERROR) {
+      errno = EINVAL;
+      return -1;
+    }
+    sb_consume(&x->zin, sb_pending(&x->zin) - z->avail_in);
+    x->buf.len = x->buf.cap - z->avail_out;
+    if (rv == Z_STREAM_END)
+      x->z_done = 1;
+  }
+  return 0;
+}
+
+/** Inflates the compressed data waiting in the transfer's zin buffer
+ *  and writes it to the file (see transfer_write_file). Data received
+ *  after the end of the stream is ignored.
+ *
+ *  Returns: 0 on success, -1 on error (errno is EBADMSG if the client
+ *           sent a corrupt stream).
+ */
+int zmode_inflate(struct transfer *x) {
+
+  z_stream *z = x->z;
+  int rv;
+
+  if (sb_reserve(&x->buf, transfer_chunk_size) == -1)
+    return -1;
+
+  while (sb_pending(&x->zin) && !x->z_done) {
+    z->next_in   = (Bytef *) sb_head(&x->zin);
+    z->avail_in  = sb_pending(&x->zin);
+    z->next_out  = (Bytef *) x->buf.data;
+    z->avail_out = x->buf.cap;
+
+    rv = inflate(z, Z_NO_FLUSH);
+    if (rv != Z_OK && rv != Z_STREAM_END && rv != Z_BUF_ERROR) {
+      errno = rv == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+      return -1;
+    }
+    sb_consume(&x->zin, sb_pending(&x->zin) - z->avail_in);
+    x->buf.off = 0;
+    x->buf.len = x->buf.cap - z->avail_out;
+    if (rv == Z_STREAM_END)
+      x->z_done = 1;
+
+    if (transfer_write_file(x, x->buf.data, x->buf.len) == -1)
+      return -1;
+  }
+  sb_reset(&x->zin);
+  return 0;
+}
+
+/** Returns 1 if the file at path looks already compressed, either by
+ *  its extension or because the sample of its first bytes in data has
+ *  close to 8 bits of entropy per byte, 0 otherwise.
+ */
+int zmode_precompressed_data(const char *path, const void *data, size_t size) {
+
+  const unsigned char *sample = data;
+  size_t counts[256];
+  const char *ext = strrchr(path, '.');
+  double entropy = 0;
+  size_t i;
+
+  if (ext && !strchr(ext, '/')) {
+    for (i = 0; compressed_exts[i]; i++)
+      if (!strcasecmp(ext + 1, compressed_exts[i]))
+        return 1;
+  }
+
+  if (size > ZMODE_PROBE_SIZE)
+    size = ZMODE_PROBE_SIZE;
+  if (size < 512)
+    return 0;  // too small to tell, and too small to matter
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < size; i++)
+    counts[sample[i]]++;
+  for (i = 0; i < 256; i++) {
+    if (counts[i]) {
+      double p = (double) counts[i] / size;
+      entropy -= p * log2(p);
+    }
+  }
+  return entropy > ZMODE_MAX_ENTROPY;
+}
+
+/** Same as zmode_precompressed_data(), sampling the file open on fd.
+ */
+int zmode_precompressed(const char *path, int fd) {
+
+  unsigned char sample[ZMODE_PROBE_SIZE];
+  ssize_t n = pread(fd, sample, sizeof(sample), 0);
+
+  return zmode_precompressed_data(path, sample, n > 0 ? n : 0);
+}
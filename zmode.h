@@ -0,0 +1,25 @@
+/* zmode.h
+ * MODE Z (deflate transmission mode) for data connections. Data sent
+ * to the client is compressed with zlib as it is read from the file
+ * or listing; data received from the client is inflated before it is
+ * written to the file.
+ */
+
+#ifndef _ZMODE_H_
+#define _ZMODE_H_
+
+#include <stddef.h>
+
+#define ZMODE_DEFAULT_LEVEL 6 /* deflate level used until OPTS MODE Z LEVEL changes it */
+#define ZMODE_PROBE_SIZE 4096 /* bytes of a file sampled to guess if it is compressed */
+
+struct transfer;
+
+int zmode_start(struct transfer *x, int deflating, int level);
+void zmode_end(struct transfer *x);
+int zmode_deflate(struct transfer *x);
+int zmode_inflate(struct transfer *x);
+int zmode_precompressed(const char *path, int fd);
+int zmode_precompressed_data(const char *path, const void *data, size_t size);
+
+#endif